@@ -0,0 +1,195 @@
+#ifndef BENCH_HH
+#define BENCH_HH
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <RaptorQ.hpp>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "common.hh"
+#include "report.hh"
+
+/**
+ * Shared by the benchmarks of the codec: the sweep of configurations given
+ * on the command line, test data cut into segments and encoded the way the
+ * sender does it. Each configuration and run makes a row of a Report.
+ */
+
+/**
+ * Configurations to run: every combination of the values given.
+ */
+struct BenchOptions {
+    /**
+     * Sizes of the data to encode, in bytes.
+     */
+    std::vector<uint64_t> fileSizes;
+
+    /**
+     * Number of symbols per block asked of makeEncoder(); the segments of
+     * the data hold BLOCKS_PER_SEGMENT blocks of that many symbols, as
+     * SEGMENT_SIZE does for SYMBOLS_PER_BLOCK.
+     */
+    std::vector<int> symbolsPerBlock;
+
+    /**
+     * Fractions of the symbols lost on the way to the decoder.
+     */
+    std::vector<double> lossRates;
+
+    /**
+     * Number of times each configuration is run.
+     */
+    int runs;
+
+    bool csv;
+
+    BenchOptions()
+        : fileSizes {1 << 20, 16 << 20, 64 << 20}
+        , symbolsPerBlock {SYMBOLS_PER_BLOCK, 256, 1024}
+        , lossRates {0, 0.05, 0.2}
+        , runs(1)
+        , csv(false)
+    {}
+};
+
+inline void
+printBenchUsage(char* command, bool lossRates)
+{
+    std::cerr << "Usage: " << command << " [-ch] [-s MB,...] [-k SYMBOLS,...]"
+              << (lossRates ? " [-l LOSS,...]" : "") << " [-n RUNS]"
+              << std::endl;
+    std::cerr << "\t-h: help" << std::endl;
+    std::cerr << "\t-c: CSV output instead of one JSON object per line" << std::endl;
+    std::cerr << "\t-s: sizes of the data, in megabytes (default 1,16,64)" << std::endl;
+    std::cerr << "\t-k: symbols per block of the " << SEGMENT_SIZE
+              << "-byte segments (default " << SYMBOLS_PER_BLOCK
+              << ",256,1024)" << std::endl;
+    if (lossRates) {
+        std::cerr << "\t-l: fractions of the symbols lost (default 0,0.05,0.2)" << std::endl;
+    }
+    std::cerr << "\t-n: runs of each configuration (default 1)" << std::endl;
+}
+
+/**
+ * \param lossRates
+ *      Whether the benchmark takes -l.
+ * \return
+ *      0 on success, -1 if the arguments are wrong.
+ */
+inline int
+parseBenchArgs(int argc, char* argv[], bool lossRates, BenchOptions& options)
+{
+    int c;
+    while ((c = getopt(argc, argv, lossRates ? "cs:k:l:n:h" : "cs:k:n:h"))
+            != -1) {
+        bool ok = true;
+        switch (c) {
+            case 'c':
+                options.csv = true;
+                break;
+            case 's':
+                ok = parseList(optarg, 1 << 20, options.fileSizes);
+                break;
+            case 'k':
+                ok = parseList(optarg, 1, options.symbolsPerBlock);
+                break;
+            case 'l':
+                ok = parseList(optarg, 1, options.lossRates) &&
+                     *std::max_element(options.lossRates.begin(),
+                                       options.lossRates.end()) < 1;
+                break;
+            case 'n':
+                options.runs = std::atoi(optarg);
+                ok = options.runs > 0;
+                break;
+            default:
+                ok = false;
+        }
+        if (!ok) {
+            printBenchUsage(argv[0], lossRates);
+            return -1;
+        }
+    }
+    if (optind != argc) {
+        printBenchUsage(argv[0], lossRates);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Random data to encode, padded to whole alignments, with a fixed seed so
+ * that runs are comparable.
+ */
+inline std::vector<Alignment>
+randomData(uint64_t size)
+{
+    std::vector<Alignment> data((size + ALIGNMENT_SIZE - 1) / ALIGNMENT_SIZE);
+    std::mt19937 generator(1);
+    for (Alignment& word : data) {
+        word = generator();
+    }
+    return data;
+}
+
+/**
+ * A segment of the data and its encoder, as in the sender.
+ */
+struct BenchSegment {
+    std::unique_ptr<RaptorQEncoder> encoder;
+    Alignment* begin;
+    Alignment* end;
+};
+
+/**
+ * Cuts the data into segments of SEGMENT_SIZE bytes, as the sender's
+ * splitFile() does, and instantiates an encoder for each with blocks of at
+ * most the given number of symbols, as the sender does with the number
+ * EncoderPlanner picks.
+ *
+ * \return
+ *      The segments, or none if an encoder could not be instantiated, e.g.
+ *      because a segment would have more than MAX_BLOCKS blocks.
+ */
+inline std::vector<BenchSegment>
+makeSegments(std::vector<Alignment>& data, int symbolsPerBlock)
+{
+    const uint64_t alignmentsPerSegment = SEGMENT_SIZE / ALIGNMENT_SIZE;
+    std::vector<BenchSegment> segments;
+    Alignment* begin = data.data();
+    Alignment* end = data.data() + data.size();
+    do {
+        Alignment* segmentEnd = uint64_t(end - begin) > alignmentsPerSegment ?
+                begin + alignmentsPerSegment : end;
+        std::unique_ptr<RaptorQEncoder> encoder =
+                makeEncoder(begin, segmentEnd, symbolsPerBlock);
+        if (!encoder) {
+            return {};
+        }
+        segments.push_back({std::move(encoder), begin, segmentEnd});
+        begin = segmentEnd;
+    } while (begin < end);
+    return segments;
+}
+
+/**
+ * Computes the intermediate symbols of a block, as the sender's
+ * PrecomputePool does: the encoder has no call for a single block, but
+ * computes them on the first repair symbol.
+ */
+inline void
+precomputeBlock(RaptorQEncoder& encoder, uint8_t sbn)
+{
+    RaptorQSymbol symbol;
+    Alignment* begin = symbol.data();
+    encoder.encode(begin, symbol.data() + symbol.size(),
+                   encoder.symbols(sbn), sbn);
+}
+
+#endif /* BENCH_HH */
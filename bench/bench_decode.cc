@@ -0,0 +1,152 @@
+#include <cstring>
+
+#include "bench.hh"
+
+/**
+ * Measures the decoding side of a transfer, on one core: the symbols of
+ * each block go through a simulated lossy channel to a decoder, which is
+ * fed as the receiver's DecoderPool does (decode() after every symbol
+ * added), source symbols first then repair symbols until the block
+ * decodes. Only the time spent in the decoder is counted.
+ */
+
+/**
+ * A block that has not decoded after this many symbols received per source
+ * symbol is given up on.
+ */
+const int MAX_SYMBOLS_PER_SOURCE_SYMBOL = 4;
+
+void
+benchDecode(Report& report, uint64_t fileSize, int symbolsPerBlock,
+            double lossRate, int run)
+{
+    std::vector<Alignment> data = randomData(fileSize);
+    std::vector<BenchSegment> segments = makeSegments(data, symbolsPerBlock);
+    if (segments.empty()) {
+        std::cerr << "Unable to instantiate an encoder for " << fileSize
+                  << " bytes with " << symbolsPerBlock
+                  << " symbols per block" << std::endl;
+        return;
+    }
+
+    // The same losses for every configuration of a run
+    std::mt19937 generator(run + 1);
+    std::bernoulli_distribution lost(lossRate);
+
+    std::vector<uint64_t> blockNs;
+    uint64_t totalNs = 0;
+    uint64_t symbolsReceived = 0;
+    uint64_t sourceSymbols = 0;
+    uint64_t failedBlocks = 0;
+    uint64_t corruptBlocks = 0;
+    RaptorQSymbol symbol;
+    for (BenchSegment& segment : segments) {
+        RaptorQEncoder& encoder = *segment.encoder;
+        RaptorQDecoder decoder(encoder.OTI_Common(),
+                               encoder.OTI_Scheme_Specific());
+
+        // The decoded blocks back to back, the padding of the last one
+        // included
+        size_t segmentSize = 0;
+        for (const auto& block : encoder) {
+            segmentSize += block.block_size();
+        }
+        std::vector<Alignment> decoded(segmentSize / ALIGNMENT_SIZE);
+
+        size_t blockOffset = 0;
+        uint8_t sbn = 0;
+        for (const auto& block : encoder) {
+            uint32_t symbols = block.symbols();
+            Alignment* blockStart = decoded.data() + blockOffset;
+            Alignment* blockEnd = blockStart +
+                                  block.block_size() / ALIGNMENT_SIZE;
+            RaptorQSymbolIterator source = block.begin_source();
+            RaptorQSymbolIterator repair = block.begin_repair();
+            uint64_t ns = 0;
+            uint32_t received = 0;
+            bool done = false;
+            for (uint32_t sent = 0; !done &&
+                    received < MAX_SYMBOLS_PER_SOURCE_SYMBOL * symbols;
+                    sent++) {
+                RaptorQSymbolIterator& next = sent < symbols ? source
+                                                             : repair;
+                uint32_t id = (*next).id();
+                Alignment* begin = symbol.data();
+                (*next)(begin, symbol.data() + symbol.size());
+                ++next;
+                if (lost(generator)) {
+                    continue;
+                }
+                received++;
+
+                uint64_t start = nowNs();
+                begin = symbol.data();
+                if (decoder.add_symbol(begin, symbol.data() + symbol.size(),
+                                       id)) {
+                    begin = blockStart;
+                    done = decoder.decode(begin, blockEnd, sbn) > 0;
+                }
+                ns += nowNs() - start;
+            }
+
+            if (!done) {
+                failedBlocks++;
+            } else {
+                decoder.free(sbn);
+                size_t length = std::min<size_t>(
+                        block.block_size(),
+                        (segment.end - segment.begin) * ALIGNMENT_SIZE -
+                        blockOffset * ALIGNMENT_SIZE);
+                if (std::memcmp(blockStart, segment.begin + blockOffset,
+                                length) != 0) {
+                    corruptBlocks++;
+                }
+            }
+            blockNs.push_back(ns);
+            totalNs += ns;
+            symbolsReceived += received;
+            sourceSymbols += symbols;
+            blockOffset += block.block_size() / ALIGNMENT_SIZE;
+            sbn++;
+        }
+    }
+
+    size_t blocks = blockNs.size();
+    report.add("benchmark", std::string("decode"))
+          .add("run", uint64_t(run))
+          .add("file_size", fileSize)
+          .add("symbols_per_block", uint64_t(symbolsPerBlock))
+          .add("loss_rate", lossRate)
+          .add("blocks", uint64_t(blocks))
+          .add("decode_ms", double(totalNs) / 1e6)
+          .add("decode_mb_per_s", megabytesPerSecond(fileSize, totalNs))
+          .add("block_decode_us_p50", double(percentile(blockNs, 0.5)) / 1e3)
+          .add("block_decode_us_p99", double(percentile(blockNs, 0.99)) / 1e3)
+          .add("block_decode_us_max", double(percentile(blockNs, 1)) / 1e3)
+          .add("overhead_symbols_per_block",
+               double(symbolsReceived - sourceSymbols) / double(blocks))
+          .add("failed_blocks", failedBlocks)
+          .add("corrupt_blocks", corruptBlocks)
+          .endRow();
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    if (parseBenchArgs(argc, argv, true, options) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    Report report(options.csv);
+    for (int run = 0; run < options.runs; run++) {
+        for (uint64_t fileSize : options.fileSizes) {
+            for (int symbolsPerBlock : options.symbolsPerBlock) {
+                for (double lossRate : options.lossRates) {
+                    benchDecode(report, fileSize, symbolsPerBlock, lossRate,
+                                run);
+                }
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,685 @@
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "impairment.hh"
+#include "report.hh"
+#include "socket.hh"
+#include "timestamp.hh"
+#include "util.hh"
+
+/**
+ * Runs whole transfers over loopback UDP, without mahimahi or root: the
+ * receiver and the sender run as child processes, and the sender talks to
+ * a shim in this process that relays packets to the receiver through an
+ * impaired link (see Impairment::Link), and ACKs back through another.
+ * Loss, burstiness, delay and rate apply to the data; the ACKs see the same
+ * delay and jitter, and the same loss with -A. Prints one CSV row per
+ * configuration and run.
+ */
+
+/**
+ * Largest datagram the shim relays.
+ */
+const size_t MAX_DATAGRAM_SIZE = 9000;
+
+/**
+ * Datagrams the shim receives per recvmmsg().
+ */
+const size_t SHIM_BATCH_SIZE = 64;
+
+/**
+ * Longest the shim sleeps without checking whether it should stop.
+ */
+const uint64_t SHIM_MAX_SLEEP_US = 10000;
+
+/**
+ * Time to wait for the receiver to report the port it listens on.
+ */
+const uint64_t RECEIVER_START_TIMEOUT_US = 5000000;
+
+struct E2EOptions {
+    std::vector<uint64_t> fileSizes;
+    std::vector<double> lossRates;
+    std::vector<double> meanBursts;
+    std::vector<uint64_t> delaysUs;
+    std::vector<uint64_t> rates;
+    uint64_t jitterUs;
+    uint64_t queueUs;
+
+    // Whether the ACKs are lost as much as the data
+    bool lossyAcks;
+
+    int runs;
+    std::string senderPath;
+    std::string receiverPath;
+    std::vector<std::string> senderArgs;
+    std::vector<std::string> receiverArgs;
+    uint64_t timeoutUs;
+
+    E2EOptions()
+        : fileSizes {16 << 20}
+        , lossRates {0, 0.01, 0.05, 0.2}
+        , meanBursts {0}
+        , delaysUs {10000}
+        , rates {100 * 1000000 / 8}
+        , jitterUs(0)
+        , queueUs(50000)
+        , lossyAcks(false)
+        , runs(1)
+        , senderPath()
+        , receiverPath()
+        , senderArgs()
+        , receiverArgs()
+        , timeoutUs(120000000)
+    {}
+};
+
+/**
+ * Relays datagrams between the sender, which it listens to on a loopback
+ * port, and the receiver, through one impaired link in each direction.
+ */
+class Shim {
+  public:
+    struct Direction {
+        Impairment::Link link;
+
+        // Bytes that entered the link
+        uint64_t bytes;
+
+        explicit Direction(const Impairment::LinkConfig& config,
+                           uint32_t seed)
+            : link(config, seed)
+            , bytes(0)
+            , inFlight()
+        {}
+
+      private:
+        struct Packet {
+            uint64_t arrival;
+            uint64_t sequence;
+            std::string payload;
+
+            bool operator>(const Packet& other) const
+            {
+                return arrival != other.arrival ? arrival > other.arrival
+                                                : sequence > other.sequence;
+            }
+        };
+
+        std::priority_queue<Packet, std::vector<Packet>,
+                            std::greater<Packet>> inFlight;
+
+        friend class Shim;
+    };
+
+    Shim(const Address& receiver, const Impairment::LinkConfig& forward,
+         const Impairment::LinkConfig& reverse, uint32_t seed);
+    ~Shim();
+
+    uint16_t port() const
+    {
+        return front.local_address().port();
+    }
+
+    /**
+     * Stops relaying; the counters are final afterwards.
+     */
+    void stop();
+
+    Direction toReceiver;
+    Direction toSender;
+
+  private:
+    void run();
+    void receive(UDPSocket& socket, DatagramSlab& slab, bool fromSender,
+                 uint64_t now);
+    void deliver(uint64_t now);
+
+    // Talks to the sender, and to the receiver
+    UDPSocket front;
+    UDPSocket back;
+
+    Address receiver;
+    Address sender;
+    bool senderKnown;
+    uint64_t sequence;
+
+    std::atomic<bool> stopping;
+    std::thread thread;
+
+    Shim(const Shim&) = delete;
+    Shim& operator=(const Shim&) = delete;
+};
+
+Shim::Shim(const Address& receiver, const Impairment::LinkConfig& forward,
+           const Impairment::LinkConfig& reverse, uint32_t seed)
+    : toReceiver(forward, seed)
+    , toSender(reverse, seed + 1)
+    , front()
+    , back()
+    , receiver(receiver)
+    , sender()
+    , senderKnown(false)
+    , sequence(0)
+    , stopping(false)
+    , thread()
+{
+    front.bind(Address("127.0.0.1", 0));
+    back.bind(Address("127.0.0.1", 0));
+    thread = std::thread(&Shim::run, this);
+}
+
+Shim::~Shim()
+{
+    stop();
+}
+
+void
+Shim::stop()
+{
+    stopping = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void
+Shim::run()
+{
+    DatagramSlab slab {MAX_DATAGRAM_SIZE, SHIM_BATCH_SIZE};
+    while (!stopping) {
+        uint64_t now = timestamp_us();
+        deliver(now);
+
+        uint64_t sleepUs = SHIM_MAX_SLEEP_US;
+        for (Direction* direction : {&toReceiver, &toSender}) {
+            if (!direction->inFlight.empty()) {
+                uint64_t arrival = direction->inFlight.top().arrival;
+                sleepUs = std::min(sleepUs, arrival > now ? arrival - now : 0);
+            }
+        }
+        pollfd fds[] = {{front.fd_num(), POLLIN, 0},
+                        {back.fd_num(), POLLIN, 0}};
+        timespec timeout {time_t(sleepUs / 1000000),
+                          long(sleepUs % 1000000 * 1000)};
+        if (ppoll(fds, 2, &timeout, nullptr) <= 0) {
+            continue;
+        }
+        now = timestamp_us();
+        if (fds[0].revents & POLLIN) {
+            receive(front, slab, true, now);
+        }
+        if (fds[1].revents & POLLIN) {
+            receive(back, slab, false, now);
+        }
+    }
+}
+
+void
+Shim::receive(UDPSocket& socket, DatagramSlab& slab, bool fromSender,
+              uint64_t now)
+{
+    try {
+        socket.recvbatch(slab);
+    } catch (const unix_error& e) {
+        return;
+    }
+    Direction& direction = fromSender ? toReceiver : toSender;
+    for (size_t i = 0; i < slab.size(); i++) {
+        if (slab[i].length == 0) {
+            // Too large for a slot; neither peer sends such datagrams
+            continue;
+        }
+        if (fromSender) {
+            // The first datagram is the sender's handshake request
+            if (!senderKnown) {
+                sender = slab.source(i);
+                senderKnown = true;
+            }
+        } else if (!(slab.source(i) == receiver)) {
+            continue;
+        }
+        direction.bytes += slab[i].length;
+        uint64_t arrival = direction.link.send(now, slab[i].length);
+        if (arrival != Impairment::Link::DROPPED) {
+            direction.inFlight.push({arrival, sequence++,
+                    std::string(slab[i].payload, slab[i].length)});
+        }
+    }
+}
+
+void
+Shim::deliver(uint64_t now)
+{
+    for (Direction* direction : {&toReceiver, &toSender}) {
+        UDPSocket& socket = direction == &toReceiver ? back : front;
+        const Address& peer = direction == &toReceiver ? receiver : sender;
+        while (!direction->inFlight.empty() &&
+                direction->inFlight.top().arrival <= now) {
+            const std::string& payload = direction->inFlight.top().payload;
+            try {
+                socket.sendbytesto(peer, payload.data(), payload.size());
+            } catch (const unix_error& e) {
+                // Gone, or full: lost like on a real path
+            }
+            direction->inFlight.pop();
+        }
+    }
+}
+
+/**
+ * Starts a program in dir, with its output in logPath.
+ */
+pid_t
+spawn(const std::vector<std::string>& args, const std::string& dir,
+      const std::string& logPath)
+{
+    std::vector<char*> argv;
+    for (const std::string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = SystemCall("fork", fork());
+    if (pid == 0) {
+        int fd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || chdir(dir.c_str()) != 0 || dup2(fd, 1) < 0 ||
+                dup2(fd, 2) < 0) {
+            _exit(127);
+        }
+        execv(argv[0], argv.data());
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+ * Returns the port of a line of the receiver's output that is the address
+ * it listens on (HOST:PORT), or 0 if the line is something else.
+ */
+uint16_t
+parseAddressLine(const std::string& line)
+{
+    size_t colon = line.rfind(':');
+    if (colon == std::string::npos || colon + 1 == line.size() ||
+            line.find(' ') != std::string::npos ||
+            line.find_first_not_of("0123456789", colon + 1) !=
+            std::string::npos) {
+        return 0;
+    }
+    return uint16_t(std::strtoul(line.c_str() + colon + 1, nullptr, 10));
+}
+
+/**
+ * Waits for the receiver to print the address it listens on. Other lines
+ * may come first, e.g. the warning that port 6330 is already used, which
+ * goes to stderr and the same log.
+ *
+ * \return
+ *      The port, or 0 if the receiver did not start.
+ */
+uint16_t
+waitForReceiverPort(pid_t receiver, const std::string& logPath)
+{
+    uint64_t deadline = timestamp_us() + RECEIVER_START_TIMEOUT_US;
+    while (timestamp_us() < deadline) {
+        std::ifstream log(logPath);
+        std::string line;
+        // Only whole lines: the last one may still be being written
+        while (std::getline(log, line) && !log.eof()) {
+            uint16_t port = parseAddressLine(line);
+            if (port != 0) {
+                return port;
+            }
+        }
+        if (waitpid(receiver, nullptr, WNOHANG) == receiver) {
+            return 0;
+        }
+        usleep(1000);
+    }
+    return 0;
+}
+
+bool
+writeRandomFile(const std::string& path, uint64_t size)
+{
+    std::ofstream file(path, std::ios::binary);
+    std::mt19937 generator(1);
+    std::vector<uint32_t> chunk(1 << 16);
+    for (uint64_t written = 0; written < size;) {
+        for (uint32_t& word : chunk) {
+            word = generator();
+        }
+        size_t length = size_t(std::min<uint64_t>(size - written,
+                chunk.size() * sizeof(uint32_t)));
+        file.write(reinterpret_cast<const char*>(chunk.data()), length);
+        written += length;
+    }
+    return bool(file);
+}
+
+bool
+sameContents(const std::string& a, const std::string& b)
+{
+    std::ifstream fileA(a, std::ios::binary);
+    std::ifstream fileB(b, std::ios::binary);
+    std::vector<char> bufferA(1 << 20);
+    std::vector<char> bufferB(1 << 20);
+    while (fileA && fileB) {
+        fileA.read(bufferA.data(), bufferA.size());
+        fileB.read(bufferB.data(), bufferB.size());
+        if (fileA.gcount() != fileB.gcount() ||
+                std::memcmp(bufferA.data(), bufferB.data(),
+                            size_t(fileA.gcount())) != 0) {
+            return false;
+        }
+    }
+    return fileA.eof() && fileB.eof();
+}
+
+struct Configuration {
+    uint64_t fileSize;
+    double lossRate;
+    double meanBurst;
+    uint64_t delayUs;
+    uint64_t rate;
+};
+
+void
+benchE2E(Report& report, const E2EOptions& options,
+         const Configuration& configuration, int run)
+{
+    char dirTemplate[] = "/tmp/bench_e2e.XXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    std::string dir = dirTemplate;
+    std::string sourcePath = dir + "/payload";
+    std::string receivedDir = dir + "/received";
+    std::string receiverLog = dir + "/receiver.log";
+    std::string senderLog = dir + "/sender.log";
+    if (mkdir(receivedDir.c_str(), 0755) != 0 ||
+            !writeRandomFile(sourcePath, configuration.fileSize)) {
+        std::cerr << "Unable to set up " << dir << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<std::string> receiverArgs {options.receiverPath, "-u"};
+    receiverArgs.insert(receiverArgs.end(), options.receiverArgs.begin(),
+                        options.receiverArgs.end());
+    pid_t receiver = spawn(receiverArgs, receivedDir, receiverLog);
+    uint16_t receiverPort = waitForReceiverPort(receiver, receiverLog);
+    if (receiverPort == 0) {
+        std::cerr << "The receiver did not start; see " << receiverLog
+                  << std::endl;
+        kill(receiver, SIGKILL);
+        waitpid(receiver, nullptr, 0);
+        exit(EXIT_FAILURE);
+    }
+
+    Impairment::LinkConfig forward;
+    forward.lossRate = configuration.lossRate;
+    forward.meanBurst = configuration.meanBurst;
+    forward.delayUs = configuration.delayUs;
+    forward.jitterUs = options.jitterUs;
+    forward.rate = configuration.rate;
+    forward.queueUs = options.queueUs;
+    Impairment::LinkConfig reverse;
+    if (options.lossyAcks) {
+        reverse.lossRate = configuration.lossRate;
+        reverse.meanBurst = configuration.meanBurst;
+    }
+    reverse.delayUs = configuration.delayUs;
+    reverse.jitterUs = options.jitterUs;
+    Shim shim(Address("127.0.0.1", receiverPort), forward, reverse,
+              uint32_t(run) * 2 + 1);
+
+    std::vector<std::string> senderArgs {options.senderPath, "127.0.0.1",
+            std::to_string(shim.port()), sourcePath, "-u"};
+    senderArgs.insert(senderArgs.end(), options.senderArgs.begin(),
+                      options.senderArgs.end());
+    uint64_t start = timestamp_us();
+    pid_t sender = spawn(senderArgs, dir, senderLog);
+
+    // Wait for both, or kill both at the deadline
+    uint64_t senderUs = 0;
+    uint64_t receiverUs = 0;
+    int senderStatus = -1;
+    int receiverStatus = -1;
+    bool timedOut = false;
+    while (senderUs == 0 || receiverUs == 0) {
+        uint64_t now = timestamp_us();
+        if (senderUs == 0 && waitpid(sender, &senderStatus, WNOHANG) ==
+                sender) {
+            senderUs = now - start;
+        }
+        if (receiverUs == 0 && waitpid(receiver, &receiverStatus, WNOHANG) ==
+                receiver) {
+            receiverUs = now - start;
+        }
+        if (now - start > options.timeoutUs) {
+            timedOut = true;
+            for (pid_t pid : {sender, receiver}) {
+                if (kill(pid, SIGKILL) == 0) {
+                    waitpid(pid, nullptr, 0);
+                }
+            }
+            senderUs = senderUs == 0 ? now - start : senderUs;
+            receiverUs = receiverUs == 0 ? now - start : receiverUs;
+            break;
+        }
+        usleep(1000);
+    }
+    shim.stop();
+
+    bool ok = !timedOut && WIFEXITED(senderStatus) &&
+              WEXITSTATUS(senderStatus) == 0 && WIFEXITED(receiverStatus) &&
+              WEXITSTATUS(receiverStatus) == 0 &&
+              sameContents(sourcePath, receivedDir + "/payload");
+
+    const Impairment::Link& data = shim.toReceiver.link;
+    report.add("run", uint64_t(run))
+          .add("file_size", configuration.fileSize)
+          .add("loss_rate", configuration.lossRate)
+          .add("mean_burst", configuration.meanBurst)
+          .add("delay_ms", double(configuration.delayUs) / 1e3)
+          .add("jitter_ms", double(options.jitterUs) / 1e3)
+          .add("rate_mbps", double(configuration.rate) * 8 / 1e6)
+          .add("ok", uint64_t(ok))
+          .add("completion_ms", double(receiverUs) / 1e3)
+          .add("sender_ms", double(senderUs) / 1e3)
+          .add("goodput_mbps", double(configuration.fileSize) * 8 /
+                               double(receiverUs))
+          .add("overhead_ratio", double(shim.toReceiver.bytes) /
+                                 double(configuration.fileSize))
+          .add("data_packets", data.packets)
+          .add("data_lost", data.lost)
+          .add("queue_drops", data.overflows)
+          .add("ack_packets", shim.toSender.link.packets)
+          .add("ack_lost", shim.toSender.link.lost)
+          .endRow();
+
+    if (ok) {
+        for (const std::string& path : {receivedDir + "/payload",
+                                        sourcePath, receiverLog, senderLog}) {
+            unlink(path.c_str());
+        }
+        rmdir(receivedDir.c_str());
+        rmdir(dir.c_str());
+    } else {
+        std::cerr << "Transfer failed; logs kept in " << dir << std::endl;
+    }
+}
+
+/**
+ * Directory of this program, where the build puts the sender and the
+ * receiver as well.
+ */
+std::string
+programDirectory()
+{
+    char path[4096];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length <= 0) {
+        return ".";
+    }
+    path[length] = 0;
+    std::string directory(path);
+    return directory.substr(0, directory.rfind('/'));
+}
+
+std::vector<std::string>
+splitArgs(const char* args)
+{
+    std::istringstream stream(args);
+    std::vector<std::string> split;
+    std::string arg;
+    while (stream >> arg) {
+        split.push_back(arg);
+    }
+    return split;
+}
+
+void printUsage(char* command)
+{
+    std::cerr << "Usage: " << command << " [-Ah] [-s MB,...] [-l LOSS,...] [-B BURST,...] [-D MS,...] [-r MBPS,...] [-j MS] [-q MS] [-n RUNS] [-x SENDER_ARGS] [-y RECEIVER_ARGS] [-S SENDER] [-R RECEIVER] [-T SECONDS]" << std::endl;
+    std::cerr << "\t-h: help" << std::endl;
+    std::cerr << "\t-s: sizes of the file, in megabytes (default 16)" << std::endl;
+    std::cerr << "\t-l: fractions of the data packets lost (default 0,0.01,0.05,0.2)" << std::endl;
+    std::cerr << "\t-B: mean lengths of the bursts of losses, 0 for independent losses (default 0)" << std::endl;
+    std::cerr << "\t-D: one-way delays in milliseconds (default 10)" << std::endl;
+    std::cerr << "\t-r: rates of the bottleneck in Mbit/s, 0 for none (default 100)" << std::endl;
+    std::cerr << "\t-j: jitter of the delay in milliseconds (default 0)" << std::endl;
+    std::cerr << "\t-q: queue of the bottleneck in milliseconds (default 50)" << std::endl;
+    std::cerr << "\t-A: lose ACKs as much as data packets" << std::endl;
+    std::cerr << "\t-n: runs of each configuration (default 1)" << std::endl;
+    std::cerr << "\t-x: extra arguments of the sender, e.g. \"-c ledbat\"" << std::endl;
+    std::cerr << "\t-y: extra arguments of the receiver" << std::endl;
+    std::cerr << "\t-S, -R: sender and receiver programs (default: next to this one)" << std::endl;
+    std::cerr << "\t-T: give up on a transfer after this many seconds (default 120)" << std::endl;
+}
+
+int parseArgs(int argc, char* argv[], E2EOptions& options)
+{
+    std::vector<double> values;
+    int c;
+    while ((c = getopt(argc, argv, "s:l:B:D:r:j:q:An:x:y:S:R:T:h")) != -1) {
+        bool ok = true;
+        switch (c) {
+            case 's':
+                ok = parseList(optarg, 1 << 20, options.fileSizes);
+                break;
+            case 'l':
+                ok = parseList(optarg, 1, options.lossRates) &&
+                     *std::max_element(options.lossRates.begin(),
+                                       options.lossRates.end()) < 1;
+                break;
+            case 'B':
+                ok = parseList(optarg, 1, options.meanBursts);
+                break;
+            case 'D':
+                ok = parseList(optarg, 1000, options.delaysUs);
+                break;
+            case 'r':
+                ok = parseList(optarg, 1000000 / 8, options.rates);
+                break;
+            case 'j':
+                ok = parseList(optarg, 1000, values) && values.size() == 1;
+                options.jitterUs = ok ? uint64_t(values[0]) : 0;
+                break;
+            case 'q':
+                ok = parseList(optarg, 1000, values) && values.size() == 1;
+                options.queueUs = ok ? uint64_t(values[0]) : 0;
+                break;
+            case 'A':
+                options.lossyAcks = true;
+                break;
+            case 'n':
+                options.runs = std::atoi(optarg);
+                ok = options.runs > 0;
+                break;
+            case 'x':
+                options.senderArgs = splitArgs(optarg);
+                break;
+            case 'y':
+                options.receiverArgs = splitArgs(optarg);
+                break;
+            case 'S':
+                options.senderPath = optarg;
+                break;
+            case 'R':
+                options.receiverPath = optarg;
+                break;
+            case 'T':
+                options.timeoutUs = uint64_t(std::atof(optarg) * 1e6);
+                ok = options.timeoutUs > 0;
+                break;
+            default:
+                ok = false;
+        }
+        if (!ok) {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind != argc) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    if (options.senderPath.empty()) {
+        options.senderPath = programDirectory() + "/sender";
+    }
+    if (options.receiverPath.empty()) {
+        options.receiverPath = programDirectory() + "/receiver";
+    }
+    for (const std::string& path : {options.senderPath,
+                                    options.receiverPath}) {
+        if (access(path.c_str(), X_OK) != 0) {
+            perror(path.c_str());
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    E2EOptions options;
+    if (parseArgs(argc, argv, options) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    Report report(true);
+    for (int run = 0; run < options.runs; run++) {
+        for (uint64_t fileSize : options.fileSizes) {
+            for (double lossRate : options.lossRates) {
+                for (double meanBurst : options.meanBursts) {
+                    for (uint64_t delayUs : options.delaysUs) {
+                        for (uint64_t rate : options.rates) {
+                            benchE2E(report, options, {fileSize, lossRate,
+                                     meanBurst, delayUs, rate}, run);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#include "bench.hh"
+
+/**
+ * Measures the encoding side of a transfer, on one core: instantiating the
+ * encoders of the segments, precomputing the intermediate symbols of each
+ * block (which the sender spreads over a PrecomputePool), and generating
+ * repair symbols from them.
+ */
+
+/**
+ * Repair symbols generated per source symbol, as many as the sender sends
+ * at a 20% loss rate.
+ */
+const double REPAIR_FRACTION = 0.25;
+
+void
+benchEncode(Report& report, uint64_t fileSize, int symbolsPerBlock, int run)
+{
+    std::vector<Alignment> data = randomData(fileSize);
+
+    uint64_t start = nowNs();
+    std::vector<BenchSegment> segments = makeSegments(data, symbolsPerBlock);
+    uint64_t instantiateNs = nowNs() - start;
+    if (segments.empty()) {
+        std::cerr << "Unable to instantiate an encoder for " << fileSize
+                  << " bytes with " << symbolsPerBlock
+                  << " symbols per block" << std::endl;
+        return;
+    }
+
+    std::vector<uint64_t> precomputeNs;
+    uint64_t totalPrecomputeNs = 0;
+    for (BenchSegment& segment : segments) {
+        for (uint8_t sbn = 0; sbn < segment.encoder->blocks(); sbn++) {
+            start = nowNs();
+            precomputeBlock(*segment.encoder, sbn);
+            precomputeNs.push_back(nowNs() - start);
+            totalPrecomputeNs += precomputeNs.back();
+        }
+    }
+
+    uint64_t repairSymbols = 0;
+    uint64_t repairNs = 0;
+    RaptorQSymbol symbol;
+    for (BenchSegment& segment : segments) {
+        for (const auto& block : *segment.encoder) {
+            uint32_t count = static_cast<uint32_t>(
+                    std::ceil(block.symbols() * REPAIR_FRACTION));
+            RaptorQSymbolIterator repair = block.begin_repair();
+            start = nowNs();
+            for (uint32_t i = 0; i < count; i++, ++repair) {
+                Alignment* begin = symbol.data();
+                (*repair)(begin, symbol.data() + symbol.size());
+            }
+            repairNs += nowNs() - start;
+            repairSymbols += count;
+        }
+    }
+
+    size_t blocks = precomputeNs.size();
+    report.add("benchmark", std::string("encode"))
+          .add("run", uint64_t(run))
+          .add("file_size", fileSize)
+          .add("symbols_per_block", uint64_t(symbolsPerBlock))
+          .add("segments", uint64_t(segments.size()))
+          .add("blocks", uint64_t(blocks))
+          .add("instantiate_ms", double(instantiateNs) / 1e6)
+          .add("precompute_ms", double(totalPrecomputeNs) / 1e6)
+          .add("precompute_mb_per_s",
+               megabytesPerSecond(fileSize, totalPrecomputeNs))
+          .add("precompute_block_us_p50",
+               double(percentile(precomputeNs, 0.5)) / 1e3)
+          .add("precompute_block_us_p99",
+               double(percentile(precomputeNs, 0.99)) / 1e3)
+          .add("precompute_block_us_max",
+               double(percentile(precomputeNs, 1)) / 1e3)
+          .add("repair_symbols", repairSymbols)
+          .add("repair_mb_per_s",
+               megabytesPerSecond(repairSymbols * SYMBOL_SIZE, repairNs))
+          .add("repair_symbol_ns",
+               repairSymbols == 0 ? 0.0
+                                  : double(repairNs) / double(repairSymbols))
+          .endRow();
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    if (parseBenchArgs(argc, argv, false, options) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    Report report(options.csv);
+    for (int run = 0; run < options.runs; run++) {
+        for (uint64_t fileSize : options.fileSizes) {
+            for (int symbolsPerBlock : options.symbolsPerBlock) {
+                benchEncode(report, fileSize, symbolsPerBlock, run);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
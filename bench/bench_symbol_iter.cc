@@ -0,0 +1,151 @@
+#include <cstring>
+
+#include "bench.hh"
+
+/**
+ * Measures the cost of getting symbols out of the encoder, on one core,
+ * against copying the same bytes: the sender sends source symbols straight
+ * from the mapped file, and only goes through the encoder's iterators for
+ * their ids and for repair symbols.
+ *
+ *   copy:   memcpy of each source symbol from the data
+ *   source: source symbols generated with the symbol iterator
+ *   ids:    incrementing the iterator and reading id() alone
+ *   repair: repair symbols, once the blocks are precomputed
+ */
+
+struct IterResult {
+    uint64_t symbols;
+    uint64_t ns;
+};
+
+/**
+ * Visits every source symbol of every block, calling
+ * visit(segment, symbol, index) with the iterator and the index of the
+ * symbol in its segment.
+ */
+template<typename Visit>
+IterResult
+timeSourceSymbols(std::vector<BenchSegment>& segments, Visit visit)
+{
+    IterResult result = {0, 0};
+    for (BenchSegment& segment : segments) {
+        uint64_t index = 0;
+        for (const auto& block : *segment.encoder) {
+            RaptorQSymbolIterator symbol = block.begin_source();
+            RaptorQSymbolIterator end = block.end_source();
+            uint64_t start = nowNs();
+            for (; symbol != end; ++symbol, ++index) {
+                visit(segment, symbol, index);
+            }
+            result.ns += nowNs() - start;
+            result.symbols += block.symbols();
+        }
+    }
+    return result;
+}
+
+void
+reportIter(Report& report, const char* method, uint64_t fileSize,
+           int symbolsPerBlock, int run, const IterResult& result)
+{
+    report.add("benchmark", std::string("symbol_iter"))
+          .add("method", std::string(method))
+          .add("run", uint64_t(run))
+          .add("file_size", fileSize)
+          .add("symbols_per_block", uint64_t(symbolsPerBlock))
+          .add("symbols", result.symbols)
+          .add("mb_per_s", megabytesPerSecond(result.symbols * SYMBOL_SIZE,
+                                              result.ns))
+          .add("symbol_ns", result.symbols == 0 ? 0.0
+                            : double(result.ns) / double(result.symbols))
+          .endRow();
+}
+
+void
+benchSymbolIter(Report& report, uint64_t fileSize, int symbolsPerBlock,
+                int run)
+{
+    std::vector<Alignment> data = randomData(fileSize);
+    std::vector<BenchSegment> segments = makeSegments(data, symbolsPerBlock);
+    if (segments.empty()) {
+        std::cerr << "Unable to instantiate an encoder for " << fileSize
+                  << " bytes with " << symbolsPerBlock
+                  << " symbols per block" << std::endl;
+        return;
+    }
+
+    // Written to so that the compiler keeps the loops
+    RaptorQSymbol symbol;
+    uint64_t sink = 0;
+
+    // The last symbols of a segment may be partial, or all padding
+    IterResult copy = timeSourceSymbols(segments,
+            [&] (BenchSegment& segment, RaptorQSymbolIterator&,
+                 uint64_t index) {
+        const Alignment* from = segment.begin +
+                                index * (SYMBOL_SIZE / ALIGNMENT_SIZE);
+        size_t length = from < segment.end ? std::min<size_t>(
+                SYMBOL_SIZE, (segment.end - from) * ALIGNMENT_SIZE) : 0;
+        std::memcpy(symbol.data(), from, length);
+        sink += symbol[0];
+    });
+    reportIter(report, "copy", fileSize, symbolsPerBlock, run, copy);
+
+    IterResult source = timeSourceSymbols(segments,
+            [&] (BenchSegment&, RaptorQSymbolIterator& it, uint64_t) {
+        Alignment* begin = symbol.data();
+        (*it)(begin, symbol.data() + symbol.size());
+        sink += symbol[0];
+    });
+    reportIter(report, "source", fileSize, symbolsPerBlock, run, source);
+
+    IterResult ids = timeSourceSymbols(segments,
+            [&] (BenchSegment&, RaptorQSymbolIterator& it, uint64_t) {
+        sink += (*it).id();
+    });
+    reportIter(report, "ids", fileSize, symbolsPerBlock, run, ids);
+
+    for (BenchSegment& segment : segments) {
+        for (uint8_t sbn = 0; sbn < segment.encoder->blocks(); sbn++) {
+            precomputeBlock(*segment.encoder, sbn);
+        }
+    }
+    IterResult repair = {0, 0};
+    for (BenchSegment& segment : segments) {
+        for (const auto& block : *segment.encoder) {
+            RaptorQSymbolIterator it = block.begin_repair();
+            uint64_t start = nowNs();
+            for (uint32_t i = 0; i < block.symbols(); i++, ++it) {
+                Alignment* begin = symbol.data();
+                (*it)(begin, symbol.data() + symbol.size());
+                sink += symbol[0];
+            }
+            repair.ns += nowNs() - start;
+            repair.symbols += block.symbols();
+        }
+    }
+    reportIter(report, "repair", fileSize, symbolsPerBlock, run, repair);
+
+    if (sink == 1) {
+        std::cerr << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    if (parseBenchArgs(argc, argv, false, options) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    Report report(options.csv);
+    for (int run = 0; run < options.runs; run++) {
+        for (uint64_t fileSize : options.fileSizes) {
+            for (int symbolsPerBlock : options.symbolsPerBlock) {
+                benchSymbolIter(report, fileSize, symbolsPerBlock, run);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+#include <algorithm>
+
+#include "impairment.hh"
+
+namespace Impairment {
+
+LossModel::LossModel(double lossRate, double meanBurst,
+                     std::mt19937& generator)
+    : generator(generator)
+    , uniform(0, 1)
+    , lossRate(lossRate)
+    , enterBad(0)
+    , leaveBad(0)
+    , bad(false)
+{
+    if (meanBurst > 0 && lossRate > 0) {
+        // In steady state the bad state holds enterBad / (enterBad +
+        // leaveBad) of the packets, and lasts 1 / leaveBad packets
+        leaveBad = 1 / std::max(meanBurst, 1.0);
+        enterBad = std::min(1.0, lossRate * leaveBad / (1 - lossRate));
+    }
+}
+
+bool
+LossModel::lost()
+{
+    if (leaveBad == 0) {
+        return lossRate > 0 && uniform(generator) < lossRate;
+    }
+    bad = uniform(generator) < (bad ? 1 - leaveBad : enterBad);
+    return bad;
+}
+
+const uint64_t Link::DROPPED;
+
+Link::Link(const LinkConfig& config, uint32_t seed)
+    : packets(0)
+    , lost(0)
+    , overflows(0)
+    , config(config)
+    , generator(seed)
+    , loss(config.lossRate, config.meanBurst, generator)
+    , jitter(-int64_t(config.jitterUs), int64_t(config.jitterUs))
+    , busyUntil(0)
+{
+}
+
+uint64_t
+Link::send(uint64_t now, size_t bytes)
+{
+    packets++;
+    if (loss.lost()) {
+        lost++;
+        return DROPPED;
+    }
+
+    uint64_t departure = now;
+    if (config.rate > 0) {
+        uint64_t start = std::max(now * 1000, busyUntil);
+        if (start - now * 1000 > config.queueUs * 1000) {
+            overflows++;
+            return DROPPED;
+        }
+        busyUntil = start + bytes * 1000000000 / config.rate;
+        departure = (busyUntil + 999) / 1000;
+    }
+
+    int64_t delay = int64_t(config.delayUs);
+    if (config.jitterUs > 0) {
+        delay = std::max<int64_t>(0, delay + jitter(generator));
+    }
+    return departure + uint64_t(delay);
+}
+
+}
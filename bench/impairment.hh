@@ -0,0 +1,137 @@
+#ifndef IMPAIRMENT_HH
+#define IMPAIRMENT_HH
+
+#include <cstdint>
+#include <random>
+
+/**
+ * A model of one direction of a network path, in the spirit of netem and
+ * mahimahi: random loss, independent or in bursts, a bottleneck of limited
+ * rate with a drop-tail queue, then a propagation delay with jitter. It only
+ * computes the fate of each packet; the caller moves the packets, in real
+ * time or on a virtual clock. All times are in microseconds.
+ */
+namespace Impairment {
+
+struct LinkConfig {
+    /**
+     * Average fraction of the packets lost.
+     */
+    double lossRate;
+
+    /**
+     * Average number of packets in a burst of losses, following the
+     * Gilbert-Elliott model; 0 for independent (Bernoulli) losses.
+     */
+    double meanBurst;
+
+    /**
+     * One-way propagation delay.
+     */
+    uint64_t delayUs;
+
+    /**
+     * Each packet is delayed by up to jitterUs more or less than delayUs,
+     * uniformly, which can reorder packets as netem does.
+     */
+    uint64_t jitterUs;
+
+    /**
+     * Rate of the bottleneck in bytes per second; 0 if unlimited.
+     */
+    uint64_t rate;
+
+    /**
+     * Capacity of the queue in front of the bottleneck, as the time it takes
+     * to drain at the rate. Packets that find the queue full are dropped.
+     */
+    uint64_t queueUs;
+
+    LinkConfig()
+        : lossRate(0)
+        , meanBurst(0)
+        , delayUs(0)
+        , jitterUs(0)
+        , rate(0)
+        , queueUs(50000)
+    {}
+};
+
+/**
+ * Decides which packets are lost. In the Gilbert-Elliott model the path
+ * alternates between a good state, where no packet is lost, and a bad state,
+ * where all are; the transition probabilities are derived from the loss rate
+ * and the mean burst length.
+ */
+class LossModel {
+  public:
+    LossModel(double lossRate, double meanBurst, std::mt19937& generator);
+
+    /**
+     * \return
+     *      True if the next packet is lost.
+     */
+    bool lost();
+
+  private:
+    std::mt19937& generator;
+    std::uniform_real_distribution<double> uniform;
+
+    double lossRate;
+
+    // Probabilities to enter and leave the bad state for each packet; 0 if
+    // losses are independent
+    double enterBad;
+    double leaveBad;
+
+    bool bad;
+};
+
+class Link {
+  public:
+    /**
+     * Value returned by send() for a packet that never arrives.
+     */
+    static const uint64_t DROPPED = UINT64_MAX;
+
+    Link(const LinkConfig& config, uint32_t seed);
+
+    /**
+     * Sends a packet over the link.
+     *
+     * \param now
+     *      Time at which the packet enters the link; calls must be in
+     *      increasing order of time.
+     * \param bytes
+     *      Size of the packet.
+     * \return
+     *      Time at which the packet arrives, or DROPPED.
+     */
+    uint64_t send(uint64_t now, size_t bytes);
+
+    /**
+     * Number of packets sent, lost, and dropped because the queue was full.
+     */
+    uint64_t packets;
+    uint64_t lost;
+    uint64_t overflows;
+
+  private:
+    LinkConfig config;
+    std::mt19937 generator;
+    LossModel loss;
+    std::uniform_int_distribution<int64_t> jitter;
+
+    // Time at which the bottleneck is done with the packets queued, in
+    // nanoseconds so that the rate holds for packets that take a fraction
+    // of a microsecond more
+    uint64_t busyUntil;
+
+    // loss refers to generator
+    Link(const Link&) = delete;
+    Link& operator=(const Link&) = delete;
+};
+
+}
+
+#endif /* IMPAIRMENT_HH */
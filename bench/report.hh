@@ -0,0 +1,144 @@
+#ifndef REPORT_HH
+#define REPORT_HH
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Helpers shared by all the benchmarks: parsing the lists of values to
+ * sweep, timing, and printing the results.
+ */
+
+/**
+ * Parses a comma-separated list of non-negative numbers, each multiplied by
+ * scale, into values.
+ *
+ * \return
+ *      False if the list is malformed.
+ */
+template<typename T>
+bool
+parseList(const char* list, double scale, std::vector<T>& values)
+{
+    values.clear();
+    std::string s(list);
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = std::min(s.find(',', start), s.size());
+        char* parsed;
+        double value = std::strtod(s.c_str() + start, &parsed);
+        if (parsed != s.c_str() + end || value < 0) {
+            return false;
+        }
+        values.push_back(static_cast<T>(value * scale));
+        start = end + 1;
+    }
+    return !values.empty();
+}
+
+/**
+ * Monotonic time in nanoseconds.
+ */
+inline uint64_t
+nowNs()
+{
+    return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/**
+ * The given percentile of a set of values, which it sorts; 0 if empty.
+ */
+inline uint64_t
+percentile(std::vector<uint64_t>& values, double fraction)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(fraction * double(values.size()));
+    return values[std::min(rank, values.size() - 1)];
+}
+
+/**
+ * Megabytes (10^6 bytes) per second.
+ */
+inline double
+megabytesPerSecond(uint64_t bytes, uint64_t ns)
+{
+    return ns == 0 ? 0 : double(bytes) * 1e3 / double(ns);
+}
+
+/**
+ * Prints one line per row on stdout: a JSON object, or CSV values under a
+ * header printed before the first row. All the rows must have the same
+ * fields in the same order.
+ */
+class Report {
+  public:
+    explicit Report(bool csv)
+        : csv(csv)
+        , headerPrinted(false)
+        , row()
+    {}
+
+    Report& add(const char* name, const std::string& value)
+    {
+        row.emplace_back(name, csv ? value : "\"" + value + "\"");
+        return *this;
+    }
+
+    Report& add(const char* name, uint64_t value)
+    {
+        row.emplace_back(name, std::to_string(value));
+        return *this;
+    }
+
+    Report& add(const char* name, double value)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.6g", value);
+        row.emplace_back(name, buffer);
+        return *this;
+    }
+
+    /**
+     * Prints the fields added since the last call.
+     */
+    void endRow()
+    {
+        if (csv && !headerPrinted) {
+            for (size_t i = 0; i < row.size(); i++) {
+                printf("%s%s", i > 0 ? "," : "", row[i].first.c_str());
+            }
+            printf("\n");
+            headerPrinted = true;
+        }
+        printf("%s", csv ? "" : "{");
+        for (size_t i = 0; i < row.size(); i++) {
+            if (csv) {
+                printf("%s%s", i > 0 ? "," : "", row[i].second.c_str());
+            } else {
+                printf("%s\"%s\":%s", i > 0 ? "," : "",
+                       row[i].first.c_str(), row[i].second.c_str());
+            }
+        }
+        printf("%s\n", csv ? "" : "}");
+        fflush(stdout);
+        row.clear();
+    }
+
+  private:
+    bool csv;
+    bool headerPrinted;
+    std::vector<std::pair<std::string, std::string>> row;
+};
+
+#endif /* REPORT_HH */
@@ -0,0 +1,902 @@
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <RaptorQ.hpp>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "common.hh"
+#include "congestion_control.hh"
+#include "encoder_planner.hh"
+#include "feedback.hh"
+#include "impairment.hh"
+#include "pacer.hh"
+#include "report.hh"
+#include "scheduler.hh"
+#include "wire_format.hh"
+
+/**
+ * Runs whole transfers on a virtual clock: the sender's Scheduler,
+ * congestion controller and pacer against a model of the receiver that
+ * sends the same ACKs, over an impaired link in each direction (see
+ * Impairment::Link). The codec is replaced by a count of the symbols each
+ * block has received: a block decodes with the probability RaptorQ gives
+ * for that many symbols, and decoding and precomputing blocks take fixed
+ * times. Runs are deterministic for a given configuration and run number,
+ * and a transfer of tens of gigabytes takes seconds, so that policies can
+ * be swept over thousands of configurations. Prints one CSV row per
+ * configuration and run.
+ */
+
+/**
+ * Size of a data packet on the wire, as the sender's pacer counts it.
+ */
+const size_t PACKET_SIZE = sizeof(WireFormat::DataPacket);
+
+/**
+ * Probability that a block fails to decode with as many symbols as source
+ * symbols; each extra symbol divides it by as much again (RFC 6330).
+ */
+const double DECODE_FAILURE_RATE = 0.01;
+
+struct SimOptions {
+    std::vector<uint64_t> fileSizes;
+    std::vector<double> lossRates;
+    std::vector<double> meanBursts;
+    std::vector<uint64_t> delaysUs;
+    std::vector<uint64_t> rates;
+    std::vector<std::string> controllers;
+    std::vector<uint32_t> overheads;
+    std::vector<uint64_t> heartbeatsUs;
+    uint64_t jitterUs;
+    uint64_t queueUs;
+
+    // Whether the ACKs are lost as much as the data
+    bool lossyAcks;
+
+    // Sender's -r: upper bound on the pacing rate in bytes per second, and
+    // the rate of the "fixed" controller; 0 for the sender's default
+    uint64_t maxRate;
+
+    // Blocks the receiver takes in at a time; 0 for all of them
+    size_t blockWindow;
+
+    // Decoding workers of the receiver, and the time to decode a block
+    unsigned workers;
+    uint64_t decodeUs;
+
+    // Precomputing threads of the sender, and the time to precompute a
+    // block
+    unsigned cores;
+    uint64_t precomputeUs;
+
+    // The receiver sends one ACK for the data packets that arrive within
+    // this long of each other, as it does for each recvmmsg()
+    uint64_t ackBatchUs;
+
+    int runs;
+
+    // Virtual time after which a transfer is given up on
+    uint64_t timeoutUs;
+
+    SimOptions()
+        : fileSizes {16 << 20}
+        , lossRates {0, 0.01, 0.05, 0.2}
+        , meanBursts {0}
+        , delaysUs {10000}
+        , rates {100 * 1000000 / 8}
+        , controllers {"bbr"}
+        , overheads {0}
+        , heartbeatsUs {uint64_t(HEARTBEAT_INTERVAL.count()) * 1000}
+        , jitterUs(0)
+        , queueUs(50000)
+        , lossyAcks(false)
+        , maxRate(0)
+        , blockWindow(0)
+        , workers(4)
+        , decodeUs(0)
+        , cores(4)
+        , precomputeUs(0)
+        , ackBatchUs(0)
+        , runs(1)
+        , timeoutUs(3600000000)
+    {}
+};
+
+struct Configuration {
+    uint64_t fileSize;
+    double lossRate;
+    double meanBurst;
+    uint64_t delayUs;
+    uint64_t rate;
+    std::string controller;
+    uint32_t overhead;
+    uint64_t heartbeatUs;
+
+    Configuration()
+        : fileSize(0)
+        , lossRate(0)
+        , meanBurst(0)
+        , delayUs(0)
+        , rate(0)
+        , controller()
+        , overhead(0)
+        , heartbeatUs(0)
+    {}
+};
+
+/**
+ * Returns every combination of the values given on the command line.
+ */
+std::vector<Configuration>
+sweep(const SimOptions& options)
+{
+    std::vector<Configuration> configurations;
+    Configuration c;
+    for (uint64_t fileSize : options.fileSizes) {
+        c.fileSize = fileSize;
+        for (double lossRate : options.lossRates) {
+            c.lossRate = lossRate;
+            for (double meanBurst : options.meanBursts) {
+                c.meanBurst = meanBurst;
+                for (uint64_t delayUs : options.delaysUs) {
+                    c.delayUs = delayUs;
+                    for (uint64_t rate : options.rates) {
+                        c.rate = rate;
+                        for (const auto& controller : options.controllers) {
+                            c.controller = controller;
+                            for (uint32_t overhead : options.overheads) {
+                                c.overhead = overhead;
+                                for (uint64_t interval : options.heartbeatsUs) {
+                                    c.heartbeatUs = interval;
+                                    configurations.push_back(c);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return configurations;
+}
+
+/**
+ * Returns the number of source symbols of each block of a file, numbered
+ * across segments, split as the sender's EncoderPlanner would for the
+ * sender's -r and the configuration's overhead.
+ */
+std::vector<uint32_t>
+blockLayout(const SimOptions& options, const Configuration& configuration)
+{
+    uint64_t fileSize = configuration.fileSize;
+    uint32_t symbolsPerBlock = EncoderPlanner(options.cores, 0,
+            options.maxRate, configuration.overhead).plan(fileSize)
+            .symbolsPerBlock;
+    uint64_t numSegments = std::max<uint64_t>(1,
+            (fileSize + SEGMENT_SIZE - 1) / SEGMENT_SIZE);
+    std::vector<uint32_t> blocks;
+    for (uint64_t segment = 0; segment < numSegments; segment++) {
+        BlockPartition partition(segment + 1 < numSegments ? SEGMENT_SIZE
+                : fileSize - segment * SEGMENT_SIZE, symbolsPerBlock);
+        for (uint32_t i = 0; i < partition.numBlocks(); i++) {
+            blocks.push_back(partition.blockSymbols(i));
+        }
+    }
+    return blocks;
+}
+
+/**
+ * One transfer, from the handshake on; the handshake itself is left out.
+ */
+class Simulation {
+  public:
+    Simulation(const SimOptions& options, const Configuration& configuration,
+               int run);
+
+    /**
+     * Runs the transfer until both ends are done, or the timeout.
+     *
+     * \return
+     *      False if the transfer timed out.
+     */
+    bool run();
+
+    void report(Report& report, int run, bool ok, uint64_t wallNs) const;
+
+  private:
+    enum EventType {
+        // The sender wakes up from a wait
+        SENDER_WAKE,
+        // A data packet reaches the receiver
+        DATA_ARRIVAL,
+        // An ACK reaches the sender
+        ACK_ARRIVAL,
+        // The receiver sends the ACK for the packets of a batch
+        ACK_BATCH_END,
+        // A decoding worker is done with a block
+        BLOCK_DECODED,
+        // The receiver's periodic ACK
+        HEARTBEAT,
+        // A data packet has bounced off the receiver, which has exited
+        REFUSED
+    };
+
+    struct Event {
+        uint64_t time;
+
+        // Tells apart events at the same time, first come first served
+        uint64_t order;
+
+        EventType type;
+
+        // DATA_ARRIVAL: the sequence number, block and sending time of the
+        // packet; ACK_ARRIVAL: the slot of the ACK in ackSlots
+        uint32_t seq;
+        size_t block;
+        uint64_t sendTime;
+
+        bool operator>(const Event& other) const
+        {
+            return time != other.time ? time > other.time
+                                      : order > other.order;
+        }
+    };
+
+    void schedule(uint64_t time, EventType type, uint32_t seq = 0,
+                  size_t block = 0, uint64_t sendTime = 0);
+
+    /**
+     * Sender: decides what to send and sends it as the congestion window
+     * and the pacer allow, as transmit() and flushBatch() do with batches
+     * of one packet, until it has to wait.
+     */
+    void runSender(uint64_t now);
+    void wakeSenderAt(uint64_t time);
+    void processAck(const std::string& payload, uint64_t now);
+
+    /**
+     * Receiver: takes in data packets and decoded blocks, and sends ACKs.
+     */
+    void receiveDataPacket(const Event& event, uint64_t now);
+    void onBlockDecoded(size_t block, uint64_t now);
+    void sendAck(uint64_t now);
+    void sendFeedbackAck(uint64_t now);
+    void sendToSender(const char* data, size_t length, uint64_t now);
+    size_t windowEnd() const
+    {
+        return std::min(firstUndecoded + window, decodedBlocks.size());
+    }
+
+    const SimOptions& options;
+    const Configuration& configuration;
+
+    const std::vector<uint32_t> blockSymbols;
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>>
+            events;
+    uint64_t nextOrder;
+
+    // Current time, for the precomputed() callback of the scheduler
+    uint64_t clock;
+
+    Impairment::Link forward;
+    Impairment::Link reverse;
+
+    // ACKs on their way to the sender; free slots are reused
+    std::vector<std::string> ackSlots;
+    std::vector<size_t> freeSlots;
+
+    // Sender
+    TransmissionState tx;
+    Scheduler scheduler;
+    Pacer pacer;
+    uint64_t maxRate;
+    bool pending;
+    Scheduler::Decision decision;
+    uint64_t wakeAt;
+    bool senderDone;
+    uint64_t senderDoneTime;
+    uint64_t sourceSent;
+    uint64_t repairSent;
+    uint64_t timeouts;
+
+    // Receiver
+    Bitmask decodedBlocks;
+    size_t numDecoded;
+    size_t window;
+    size_t firstUndecoded;
+    std::vector<uint16_t> symbolsReceived;
+    size_t blocksSeen;
+    std::vector<bool> decoding;
+    std::vector<uint64_t> workerBusyUntil;
+    FeedbackRecorder feedback;
+    bool batchOpen;
+    bool receiverDone;
+    uint64_t receiverDoneTime;
+    bool refused;
+    uint64_t symbolsUseless;
+    uint64_t symbolsOutsideWindow;
+    uint64_t decodeFailures;
+    std::mt19937 generator;
+    std::uniform_real_distribution<double> uniform;
+
+    DISALLOW_COPY_AND_ASSIGN(Simulation)
+};
+
+Impairment::LinkConfig
+forwardLink(const SimOptions& options, const Configuration& configuration)
+{
+    Impairment::LinkConfig link;
+    link.lossRate = configuration.lossRate;
+    link.meanBurst = configuration.meanBurst;
+    link.delayUs = configuration.delayUs;
+    link.jitterUs = options.jitterUs;
+    link.rate = configuration.rate;
+    link.queueUs = options.queueUs;
+    return link;
+}
+
+Impairment::LinkConfig
+reverseLink(const SimOptions& options, const Configuration& configuration)
+{
+    Impairment::LinkConfig link;
+    if (options.lossyAcks) {
+        link.lossRate = configuration.lossRate;
+        link.meanBurst = configuration.meanBurst;
+    }
+    link.delayUs = configuration.delayUs;
+    link.jitterUs = options.jitterUs;
+    return link;
+}
+
+/**
+ * The sender's default for its -r, which the "fixed" controller sends at.
+ */
+uint64_t
+fixedRate(const SimOptions& options)
+{
+    return options.maxRate > 0 ? options.maxRate
+                               : PACKET_SIZE * 1000000 / 350;
+}
+
+Simulation::Simulation(const SimOptions& options,
+                       const Configuration& configuration, int run)
+    : options(options)
+    , configuration(configuration)
+    , blockSymbols(blockLayout(options, configuration))
+    , events()
+    , nextOrder(0)
+    , clock(0)
+    , forward(forwardLink(options, configuration), uint32_t(run) * 2 + 1)
+    , reverse(reverseLink(options, configuration), uint32_t(run) * 2 + 2)
+    , ackSlots()
+    , freeSlots()
+    , tx(makeCongestionController(configuration.controller, PACKET_SIZE,
+                                  fixedRate(options)),
+         blockSymbols.size(),
+         options.blockWindow > 0 ? options.blockWindow : blockSymbols.size(),
+         configuration.overhead, 0)
+    , scheduler(tx, blockSymbols,
+                [this](size_t block) {
+                    return this->options.precomputeUs == 0 ||
+                           clock >= (block / this->options.cores + 1) *
+                                    this->options.precomputeUs;
+                },
+                true)
+    , pacer(PACER_BURST_INTERVAL_US, PACKET_SIZE, 0)
+    , maxRate(options.maxRate)
+    , pending(false)
+    , decision()
+    , wakeAt(0)
+    , senderDone(false)
+    , senderDoneTime(0)
+    , sourceSent(0)
+    , repairSent(0)
+    , timeouts(0)
+    , decodedBlocks(blockSymbols.size())
+    , numDecoded(0)
+    , window(options.blockWindow > 0 ? options.blockWindow
+                                     : blockSymbols.size())
+    , firstUndecoded(0)
+    , symbolsReceived(blockSymbols.size(), 0)
+    , blocksSeen(0)
+    , decoding(blockSymbols.size(), false)
+    , workerBusyUntil(options.workers, 0)
+    , feedback()
+    , batchOpen(false)
+    , receiverDone(false)
+    , receiverDoneTime(0)
+    , refused(false)
+    , symbolsUseless(0)
+    , symbolsOutsideWindow(0)
+    , decodeFailures(0)
+    , generator(uint32_t(run))
+    , uniform(0, 1)
+{
+}
+
+void
+Simulation::schedule(uint64_t time, EventType type, uint32_t seq,
+                     size_t block, uint64_t sendTime)
+{
+    events.push({time, nextOrder++, type, seq, block, sendTime});
+}
+
+bool
+Simulation::run()
+{
+    schedule(0, SENDER_WAKE);
+    schedule(configuration.heartbeatUs, HEARTBEAT);
+    while (!(senderDone && receiverDone) && !events.empty()) {
+        Event event = events.top();
+        events.pop();
+        uint64_t now = event.time;
+        if (now > options.timeoutUs) {
+            return false;
+        }
+        clock = now;
+        switch (event.type) {
+            case SENDER_WAKE:
+                // Only the latest wake-up counts; ACKs wake the sender too
+                if (now == wakeAt && !senderDone) {
+                    runSender(now);
+                }
+                break;
+            case DATA_ARRIVAL:
+                receiveDataPacket(event, now);
+                break;
+            case ACK_ARRIVAL:
+                if (!senderDone) {
+                    processAck(ackSlots[event.block], now);
+                    runSender(now);
+                }
+                freeSlots.push_back(event.block);
+                break;
+            case ACK_BATCH_END:
+                batchOpen = false;
+                if (!receiverDone) {
+                    sendFeedbackAck(now);
+                }
+                break;
+            case BLOCK_DECODED:
+                onBlockDecoded(event.block, now);
+                break;
+            case HEARTBEAT:
+                if (!receiverDone) {
+                    sendAck(now);
+                    schedule(now + configuration.heartbeatUs, HEARTBEAT);
+                }
+                break;
+            case REFUSED:
+                // The sender's next recv() fails with ECONNREFUSED
+                if (!senderDone) {
+                    tx.markAllDecoded();
+                    runSender(now);
+                }
+                break;
+        }
+    }
+    return senderDone && receiverDone;
+}
+
+void
+Simulation::wakeSenderAt(uint64_t time)
+{
+    // Waits are always in the future, so a wake-up at the same time as the
+    // latest one is still to come
+    if (time != wakeAt) {
+        wakeAt = time;
+        schedule(time, SENDER_WAKE);
+    }
+}
+
+void
+Simulation::runSender(uint64_t now)
+{
+    while (1) {
+        if (tx.inflight() > 0 &&
+                now - tx.lastFeedbackTime > tx.retransmissionTimeout()) {
+            timeouts++;
+        }
+        tx.checkTimeout(now);
+
+        if (!pending) {
+            decision = scheduler.next(now, tx.nextSeq);
+            if (decision.action == Scheduler::DONE) {
+                senderDone = true;
+                senderDoneTime = now;
+                return;
+            }
+            if (decision.action == Scheduler::WAIT) {
+                wakeSenderAt(now + PRECOMPUTE_POLL_MS * 1000);
+                return;
+            }
+            pending = true;
+        }
+        if (tx.finished()) {
+            // The batch is dropped, as flushBatch() does
+            pending = false;
+            continue;
+        }
+
+        uint64_t rate = tx.controller->pacingRate();
+        if (maxRate > 0) {
+            rate = std::min(rate, maxRate);
+        }
+        pacer.setRate(rate, now);
+        if (tx.inflight() >= tx.controller->congestionWindow()) {
+            wakeSenderAt(std::max(now + 1, tx.lastFeedbackTime +
+                                           tx.retransmissionTimeout()));
+            return;
+        }
+        uint64_t waitUs = pacer.waitTime(PACKET_SIZE, now);
+        if (waitUs > 0) {
+            wakeSenderAt(now + waitUs);
+            return;
+        }
+
+        uint32_t seq = tx.nextSeq++;
+        uint64_t sendTime = pacer.reserve(PACKET_SIZE, now);
+        pacer.onSent(PACKET_SIZE, PACKET_SIZE, now);
+        if (decision.action == Scheduler::SOURCE) {
+            sourceSent++;
+        } else {
+            repairSent++;
+        }
+        uint64_t arrival = forward.send(now, PACKET_SIZE);
+        if (arrival != Impairment::Link::DROPPED) {
+            schedule(arrival, DATA_ARRIVAL, seq, decision.block, sendTime);
+        }
+        pending = false;
+    }
+}
+
+void
+Simulation::processAck(const std::string& payload, uint64_t now)
+{
+    const WireFormat::Ack* ack =
+            reinterpret_cast<const WireFormat::Ack*>(payload.data());
+    if (WireFormat::getOpcode(payload.data()) == WireFormat::EXTENDED_ACK) {
+        tx.onLossReport(*reinterpret_cast<const WireFormat::ExtendedAck*>(
+                                payload.data()),
+                        payload.size());
+    }
+    tx.onAck(*ack);
+    tx.onFeedback(ack->feedback, now);
+}
+
+void
+Simulation::receiveDataPacket(const Event& event, uint64_t now)
+{
+    if (receiverDone) {
+        // The receiver has exited; the sender hears of it once
+        if (!refused) {
+            refused = true;
+            schedule(now + configuration.delayUs, REFUSED);
+        }
+        return;
+    }
+
+    feedback.record(event.seq, event.sendTime, now);
+    size_t block = event.block;
+    if (decodedBlocks.test(block) || decoding[block]) {
+        symbolsUseless++;
+    } else if (block >= windowEnd()) {
+        symbolsOutsideWindow++;
+    } else {
+        uint16_t& received = symbolsReceived[block];
+        if (received < UINT16_MAX) {
+            received++;
+        }
+        blocksSeen = std::max(blocksSeen, block + 1);
+        if (received >= blockSymbols[block]) {
+            // Each symbol from the source symbols on is a decoding attempt,
+            // on the worker of the block
+            uint64_t& busyUntil =
+                    workerBusyUntil[block % workerBusyUntil.size()];
+            busyUntil = std::max(busyUntil, now) + options.decodeUs;
+            double failure = std::pow(DECODE_FAILURE_RATE,
+                                      received - blockSymbols[block] + 1);
+            if (uniform(generator) >= failure) {
+                decoding[block] = true;
+                schedule(busyUntil, BLOCK_DECODED, 0, block);
+            } else {
+                decodeFailures++;
+            }
+        }
+    }
+
+    if (options.ackBatchUs == 0) {
+        sendFeedbackAck(now);
+    } else if (!batchOpen) {
+        batchOpen = true;
+        schedule(now + options.ackBatchUs, ACK_BATCH_END);
+    }
+}
+
+void
+Simulation::onBlockDecoded(size_t block, uint64_t now)
+{
+    if (receiverDone) {
+        return;
+    }
+    decodedBlocks.set(block);
+    numDecoded++;
+    while (firstUndecoded < decodedBlocks.size() &&
+            decodedBlocks.test(firstUndecoded)) {
+        firstUndecoded++;
+    }
+    sendAck(now);
+    if (numDecoded == decodedBlocks.size()) {
+        for (int i = 0; i < FINAL_ACK_COPIES; i++) {
+            sendAck(now);
+        }
+        receiverDone = true;
+        receiverDoneTime = now;
+    }
+}
+
+void
+Simulation::sendAck(uint64_t now)
+{
+    size_t firstWord = firstUndecoded / 64;
+    WireFormat::Ack ack(0, downCast<uint32_t>(firstWord * 64),
+                        decodedBlocks.snapshot(firstWord, 4),
+                        downCast<uint32_t>(windowEnd()));
+    sendToSender(reinterpret_cast<const char*>(&ack), sizeof(ack), now);
+}
+
+void
+Simulation::sendFeedbackAck(uint64_t now)
+{
+    size_t firstWord = firstUndecoded / 64;
+    size_t first = firstWord * 64;
+    WireFormat::Ack ack(0, downCast<uint32_t>(first),
+                        decodedBlocks.snapshot(firstWord, 4),
+                        downCast<uint32_t>(windowEnd()),
+                        feedback.feedback(now));
+    std::vector<uint16_t> received;
+    if (blocksSeen > first) {
+        received.assign(symbolsReceived.begin() + first,
+                        symbolsReceived.begin() +
+                        std::min(first + 64 * 4, blocksSeen));
+    }
+    WireFormat::ExtendedAck extendedAck(ack,
+            uint16_t(std::min(feedback.lossRate() * 65536.0, 65535.0)),
+            received);
+    sendToSender(reinterpret_cast<const char*>(&extendedAck),
+                 extendedAck.length(), now);
+}
+
+void
+Simulation::sendToSender(const char* data, size_t length, uint64_t now)
+{
+    uint64_t arrival = reverse.send(now, length);
+    if (arrival == Impairment::Link::DROPPED) {
+        return;
+    }
+    size_t slot;
+    if (freeSlots.empty()) {
+        slot = ackSlots.size();
+        ackSlots.emplace_back();
+    } else {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    ackSlots[slot].assign(data, length);
+    schedule(arrival, ACK_ARRIVAL, 0, slot);
+}
+
+void
+Simulation::report(Report& report, int run, bool ok, uint64_t wallNs) const
+{
+    uint64_t completionUs = receiverDone ? receiverDoneTime : clock;
+    report.add("run", uint64_t(run))
+          .add("file_size", configuration.fileSize)
+          .add("loss_rate", configuration.lossRate)
+          .add("mean_burst", configuration.meanBurst)
+          .add("delay_ms", double(configuration.delayUs) / 1e3)
+          .add("jitter_ms", double(options.jitterUs) / 1e3)
+          .add("rate_mbps", double(configuration.rate) * 8 / 1e6)
+          .add("controller", configuration.controller)
+          .add("overhead", uint64_t(configuration.overhead))
+          .add("heartbeat_ms", double(configuration.heartbeatUs) / 1e3)
+          .add("ok", uint64_t(ok))
+          .add("completion_ms", double(completionUs) / 1e3)
+          .add("sender_ms", double(senderDone ? senderDoneTime : clock) / 1e3)
+          .add("goodput_mbps", double(configuration.fileSize) * 8 /
+                               double(std::max<uint64_t>(1, completionUs)))
+          .add("overhead_ratio", double(forward.packets * PACKET_SIZE) /
+                                 double(configuration.fileSize))
+          .add("source_symbols", sourceSent)
+          .add("repair_symbols", repairSent)
+          .add("useless_symbols", symbolsUseless)
+          .add("outside_window", symbolsOutsideWindow)
+          .add("decode_failures", decodeFailures)
+          .add("timeouts", timeouts)
+          .add("data_packets", forward.packets)
+          .add("data_lost", forward.lost)
+          .add("queue_drops", forward.overflows)
+          .add("ack_packets", reverse.packets)
+          .add("ack_lost", reverse.lost)
+          .add("wall_ms", double(wallNs) / 1e6)
+          .endRow();
+}
+
+void printUsage(char* command)
+{
+    std::cerr << "Usage: " << command << " [-Ah] [-s MB,...] [-l LOSS,...] [-B BURST,...] [-D MS,...] [-r MBPS,...] [-c CC,...] [-o OVERHEAD,...] [-H MS,...] [-j MS] [-q MS] [-m MBPS] [-w BLOCKS] [-W WORKERS] [-e US] [-P CORES] [-p US] [-b US] [-n RUNS] [-T SECONDS]" << std::endl;
+    std::cerr << "\t-h: help" << std::endl;
+    std::cerr << "\t-s: sizes of the file, in megabytes (default 16)" << std::endl;
+    std::cerr << "\t-l: fractions of the data packets lost (default 0,0.01,0.05,0.2)" << std::endl;
+    std::cerr << "\t-B: mean lengths of the bursts of losses, 0 for independent losses (default 0)" << std::endl;
+    std::cerr << "\t-D: one-way delays in milliseconds (default 10)" << std::endl;
+    std::cerr << "\t-r: rates of the bottleneck in Mbit/s, 0 for none (default 100)" << std::endl;
+    std::cerr << "\t-c: congestion controllers of the sender (default bbr)" << std::endl;
+    std::cerr << "\t-o: overheads of the sender, see its -o (default 0)" << std::endl;
+    std::cerr << "\t-H: intervals between the receiver's heartbeat ACKs in milliseconds (default " << HEARTBEAT_INTERVAL.count() << ")" << std::endl;
+    std::cerr << "\t-j: jitter of the delay in milliseconds (default 0)" << std::endl;
+    std::cerr << "\t-q: queue of the bottleneck in milliseconds (default 50)" << std::endl;
+    std::cerr << "\t-A: lose ACKs as much as data packets" << std::endl;
+    std::cerr << "\t-m: sender's -r in Mbit/s (default none)" << std::endl;
+    std::cerr << "\t-w: blocks the receiver takes in at a time, 0 for all (default 0)" << std::endl;
+    std::cerr << "\t-W: decoding workers of the receiver (default 4)" << std::endl;
+    std::cerr << "\t-e: time to decode a block in microseconds (default 0)" << std::endl;
+    std::cerr << "\t-P: precomputing threads of the sender (default 4)" << std::endl;
+    std::cerr << "\t-p: time to precompute a block in microseconds (default 0)" << std::endl;
+    std::cerr << "\t-b: the receiver ACKs the packets that arrive within this many microseconds at once (default 0)" << std::endl;
+    std::cerr << "\t-n: runs of each configuration (default 1)" << std::endl;
+    std::cerr << "\t-T: give up on a transfer after this many simulated seconds (default 3600)" << std::endl;
+}
+
+/**
+ * Parses a single non-negative number, multiplied by scale, into value.
+ */
+template<typename T>
+bool
+parseValue(const char* arg, double scale, T& value)
+{
+    std::vector<T> values;
+    if (!parseList(arg, scale, values) || values.size() != 1) {
+        return false;
+    }
+    value = values[0];
+    return true;
+}
+
+bool
+parseNames(const char* list, std::vector<std::string>& names)
+{
+    names.clear();
+    std::string s(list);
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = std::min(s.find(',', start), s.size());
+        names.push_back(s.substr(start, end - start));
+        if (!makeCongestionController(names.back(), PACKET_SIZE, 1)) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+int parseArgs(int argc, char* argv[], SimOptions& options)
+{
+    int c;
+    while ((c = getopt(argc, argv,
+                       "s:l:B:D:r:c:o:H:j:q:Am:w:W:e:P:p:b:n:T:h")) != -1) {
+        bool ok = true;
+        double seconds;
+        switch (c) {
+            case 's':
+                ok = parseList(optarg, 1 << 20, options.fileSizes) &&
+                     *std::min_element(options.fileSizes.begin(),
+                                       options.fileSizes.end()) > 0 &&
+                     *std::max_element(options.fileSizes.begin(),
+                                       options.fileSizes.end()) <=
+                     MAX_FILE_SIZE;
+                break;
+            case 'l':
+                ok = parseList(optarg, 1, options.lossRates) &&
+                     *std::max_element(options.lossRates.begin(),
+                                       options.lossRates.end()) < 1;
+                break;
+            case 'B':
+                ok = parseList(optarg, 1, options.meanBursts);
+                break;
+            case 'D':
+                ok = parseList(optarg, 1000, options.delaysUs);
+                break;
+            case 'r':
+                ok = parseList(optarg, 1000000 / 8, options.rates);
+                break;
+            case 'c':
+                ok = parseNames(optarg, options.controllers);
+                break;
+            case 'o':
+                ok = parseList(optarg, 1, options.overheads);
+                break;
+            case 'H':
+                ok = parseList(optarg, 1000, options.heartbeatsUs) &&
+                     *std::min_element(options.heartbeatsUs.begin(),
+                                       options.heartbeatsUs.end()) > 0;
+                break;
+            case 'j':
+                ok = parseValue(optarg, 1000, options.jitterUs);
+                break;
+            case 'q':
+                ok = parseValue(optarg, 1000, options.queueUs);
+                break;
+            case 'A':
+                options.lossyAcks = true;
+                break;
+            case 'm':
+                ok = parseValue(optarg, 1000000 / 8, options.maxRate);
+                break;
+            case 'w':
+                ok = parseValue(optarg, 1, options.blockWindow);
+                break;
+            case 'W':
+                ok = parseValue(optarg, 1, options.workers) &&
+                     options.workers > 0;
+                break;
+            case 'e':
+                ok = parseValue(optarg, 1, options.decodeUs);
+                break;
+            case 'P':
+                ok = parseValue(optarg, 1, options.cores) && options.cores > 0;
+                break;
+            case 'p':
+                ok = parseValue(optarg, 1, options.precomputeUs);
+                break;
+            case 'b':
+                ok = parseValue(optarg, 1, options.ackBatchUs);
+                break;
+            case 'n':
+                options.runs = std::atoi(optarg);
+                ok = options.runs > 0;
+                break;
+            case 'T':
+                ok = parseValue(optarg, 1, seconds) && seconds > 0;
+                options.timeoutUs = ok ? uint64_t(seconds * 1e6) : 0;
+                break;
+            default:
+                ok = false;
+        }
+        if (!ok) {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind != argc) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    SimOptions options;
+    if (parseArgs(argc, argv, options) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    Report report(true);
+    std::vector<Configuration> configurations = sweep(options);
+    for (int run = 0; run < options.runs; run++) {
+        for (const Configuration& configuration : configurations) {
+            uint64_t start = nowNs();
+            Simulation simulation(options, configuration, run);
+            bool ok = simulation.run();
+            simulation.report(report, run, ok, nowNs() - start);
+        }
+    }
+    return EXIT_SUCCESS;
+}
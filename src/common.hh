@@ -1,8 +1,13 @@
 #ifndef COMMON_HH
 #define COMMON_HH
 
+#include <algorithm>
+#include <atomic>
 #include <bitset>
 #include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -29,7 +34,8 @@ typedef uint32_t Alignment;
 constexpr size_t SYMBOL_SIZE = (1400 / ALIGNMENT_SIZE) * ALIGNMENT_SIZE;
 
 /**
- * The maximum number of blocks is 256, which can be fit into a uint8_t integer.
+ * The maximum number of blocks of an encoder is 256, which can be fit into a
+ * uint8_t integer.
  */
 #define MAX_BLOCKS 256
 
@@ -39,25 +45,58 @@ constexpr size_t SYMBOL_SIZE = (1400 / ALIGNMENT_SIZE) * ALIGNMENT_SIZE;
 #define MAX_SYMBOLS_PER_BLOCK 56403
 
 /**
- * Given our choice of SYMBOL_SIZE to avoid IP fragmentation, the maximum size
- * of the file we can support is 20214835200 bytes, or ~20GBs.
+ * Files are split into segments that are encoded independently, each of
+ * BLOCKS_PER_SEGMENT * SYMBOLS_PER_BLOCK symbols. Fixing the segment size
+ * keeps the encoding cost of a file proportional to its size, and lets the
+ * segments be precomputed in parallel; how a segment is split into blocks
+ * is up to EncoderPlanner. A segment is a whole number of symbols, so only
+ * the last one ends with padding.
  */
-constexpr uint64_t MAX_FILE_SIZE = MAX_BLOCKS * MAX_SYMBOLS_PER_BLOCK *
-        SYMBOL_SIZE;
+#define SYMBOLS_PER_BLOCK 64
+#define BLOCKS_PER_SEGMENT 128
+constexpr uint64_t SEGMENT_SIZE = uint64_t(BLOCKS_PER_SEGMENT) *
+        SYMBOLS_PER_BLOCK * SYMBOL_SIZE;
 
 /**
- * Initial value of the repair symbol transmission interval. It must be set
- * to a relatively small number because the sender will only get a more
- * accurate estimated value from the receiver once it has decoded the first
- * block. If we set this initial value too high and we are under a high packet
- * loss environment, the sender may end up using this initial value even after
- * all the source symbols have been transmitted and none of the blocks has been
- * successfully decoded by the receiver.
- *
- * Right now, we conservatively assume the packet loss rate p is 10%. So the
- * initial interval is set to 1( = (1-p)/p).
+ * A file can have up to 2^32 - 1 segments, i.e. ~49 PB with our choice of
+ * SYMBOL_SIZE; before files were split into segments, a single encoder
+ * limited them to ~20 GB (MAX_BLOCKS * MAX_SYMBOLS_PER_BLOCK * SYMBOL_SIZE).
+ */
+constexpr uint64_t MAX_FILE_SIZE = UINT32_MAX * SEGMENT_SIZE;
+
+/**
+ * Packet loss rate the sender assumes until the receiver reports one, which
+ * takes a round trip. It errs on the high side: a block sent with too few
+ * repair symbols costs another round trip to top up, whereas a few extra
+ * repair symbols for the blocks of the first round trip cost little.
  */
-#define INIT_REPAIR_SYMBOL_INTERVAL 9
+#define INIT_LOSS_RATE 0.1
+
+/**
+ * The sender's pacer releases packets in micro-bursts that span this many
+ * microseconds at the pacing rate, so that the sender wakes up at most a
+ * few thousand times per second however fast the link is.
+ */
+#define PACER_BURST_INTERVAL_US 250
+
+/**
+ * When all the blocks left to send repair symbols for are still being
+ * precomputed, the sender processes ACKs for up to this many milliseconds
+ * before checking again.
+ */
+#define PRECOMPUTE_POLL_MS 1
+
+/**
+ * Number of copies of the final ACK sent over UDP, so that the sender learns
+ * about the end of the transfer even if some of them are lost.
+ */
+#define FINAL_ACK_COPIES 3
+
+/**
+ * Time between two snapshots of the metrics exported with -M, in
+ * milliseconds.
+ */
+#define METRICS_INTERVAL_MS 1000
 
 constexpr size_t NUM_ALIGN_PER_SYMBOL = SYMBOL_SIZE / ALIGNMENT_SIZE;
 
@@ -69,6 +108,37 @@ typedef RaptorQ::Decoder<Alignment*, Alignment*> RaptorQDecoder;
 
 typedef RaptorQ::Symbol_Iterator<Alignment*, Alignment*> RaptorQSymbolIterator;
 
+/**
+ * The decoder state of a block being received is estimated at this many
+ * times the size of the block: the symbols received, plus the matrices
+ * used to decode them.
+ */
+const size_t DECODER_MEMORY_FACTOR = 2;
+
+/**
+ * Instantiates a RaptorQ encoder for the data in [begin, end), with blocks
+ * of at most symbolsPerBlock symbols, as chosen by EncoderPlanner.
+ *
+ * \return
+ *      The encoder, or nullptr if the data does not fit in MAX_BLOCKS such
+ *      blocks.
+ */
+inline std::unique_ptr<RaptorQEncoder>
+makeEncoder(Alignment* begin, Alignment* end, uint32_t symbolsPerBlock)
+{
+    std::unique_ptr<RaptorQEncoder> encoder {
+            new RaptorQEncoder(begin,
+                               end,
+                               SYMBOL_SIZE, /* no interleaving */
+                               SYMBOL_SIZE,
+                               symbolsPerBlock * SYMBOL_SIZE)
+    };
+    if (!*encoder) {
+        return nullptr;
+    }
+    return encoder;
+}
+
 const static std::chrono::duration<int64_t, std::milli> HEARTBEAT_INTERVAL =
         std::chrono::milliseconds(50);
 
@@ -96,11 +166,15 @@ downCast(const Large& large)
     return small;
 }
 
-uint32_t
+/**
+ * Returns a random number, e.g. a connection id. Unlike rand() seeded with
+ * the time, senders started within the same second get different ones.
+ */
+inline uint32_t
 generateRandom()
 {
-    std::srand(std::time(0));
-    return std::rand();
+    std::random_device device;
+    return device();
 }
 
 /**
@@ -148,79 +222,197 @@ void sendInWireFormat(UDPSocket* socket,
 }
 
 /**
- * A bit mask of 256 bits.
+ * Same as above, but to the given address, e.g. from a socket shared by
+ * many peers.
  */
-struct Bitmask256 {
-
-    std::bitset<64> bitset[4];
-
-    std::mutex mutex;
+template<typename T, typename... Args>
+void sendInWireFormatTo(UDPSocket* socket,
+                        const Address& peer,
+                        Args&&... args)
+{
+    char raw[sizeof(T)];
+    new(raw) T(static_cast<Args&&>(args)...);
+    socket->sendbytesto(peer, raw, sizeof(T));
+}
 
-    Bitmask256()
-        : bitset {0, 0, 0, 0}
-        , mutex()
-    {}
+/**
+ * A bit mask of an arbitrary number of bits (e.g. one per block) that any
+ * number of threads may update and read without locking: every operation
+ * but snapshot() boils down to one atomic instruction per 64-bit word.
+ * Bits can only be set, never cleared, which is what makes snapshot()
+ * consistent.
+ */
+class Bitmask {
+  public:
+    explicit Bitmask(size_t numBits)
+        : numBits(numBits)
+        , numWords((numBits + 63) / 64)
+        , words(new std::atomic<uint64_t>[numWords])
+    {
+        for (size_t i = 0; i < numWords; i++) {
+            words[i].store(0, std::memory_order_relaxed);
+        }
+    }
 
-    explicit
-    Bitmask256(const uint64_t bitmask[4])
-        : bitset {bitmask[0], bitmask[1], bitmask[2], bitmask[3]}
-        , mutex()
-    {}
+    size_t size() const
+    {
+        return numBits;
+    }
 
     /**
-     * Performs bitwise OR operation with another bit mask.
+     * Sets the bits that are set in another bit mask, given as count
+     * 64-bit words (least significant bit first) that line up with our
+     * words from firstWord on. Bits beyond size() are ignored.
+     *
+     * \return
+     *      The number of bits that were not set before.
      */
-    void bitwiseOr(const Bitmask256& other)
+    size_t bitwiseOr(const uint64_t* other, size_t count,
+                     size_t firstWord = 0)
     {
-        Guard _(mutex);
-        bitset[0] |= other.bitset[0];
-        bitset[1] |= other.bitset[1];
-        bitset[2] |= other.bitset[2];
-        bitset[3] |= other.bitset[3];
+        size_t newlySet = 0;
+        for (size_t i = firstWord;
+                i < numWords && i < firstWord + count; i++) {
+            uint64_t bits = other[i - firstWord] & validBits(i);
+            if (bits) {
+                uint64_t old = words[i].fetch_or(bits,
+                                                 std::memory_order_release);
+                newlySet += __builtin_popcountll(bits & ~old);
+            }
+        }
+        return newlySet;
     }
 
     /**
-     * Returns the number of bits that are set to true.
+     * Returns the number of bits that are set to true. Bits are never
+     * cleared, so one pass over the words counts at least every bit set
+     * before the call, without a snapshot().
      */
-    uint8_t count()
+    size_t count() const
     {
-        Guard _(mutex);
-        return downCast<uint8_t>(bitset[0].count() + bitset[1].count()
-                + bitset[2].count() + bitset[3].count());
+        size_t count = 0;
+        for (size_t i = 0; i < numWords; i++) {
+            count += __builtin_popcountll(
+                    words[i].load(std::memory_order_relaxed));
+        }
+        return count;
     }
 
     /**
      * Sets the n-th bit in the bit mask.
      */
-    void set(uint8_t n, bool value = true)
+    void set(size_t n)
     {
-        Guard _(mutex);
-        bitset[n / 64].set(n % 64, value);
+        words[n / 64].fetch_or(uint64_t(1) << (n % 64),
+                               std::memory_order_release);
     }
 
     /**
      * Sets first N bits in the bit mask to be 1;
      */
-    void setFirstN(uint8_t n) {
-        for (uint8_t i = 0; i < n; i++) {
-            set(i);
+    void setFirstN(size_t n)
+    {
+        setRange(0, n);
+    }
+
+    /**
+     * Sets the bits from begin to end (excluded).
+     *
+     * \return
+     *      The number of bits that were not set before.
+     */
+    size_t setRange(size_t begin, size_t end)
+    {
+        size_t newlySet = 0;
+        end = std::min(end, numBits);
+        for (size_t i = begin / 64; i < numWords && 64 * i < end; i++) {
+            uint64_t mask = end - 64 * i >= 64 ? ~uint64_t(0)
+                    : (uint64_t(1) << (end - 64 * i)) - 1;
+            if (begin > 64 * i) {
+                mask &= ~((uint64_t(1) << (begin - 64 * i)) - 1);
+            }
+            uint64_t old = words[i].fetch_or(mask & validBits(i),
+                                             std::memory_order_release);
+            newlySet += __builtin_popcountll(mask & validBits(i) & ~old);
         }
+        return newlySet;
     }
 
     /**
      * Tests the n-th bit in the bit mask.
      */
-    bool test(uint8_t n)
+    bool test(size_t n) const
+    {
+        return words[n / 64].load(std::memory_order_acquire) &
+               (uint64_t(1) << (n % 64));
+    }
+
+    /**
+     * Returns the index of the first bit that is not set, or size() if all
+     * of them are.
+     */
+    size_t firstClear() const
     {
-        Guard _(mutex);
-        return bitset[n / 64].test(n % 64);
+        for (size_t i = 0; i < numWords; i++) {
+            uint64_t word = words[i].load(std::memory_order_acquire);
+            if (word != validBits(i)) {
+                return 64 * i + __builtin_ctzll(~word);
+            }
+        }
+        return numBits;
+    }
+
+    /**
+     * Returns the words of the bit mask (or the count words from firstWord
+     * on, padded with zeros past the end) as they were at one instant, even
+     * if other threads set bits meanwhile. The words are read until two
+     * passes in a row agree; since bits are never cleared, nothing can
+     * have changed in between.
+     */
+    std::vector<uint64_t> snapshot(size_t firstWord = 0,
+                                   size_t count = SIZE_MAX) const
+    {
+        std::vector<uint64_t> current = load(firstWord, count);
+        while (1) {
+            std::vector<uint64_t> next = load(firstWord, count);
+            if (next == current) {
+                return current;
+            }
+            current.swap(next);
+        }
+    }
+
+  private:
+    /**
+     * Reads the words one by one.
+     */
+    std::vector<uint64_t> load(size_t firstWord, size_t count) const
+    {
+        if (count == SIZE_MAX) {
+            count = numWords - std::min(firstWord, numWords);
+        }
+        std::vector<uint64_t> result(count);
+        for (size_t i = 0; i < result.size(); i++) {
+            result[i] = firstWord + i < numWords ?
+                    words[firstWord + i].load(std::memory_order_acquire) : 0;
+        }
+        return result;
     }
 
-    std::array<std::bitset<64>, 4> toBitsetArray() {
-        Guard _(mutex);
-        return std::array<std::bitset<64>, 4>{
-                bitset[0], bitset[1], bitset[2], bitset[3]};
+    /**
+     * Mask of the bits of word i that are part of the bit mask.
+     */
+    uint64_t validBits(size_t i) const
+    {
+        return 64 * (i + 1) <= numBits ? ~uint64_t(0)
+                : (uint64_t(1) << (numBits - 64 * i)) - 1;
     }
+
+    const size_t numBits;
+    const size_t numWords;
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+    DISALLOW_COPY_AND_ASSIGN(Bitmask)
 };
 
 template<typename Alignment>
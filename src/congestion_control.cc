@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <limits>
+
+#include "congestion_control.hh"
+
+/**
+ * Round-trip time assumed before the first sample, in microseconds.
+ */
+static const double INITIAL_RTT = 100000;
+
+/**
+ * Microseconds per second.
+ */
+static const double MICROS_PER_SEC = 1e6;
+
+FixedRateController::FixedRateController(uint64_t rate)
+    : rate(rate)
+{}
+
+void
+FixedRateController::onAck(const AckSample& sample)
+{
+    (void) sample;
+}
+
+void
+FixedRateController::onTimeout()
+{}
+
+uint32_t
+FixedRateController::congestionWindow() const
+{
+    return std::numeric_limits<uint32_t>::max();
+}
+
+uint64_t
+FixedRateController::pacingRate() const
+{
+    return rate;
+}
+
+/**
+ * Parameters of LEDBAT; see RFC 6817, section 2.5 for the recommended values.
+ */
+namespace Ledbat {
+// Maximum queuing delay we are willing to add, in microseconds
+const int64_t TARGET = 100000;
+const double GAIN = 1.0;
+// Number of one-minute base delay minima remembered
+const size_t BASE_HISTORY = 10;
+const uint64_t BASE_ROLLOVER_INTERVAL = 60000000;
+// Number of delay samples filtered into the current delay
+const size_t CURRENT_FILTER = 4;
+const double INIT_CWND = 2;
+const double MIN_CWND = 2;
+const double ALLOWED_INCREASE = 1;
+// Pacing spreads a window over slightly less than a round trip
+const double PACING_GAIN = 1.25;
+}
+
+LedbatController::LedbatController(size_t packetSize)
+    : packetSize(packetSize)
+    , cwnd(Ledbat::INIT_CWND)
+    , ssthresh(std::numeric_limits<double>::max())
+    , srtt(INITIAL_RTT)
+    , baseDelays()
+    , lastRollover(0)
+    , currentDelays()
+    , lastDecrease(0)
+{}
+
+void
+LedbatController::updateBaseDelay(uint64_t now, int64_t delay)
+{
+    if (baseDelays.empty() ||
+            now - lastRollover > Ledbat::BASE_ROLLOVER_INTERVAL) {
+        baseDelays.push_back(delay);
+        lastRollover = now;
+        if (baseDelays.size() > Ledbat::BASE_HISTORY) {
+            baseDelays.pop_front();
+        }
+    } else {
+        baseDelays.back() = std::min(baseDelays.back(), delay);
+    }
+
+    currentDelays.push_back(delay);
+    if (currentDelays.size() > Ledbat::CURRENT_FILTER) {
+        currentDelays.pop_front();
+    }
+}
+
+void
+LedbatController::onAck(const AckSample& sample)
+{
+    srtt = 0.875 * srtt + 0.125 * static_cast<double>(sample.rtt);
+    updateBaseDelay(sample.now, sample.oneWayDelay);
+
+    if (sample.newlyLost > 0) {
+        if (sample.now - lastDecrease > srtt) {
+            cwnd = std::max(cwnd / 2, Ledbat::MIN_CWND);
+            ssthresh = cwnd;
+            lastDecrease = sample.now;
+        }
+        return;
+    }
+
+    int64_t queuingDelay =
+            *std::min_element(currentDelays.begin(), currentDelays.end()) -
+            *std::min_element(baseDelays.begin(), baseDelays.end());
+    if (cwnd < ssthresh) {
+        if (queuingDelay < Ledbat::TARGET / 2) {
+            cwnd += sample.newlyAcked;
+            return;
+        }
+        // Delay is building up: the pipe is full
+        ssthresh = cwnd;
+    }
+
+    double offTarget = static_cast<double>(Ledbat::TARGET - queuingDelay) /
+                       Ledbat::TARGET;
+    cwnd += Ledbat::GAIN * offTarget * sample.newlyAcked / cwnd;
+
+    // Do not grow the window beyond what the sender actually uses
+    double maxAllowedCwnd = sample.inflight + sample.newlyAcked +
+                            Ledbat::ALLOWED_INCREASE;
+    cwnd = std::max(std::min(cwnd, maxAllowedCwnd), Ledbat::MIN_CWND);
+}
+
+void
+LedbatController::onTimeout()
+{
+    ssthresh = std::max(cwnd / 2, Ledbat::MIN_CWND);
+    cwnd = Ledbat::MIN_CWND;
+}
+
+uint32_t
+LedbatController::congestionWindow() const
+{
+    return static_cast<uint32_t>(cwnd);
+}
+
+uint64_t
+LedbatController::pacingRate() const
+{
+    double gain = cwnd < ssthresh ? 2 * Ledbat::PACING_GAIN
+                                  : Ledbat::PACING_GAIN;
+    return static_cast<uint64_t>(
+            gain * cwnd * packetSize * MICROS_PER_SEC / srtt);
+}
+
+/**
+ * Parameters of the BBR-style controller, following the values used by BBR
+ * version 1.
+ */
+namespace Bbr {
+// 2/ln(2), the smallest gain that doubles the delivery rate every round
+const double HIGH_GAIN = 2.885;
+const double CWND_GAIN = 2;
+const double GAIN_CYCLE[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+const int GAIN_CYCLE_LENGTH = sizeof(GAIN_CYCLE) / sizeof(GAIN_CYCLE[0]);
+// Number of round trips the bottleneck bandwidth estimate is kept for
+const uint64_t BW_WINDOW_ROUNDS = 10;
+// Startup ends after this many rounds without 25% bandwidth growth
+const int FULL_BW_ROUNDS = 3;
+const double FULL_BW_THRESHOLD = 1.25;
+const double INIT_CWND = 10;
+const double MIN_CWND = 4;
+}
+
+BbrController::BbrController(size_t packetSize)
+    : packetSize(packetSize)
+    , mode(STARTUP)
+    , pacingGain(Bbr::HIGH_GAIN)
+    , delivered(0)
+    , roundCount(0)
+    , roundEndSeq(0)
+    , roundStartTime(0)
+    , roundStartDelivered(0)
+    , bandwidthSamples()
+    , minRtt(0)
+    , ackBurst(0)
+    , lastAckBurst(0)
+    , fullBandwidth(0)
+    , roundsWithoutGrowth(0)
+    , cycleIndex(0)
+{}
+
+double
+BbrController::bottleneckBandwidth() const
+{
+    double bandwidth = 0;
+    for (const auto& sample : bandwidthSamples) {
+        bandwidth = std::max(bandwidth, sample.second);
+    }
+    return bandwidth;
+}
+
+double
+BbrController::bdp() const
+{
+    if (bandwidthSamples.empty() || minRtt == 0) {
+        return Bbr::INIT_CWND;
+    }
+    return bottleneckBandwidth() * static_cast<double>(minRtt) / MICROS_PER_SEC;
+}
+
+void
+BbrController::endRound(const AckSample& sample)
+{
+    if (roundStartTime > 0 && sample.now > roundStartTime) {
+        double rate = static_cast<double>(delivered - roundStartDelivered) *
+                MICROS_PER_SEC / static_cast<double>(sample.now - roundStartTime);
+        bandwidthSamples.emplace_back(roundCount, rate);
+    }
+    roundCount++;
+    while (!bandwidthSamples.empty() &&
+            bandwidthSamples.front().first + Bbr::BW_WINDOW_ROUNDS < roundCount) {
+        bandwidthSamples.pop_front();
+    }
+
+    roundEndSeq = sample.nextSeq;
+    roundStartTime = sample.now;
+    roundStartDelivered = delivered;
+    lastAckBurst = ackBurst;
+    ackBurst = 0;
+}
+
+void
+BbrController::advanceMode(const AckSample& sample)
+{
+    double bandwidth = bottleneckBandwidth();
+    switch (mode) {
+        case STARTUP:
+            if (bandwidth >= fullBandwidth * Bbr::FULL_BW_THRESHOLD) {
+                fullBandwidth = bandwidth;
+                roundsWithoutGrowth = 0;
+            } else if (++roundsWithoutGrowth >= Bbr::FULL_BW_ROUNDS) {
+                mode = DRAIN;
+                pacingGain = 1 / Bbr::HIGH_GAIN;
+            }
+            break;
+        case DRAIN:
+            if (sample.inflight <= bdp()) {
+                mode = PROBE_BW;
+                cycleIndex = 0;
+                pacingGain = Bbr::GAIN_CYCLE[cycleIndex];
+            }
+            break;
+        case PROBE_BW:
+            cycleIndex = (cycleIndex + 1) % Bbr::GAIN_CYCLE_LENGTH;
+            pacingGain = Bbr::GAIN_CYCLE[cycleIndex];
+            break;
+    }
+}
+
+void
+BbrController::onAck(const AckSample& sample)
+{
+    if (minRtt == 0 || sample.rtt < minRtt) {
+        minRtt = std::max<uint64_t>(sample.rtt, 1);
+    }
+    delivered += sample.newlyAcked;
+    ackBurst = std::max(ackBurst, sample.newlyAcked);
+
+    if (sample.highestSeq >= roundEndSeq) {
+        endRound(sample);
+        advanceMode(sample);
+    }
+}
+
+void
+BbrController::onTimeout()
+{
+    // The path may have changed completely; measure it again from scratch
+    mode = STARTUP;
+    pacingGain = Bbr::HIGH_GAIN;
+    bandwidthSamples.clear();
+    roundStartTime = 0;
+    fullBandwidth = 0;
+    roundsWithoutGrowth = 0;
+}
+
+uint32_t
+BbrController::congestionWindow() const
+{
+    double gain = mode == STARTUP ? Bbr::HIGH_GAIN : Bbr::CWND_GAIN;
+    double cwnd = gain * bdp() + std::max(ackBurst, lastAckBurst);
+    return static_cast<uint32_t>(std::max(cwnd, Bbr::MIN_CWND));
+}
+
+uint64_t
+BbrController::pacingRate() const
+{
+    double bandwidth = bottleneckBandwidth();
+    if (bandwidth == 0) {
+        bandwidth = Bbr::INIT_CWND * MICROS_PER_SEC /
+                (minRtt > 0 ? static_cast<double>(minRtt) : INITIAL_RTT);
+    }
+    return static_cast<uint64_t>(pacingGain * bandwidth * packetSize);
+}
+
+std::unique_ptr<CongestionController>
+makeCongestionController(const std::string& name, size_t packetSize,
+                         uint64_t fixedRate)
+{
+    if (name == "fixed") {
+        return std::unique_ptr<CongestionController>(
+                new FixedRateController(fixedRate));
+    } else if (name == "ledbat") {
+        return std::unique_ptr<CongestionController>(
+                new LedbatController(packetSize));
+    } else if (name == "bbr") {
+        return std::unique_ptr<CongestionController>(
+                new BbrController(packetSize));
+    }
+    return nullptr;
+}
@@ -0,0 +1,280 @@
+#ifndef CONGESTION_CONTROL_HH
+#define CONGESTION_CONTROL_HH
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+/**
+ * Congestion signals extracted by the sender from one ACK that carries
+ * feedback about the data packets received so far.
+ */
+struct AckSample {
+    /**
+     * Time the ACK arrived, in microseconds (see timestamp_us()).
+     */
+    uint64_t now;
+
+    /**
+     * Number of data packets newly reported as received by this ACK.
+     */
+    uint32_t newlyAcked;
+
+    /**
+     * Number of data packets newly inferred as lost by this ACK.
+     */
+    uint32_t newlyLost;
+
+    /**
+     * Number of data packets sent but not yet reported received or lost.
+     */
+    uint32_t inflight;
+
+    /**
+     * Highest sequence number reported received so far.
+     */
+    uint32_t highestSeq;
+
+    /**
+     * Sequence number the sender will give to its next data packet.
+     */
+    uint32_t nextSeq;
+
+    /**
+     * Round-trip time sample in microseconds.
+     */
+    uint64_t rtt;
+
+    /**
+     * One-way delay sample in microseconds. It includes the unknown offset
+     * between the clocks of the two hosts, so only differences between
+     * samples are meaningful.
+     */
+    int64_t oneWayDelay;
+};
+
+/**
+ * Decides how fast the sender may transmit over a transport that does not
+ * do congestion control on its own (i.e. plain UDP).
+ */
+class CongestionController {
+  public:
+    virtual ~CongestionController() {}
+
+    /**
+     * Updates the controller with the feedback carried by one ACK.
+     */
+    virtual void onAck(const AckSample& sample) = 0;
+
+    /**
+     * Invoked when no feedback has arrived for a retransmission timeout;
+     * all packets in flight are then considered lost.
+     */
+    virtual void onTimeout() = 0;
+
+    /**
+     * Maximum number of data packets allowed in flight.
+     */
+    virtual uint32_t congestionWindow() const = 0;
+
+    /**
+     * Rate at which data packets should be paced, in bytes per second.
+     */
+    virtual uint64_t pacingRate() const = 0;
+
+    virtual const char* name() const = 0;
+};
+
+/**
+ * Sends at a constant rate regardless of feedback. This is what the sender
+ * used to do with a hardcoded usleep() between packets, and it remains the
+ * default on DCCP where the kernel takes care of congestion.
+ */
+class FixedRateController : public CongestionController {
+  public:
+    explicit FixedRateController(uint64_t rate);
+
+    void onAck(const AckSample& sample);
+    void onTimeout();
+    uint32_t congestionWindow() const;
+    uint64_t pacingRate() const;
+    const char* name() const { return "fixed"; }
+
+  private:
+    uint64_t rate;
+};
+
+/**
+ * Low Extra Delay Background Transport (RFC 6817). Grows the window in
+ * proportion to how far the measured queuing delay is below a target, so it
+ * fills the link while yielding to competing traffic. A slow start phase,
+ * ended by the first loss or delay build-up, gets us to link rate quickly on
+ * long fat pipes. Since every loss halves the window, it is slow on links
+ * with random loss.
+ */
+class LedbatController : public CongestionController {
+  public:
+    explicit LedbatController(size_t packetSize);
+
+    void onAck(const AckSample& sample);
+    void onTimeout();
+    uint32_t congestionWindow() const;
+    uint64_t pacingRate() const;
+    const char* name() const { return "ledbat"; }
+
+  private:
+    void updateBaseDelay(uint64_t now, int64_t delay);
+
+    size_t packetSize;
+
+    /**
+     * Congestion window in packets.
+     */
+    double cwnd;
+
+    /**
+     * Slow start threshold in packets.
+     */
+    double ssthresh;
+
+    /**
+     * Smoothed round-trip time in microseconds.
+     */
+    double srtt;
+
+    /**
+     * Minimum one-way delays of the last BASE_HISTORY minutes, newest last.
+     */
+    std::deque<int64_t> baseDelays;
+
+    /**
+     * Time at which the newest entry of baseDelays was started.
+     */
+    uint64_t lastRollover;
+
+    /**
+     * The last CURRENT_FILTER one-way delay samples.
+     */
+    std::deque<int64_t> currentDelays;
+
+    /**
+     * Time of the last multiplicative decrease; the window is halved at
+     * most once per round trip.
+     */
+    uint64_t lastDecrease;
+};
+
+/**
+ * A BBR-style controller: paces at a gain times the estimated bottleneck
+ * bandwidth (windowed max of the per-round delivery rate) and caps the data
+ * in flight at twice the estimated bandwidth-delay product. It ignores loss,
+ * which makes it suitable for long fat pipes with random loss.
+ */
+class BbrController : public CongestionController {
+  public:
+    explicit BbrController(size_t packetSize);
+
+    void onAck(const AckSample& sample);
+    void onTimeout();
+    uint32_t congestionWindow() const;
+    uint64_t pacingRate() const;
+    const char* name() const { return "bbr"; }
+
+  private:
+    enum Mode { STARTUP, DRAIN, PROBE_BW };
+
+    /**
+     * Estimated bottleneck bandwidth in packets per second, or 0 if there
+     * is no estimate yet.
+     */
+    double bottleneckBandwidth() const;
+
+    /**
+     * Estimated bandwidth-delay product in packets.
+     */
+    double bdp() const;
+
+    /**
+     * Closes the current round trip, which ends once a packet sent after
+     * its start is reported received, and takes a delivery rate sample.
+     */
+    void endRound(const AckSample& sample);
+
+    void advanceMode(const AckSample& sample);
+
+    size_t packetSize;
+
+    Mode mode;
+
+    /**
+     * Gain applied to the bottleneck bandwidth to get the pacing rate.
+     */
+    double pacingGain;
+
+    /**
+     * Total number of packets delivered so far.
+     */
+    uint64_t delivered;
+
+    /**
+     * Number of round trips completed so far.
+     */
+    uint64_t roundCount;
+
+    /**
+     * The current round ends when this sequence number is reported received.
+     */
+    uint32_t roundEndSeq;
+
+    /**
+     * Time and number of packets delivered at the start of the round.
+     */
+    uint64_t roundStartTime;
+    uint64_t roundStartDelivered;
+
+    /**
+     * (round, rate) delivery rate samples, in packets per second, kept for
+     * BW_WINDOW_ROUNDS round trips; their maximum is the bottleneck
+     * bandwidth estimate.
+     */
+    std::deque<std::pair<uint64_t, double>> bandwidthSamples;
+
+    /**
+     * Minimum round-trip time observed in microseconds, or 0 if unknown.
+     */
+    uint64_t minRtt;
+
+    /**
+     * Largest number of packets acknowledged by a single ACK in this round
+     * and the previous one; the receiver acknowledges packets in batches,
+     * so the window must leave room for that on top of the BDP.
+     */
+    uint32_t ackBurst;
+    uint32_t lastAckBurst;
+
+    /**
+     * Bandwidth at which the pipe was last found to be still growing, and
+     * the number of rounds since then; used to detect the end of startup.
+     */
+    double fullBandwidth;
+    int roundsWithoutGrowth;
+
+    /**
+     * Index into the PROBE_BW pacing gain cycle.
+     */
+    int cycleIndex;
+};
+
+/**
+ * Instantiates the congestion controller with the given name ("fixed",
+ * "ledbat" or "bbr").
+ *
+ * \return
+ *      The controller, or nullptr if the name is unknown.
+ */
+std::unique_ptr<CongestionController>
+makeCongestionController(const std::string& name, size_t packetSize,
+                         uint64_t fixedRate);
+
+#endif /* CONGESTION_CONTROL_HH */
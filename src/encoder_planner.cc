@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <iterator>
+#include <RaptorQ.hpp>
+
+#include "encoder_planner.hh"
+
+/**
+ * The values of K' of RFC 6330 (table 2 of section 5.6) up to
+ * MAX_PLANNED_SYMBOLS_PER_BLOCK, and the first one above it: the numbers
+ * of symbols the codec pads the blocks to.
+ */
+static const uint32_t PADDED_SYMBOLS[] = {
+    10, 12, 18, 20, 26, 30, 32, 36, 42, 46, 48, 49, 55, 60, 62, 69, 75, 84,
+    88, 91, 95, 97, 101, 114, 119, 125, 127, 138, 140, 149, 153, 160, 166,
+    168, 179, 181, 185, 187, 200, 213, 217, 225, 236, 242, 248, 257, 263,
+    269, 280, 295, 301, 307, 312, 324, 336, 348, 360, 372, 384, 396, 408,
+    420, 432, 444, 456, 468, 480, 492, 504, 516, 528, 540, 552, 564, 576,
+    588, 600, 612, 624, 636, 648, 660, 672, 684, 696, 708, 720, 732, 744,
+    756, 768, 780, 792, 804, 816, 828, 840, 852, 864, 876, 888, 900, 912,
+    924, 936, 948, 960, 972, 984, 996, 1008, 1032,
+};
+
+/**
+ * Time to precompute a block of K' symbols, in microseconds: a fixed cost
+ * (setting up the block and handing it to a thread) plus the Gaussian
+ * elimination, cubic in K'. Decoding does the same elimination, but is
+ * slower in libRaptorQ. The fixed cost is what puts the best block size of
+ * a file on one core at 62 symbols, which is what blocks of the former
+ * SYMBOLS_PER_BLOCK were padded to; the cubic terms are rough estimates,
+ * to be refitted with bench_encode and bench_decode on other hardware.
+ */
+static const double BLOCK_SETUP_US = 600;
+static const double PRECOMPUTE_US_PER_CUBED_SYMBOL = 1e-3;
+static const double DECODE_US_PER_CUBED_SYMBOL = 1.5e-3;
+
+uint32_t
+paddedSymbols(uint32_t numSymbols)
+{
+    const uint32_t* padded = std::lower_bound(std::begin(PADDED_SYMBOLS),
+                                              std::end(PADDED_SYMBOLS),
+                                              numSymbols);
+    return padded == std::end(PADDED_SYMBOLS) ? 0 : *padded;
+}
+
+BlockPartition::BlockPartition(uint64_t numBytes, uint32_t symbolsPerBlock)
+    : numSymbols(downCast<uint32_t>((numBytes + SYMBOL_SIZE - 1) /
+                                    SYMBOL_SIZE))
+    , numLarge(0)
+    , largeSymbols(0)
+    , numSmall(0)
+    , smallSymbols(0)
+{
+    // With sub-symbols as large as the symbols, KL(N_max) is the largest
+    // K' not above symbolsPerBlock
+    const uint32_t* upper = std::upper_bound(std::begin(PADDED_SYMBOLS),
+                                             std::end(PADDED_SYMBOLS),
+                                             symbolsPerBlock);
+    if (upper == std::begin(PADDED_SYMBOLS) || numSymbols == 0) {
+        return;
+    }
+    uint32_t maxSymbols = *(upper - 1);
+    uint32_t numBlocks = (numSymbols + maxSymbols - 1) / maxSymbols;
+    largeSymbols = (numSymbols + numBlocks - 1) / numBlocks;
+    smallSymbols = numSymbols / numBlocks;
+    numLarge = numSymbols - smallSymbols * numBlocks;
+    numSmall = numBlocks - numLarge;
+}
+
+EncoderPlanner::EncoderPlanner(unsigned cores,
+                               size_t receiverMemory,
+                               uint64_t rate,
+                               uint32_t overhead)
+    : cores(std::max(1u, cores))
+    , receiverMemory(receiverMemory)
+    , rate(rate)
+    , overhead(overhead)
+{
+}
+
+EncoderPlanner::Plan
+EncoderPlanner::plan(uint64_t dataSize) const
+{
+    Plan best = predict(dataSize, PADDED_SYMBOLS[0]);
+    for (uint32_t symbols : PADDED_SYMBOLS) {
+        if (symbols > MAX_PLANNED_SYMBOLS_PER_BLOCK) {
+            break;
+        }
+        Plan plan = predict(dataSize, symbols);
+        if (plan.numBlocks > 0 &&
+                (best.numBlocks == 0 || plan.costUs() < best.costUs())) {
+            best = plan;
+        }
+        // Larger blocks would all be the same single block
+        if (dataSize <= uint64_t(symbols) * SYMBOL_SIZE) {
+            break;
+        }
+    }
+    return best;
+}
+
+EncoderPlanner::Plan
+EncoderPlanner::predict(uint64_t dataSize, uint32_t symbolsPerBlock) const
+{
+    Plan plan = {symbolsPerBlock, 0, 0, 0, 0};
+    uint64_t fullSegments = dataSize / SEGMENT_SIZE;
+    BlockPartition full(SEGMENT_SIZE, symbolsPerBlock);
+    BlockPartition last(dataSize % SEGMENT_SIZE, symbolsPerBlock);
+    if ((fullSegments > 0 && !full.valid()) ||
+            (last.numSymbols > 0 && !last.valid())) {
+        return plan;
+    }
+    uint32_t largestBlock = 0;
+    addSegments(full, fullSegments, plan, largestBlock);
+    addSegments(last, 1, plan, largestBlock);
+    if (plan.numBlocks == 0) {
+        return plan;
+    }
+
+    // The blocks are spread over the cores, but a block is not split, and
+    // the receiver decodes no more blocks at a time than fit its memory
+    size_t decoders = cores;
+    if (receiverMemory > 0) {
+        decoders = std::max<size_t>(1, std::min<size_t>(cores,
+                receiverMemory / 2 / (DECODER_MEMORY_FACTOR *
+                                      largestBlock * SYMBOL_SIZE)));
+    }
+    double cubed = double(largestBlock) * largestBlock * largestBlock;
+    plan.precomputeUs = std::max(plan.precomputeUs / cores,
+            BLOCK_SETUP_US + PRECOMPUTE_US_PER_CUBED_SYMBOL * cubed);
+    plan.decodeUs = std::max(plan.decodeUs / double(decoders),
+            BLOCK_SETUP_US + DECODE_US_PER_CUBED_SYMBOL * cubed);
+    if (rate > 0) {
+        plan.overheadUs = double(plan.numBlocks) * overhead * SYMBOL_SIZE *
+                          1e6 / double(rate);
+    }
+    return plan;
+}
+
+void
+EncoderPlanner::addSegments(const BlockPartition& partition, uint64_t count,
+                            Plan& plan, uint32_t& largestBlock) const
+{
+    uint32_t sizes[2] = {partition.largeSymbols, partition.smallSymbols};
+    uint32_t counts[2] = {partition.numLarge, partition.numSmall};
+    for (int i = 0; i < 2; i++) {
+        if (count == 0 || counts[i] == 0) {
+            continue;
+        }
+        uint32_t padded = paddedSymbols(sizes[i]);
+        double blocks = double(count) * counts[i];
+        double cubed = double(padded) * padded * padded;
+        plan.precomputeUs += blocks *
+                (BLOCK_SETUP_US + PRECOMPUTE_US_PER_CUBED_SYMBOL * cubed);
+        plan.decodeUs += blocks *
+                (BLOCK_SETUP_US + DECODE_US_PER_CUBED_SYMBOL * cubed);
+        largestBlock = std::max(largestBlock, padded);
+    }
+    plan.numBlocks += count * partition.numBlocks();
+}
@@ -0,0 +1,163 @@
+#ifndef ENCODER_PLANNER_HH
+#define ENCODER_PLANNER_HH
+
+#include <cstdint>
+
+#include "common.hh"
+
+/**
+ * The planner does not consider blocks of more symbols than this: one
+ * takes about a second to precompute (see EncoderPlanner), so they never
+ * pay off, and the table of RFC 6330 it needs stops there.
+ */
+#define MAX_PLANNED_SYMBOLS_PER_BLOCK 1024
+
+/**
+ * Returns the number of symbols a block of numSymbols source symbols is
+ * padded to by the codec: the smallest K' of RFC 6330 (section 5.6) that
+ * is at least numSymbols, or 0 if it is beyond the planner's table.
+ */
+uint32_t paddedSymbols(uint32_t numSymbols);
+
+/**
+ * How RFC 6330 (section 4.4.1.2) splits data into source blocks, without
+ * sub-blocks: into as few blocks of at most symbolsPerBlock symbols as
+ * possible, the first numLarge of them with one symbol more than the
+ * others. It is what makeEncoder() gets from the codec, computed without
+ * instantiating an encoder.
+ */
+struct BlockPartition {
+    /**
+     * \param numBytes
+     *      Size of the data.
+     * \param symbolsPerBlock
+     *      Maximum number of symbols per block, as given to makeEncoder();
+     *      it counts as the largest K' not above it.
+     */
+    BlockPartition(uint64_t numBytes, uint32_t symbolsPerBlock);
+
+    uint32_t numBlocks() const
+    {
+        return numLarge + numSmall;
+    }
+
+    /**
+     * Returns the number of source symbols of a block.
+     */
+    uint32_t blockSymbols(uint32_t block) const
+    {
+        return block < numLarge ? largeSymbols : smallSymbols;
+    }
+
+    /**
+     * True if the codec accepts the partition: it has at most MAX_BLOCKS
+     * blocks, and symbolsPerBlock is at least the smallest K'.
+     */
+    bool valid() const
+    {
+        return largeSymbols > 0 && numBlocks() <= MAX_BLOCKS;
+    }
+
+    /**
+     * Number of source symbols of the data (Kt).
+     */
+    uint32_t numSymbols;
+
+    /**
+     * Number and size of the large blocks (ZL and KL), then of the small
+     * ones (ZS and KS).
+     */
+    uint32_t numLarge;
+    uint32_t largeSymbols;
+    uint32_t numSmall;
+    uint32_t smallSymbols;
+};
+
+/**
+ * Picks the number of symbols per block of the segments of a transfer by
+ * predicting, for each K' of RFC 6330, how long the sender takes to
+ * precompute the blocks on its cores and the receiver takes to decode
+ * them in its memory, instead of trying encoders until one is valid.
+ * Large blocks are cubic in their size to precompute and decode, whereas
+ * small ones make more of them, each with a fixed cost, more extra repair
+ * symbols to send, and fewer than there are cores for small files.
+ */
+class EncoderPlanner {
+  public:
+    /**
+     * What the planner predicts for a number of symbols per block.
+     */
+    struct Plan {
+        uint32_t symbolsPerBlock;
+
+        /**
+         * Number of blocks of all the segments; 0 if some segment would have
+         * more than MAX_BLOCKS, or there is no data.
+         */
+        size_t numBlocks;
+
+        /**
+         * Time for the sender to precompute all the blocks, and for the
+         * receiver to decode them, in microseconds.
+         */
+        double precomputeUs;
+        double decodeUs;
+
+        /**
+         * Time to send the extra repair symbols of all the blocks, in
+         * microseconds.
+         */
+        double overheadUs;
+
+        double costUs() const
+        {
+            return precomputeUs + decodeUs + overheadUs;
+        }
+    };
+
+    /**
+     * \param cores
+     *      Number of threads precomputing blocks at the sender; the
+     *      receiver is assumed to have as many decoding workers.
+     * \param receiverMemory
+     *      The receiver's memory limit (its -m) in bytes, which bounds the
+     *      number of blocks it decodes at a time, or 0 for none.
+     * \param rate
+     *      Sending rate in bytes per second, or 0 if unknown.
+     * \param overhead
+     *      Number of extra repair symbols per block; see Scheduler.
+     */
+    EncoderPlanner(unsigned cores,
+                   size_t receiverMemory,
+                   uint64_t rate,
+                   uint32_t overhead);
+
+    /**
+     * Returns the plan of least cost for dataSize bytes cut into segments
+     * of SEGMENT_SIZE bytes, all encoded with the same number of symbols
+     * per block.
+     */
+    Plan plan(uint64_t dataSize) const;
+
+    /**
+     * Returns the predictions for a given number of symbols per block.
+     */
+    Plan predict(uint64_t dataSize, uint32_t symbolsPerBlock) const;
+
+  private:
+    /**
+     * Adds the work of the blocks of count segments split as partition to
+     * a plan, and keeps track of the largest block once padded.
+     */
+    void addSegments(const BlockPartition& partition, uint64_t count,
+                     Plan& plan, uint32_t& largestBlock) const;
+
+    const unsigned cores;
+    const size_t receiverMemory;
+    const uint64_t rate;
+    const uint32_t overhead;
+
+    DISALLOW_COPY_AND_ASSIGN(EncoderPlanner)
+};
+
+#endif /* ENCODER_PLANNER_HH */
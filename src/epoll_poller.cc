@@ -0,0 +1,138 @@
+#include <stdexcept>
+
+#include "epoll_poller.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* maximum number of ready file descriptors handled per call */
+static const size_t MAX_EVENTS = 64;
+
+EpollPoller::EpollPoller()
+  : epoll_fd_( SystemCall( "epoll_create1", epoll_create1( EPOLL_CLOEXEC ) ) ),
+    actions_(),
+    registrations_(),
+    events_( MAX_EVENTS ),
+    interested_( 0 )
+{}
+
+void EpollPoller::add_action( EpollPoller::Action action )
+{
+  const int fd_num = action.fd.fd_num();
+  size_t index = 0;
+  while ( index < registrations_.size() and registrations_[ index ].fd_num != fd_num ) {
+    index++;
+  }
+
+  if ( index == registrations_.size() ) {
+    registrations_.push_back( { fd_num, {}, 0, false } );
+    epoll_event event;
+    zero( event );
+    event.data.u64 = index;
+    SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_ADD, fd_num, &event ) );
+  }
+
+  registrations_[ index ].actions.push_back( actions_.size() );
+  registrations_[ index ].conditional |= bool( action.when_interested );
+  actions_.push_back( action );
+  update( index );
+}
+
+void EpollPoller::update( const size_t registration_index )
+{
+  Registration & registration = registrations_[ registration_index ];
+
+  uint32_t events = 0;
+  for ( const size_t i : registration.actions ) {
+    const Action & action = actions_[ i ];
+    if ( not action.active
+	 or ( action.when_interested and not action.when_interested() ) ) {
+      continue;
+    }
+
+    /* don't poll in on fds that have had EOF */
+    if ( action.direction == Direction::In and action.fd.eof() ) {
+      continue;
+    }
+
+    /* POLLIN and POLLOUT have the same values as EPOLLIN and EPOLLOUT */
+    events |= action.direction;
+  }
+
+  if ( events == registration.events ) {
+    return;
+  }
+
+  epoll_event event;
+  zero( event );
+  event.events = events;
+  event.data.u64 = registration_index;
+  SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_MOD,
+				      registration.fd_num, &event ) );
+
+  interested_ += ( events != 0 ) - ( registration.events != 0 );
+  registration.events = events;
+}
+
+EpollPoller::Result EpollPoller::poll( const int & timeout_ms )
+{
+  /* only the actions that may change their mind are asked again */
+  for ( size_t i = 0; i < registrations_.size(); i++ ) {
+    if ( registrations_[ i ].conditional ) {
+      update( i );
+    }
+  }
+
+  /* Quit if no file descriptor is of interest */
+  if ( interested_ == 0 ) {
+    return Result::Type::Exit;
+  }
+
+  const int ready = SystemCall( "epoll_wait", epoll_wait( epoll_fd_.fd_num(), events_.data(),
+							   events_.size(), timeout_ms ) );
+  if ( ready == 0 ) {
+    return Result::Type::Timeout;
+  }
+
+  for ( int i = 0; i < ready; i++ ) {
+    const uint32_t revents = events_[ i ].events;
+    const size_t registration_index = events_[ i ].data.u64;
+
+    if ( revents & (EPOLLERR | EPOLLHUP) ) {
+      return Result::Type::Exit;
+    }
+
+    for ( const size_t action_index : registrations_[ registration_index ].actions ) {
+      Action & action = actions_[ action_index ];
+
+      /* we only want to call callback if revents includes
+	 the event we asked for */
+      if ( not ( revents & registrations_[ registration_index ].events & action.direction ) ) {
+	continue;
+      }
+
+      const auto count_before = action.service_count();
+      auto result = action.callback();
+
+      if ( count_before == action.service_count() ) {
+	throw runtime_error( "EpollPoller: busy wait detected: callback did not read/write fd" );
+      }
+
+      switch ( result.result ) {
+      case ResultType::Exit:
+	return Result( Result::Type::Exit, result.exit_status );
+      case ResultType::Cancel:
+	action.active = false;
+	/* fall through */
+      case ResultType::Continue:
+	break;
+      }
+    }
+
+    /* the callbacks may have hit EOF or cancelled themselves */
+    update( registration_index );
+  }
+
+  return Result::Type::Success;
+}
@@ -0,0 +1,57 @@
+#ifndef EPOLL_POLLER_HH
+#define EPOLL_POLLER_HH
+
+#include <cstdint>
+#include <vector>
+
+#include <sys/epoll.h>
+
+#include "file_descriptor.hh"
+#include "poller.hh"
+
+/* Poller on top of epoll: the kernel keeps the set of file descriptors
+   between calls, and each call only visits those that are ready. Actions
+   with a when_interested predicate still have it evaluated on every call,
+   and their interest is only updated in the kernel when it changes.
+   Registrations are level-triggered, since callbacks may leave data
+   unread (e.g. read a single batch of datagrams). */
+class EpollPoller
+{
+public:
+  typedef Poller::Action Action;
+  typedef Poller::Result Result;
+
+private:
+  /* the kernel takes one registration per file descriptor, shared by the
+     actions that read and write it */
+  struct Registration
+  {
+    int fd_num;
+    std::vector< size_t > actions;
+
+    /* events currently registered with the kernel */
+    uint32_t events;
+
+    /* true if an action on the fd has a when_interested predicate */
+    bool conditional;
+  };
+
+  FileDescriptor epoll_fd_;
+  std::vector< Action > actions_;
+  std::vector< Registration > registrations_;
+  std::vector< epoll_event > events_;
+
+  /* number of registrations with a non-empty event set */
+  size_t interested_;
+
+  /* re-evaluate which events the actions on a registration want */
+  void update( const size_t registration_index );
+
+public:
+  EpollPoller();
+
+  void add_action( Action action );
+  Result poll( const int & timeout_ms );
+};
+
+#endif /* EPOLL_POLLER_HH */
@@ -0,0 +1,59 @@
+#include <algorithm>
+#include <RaptorQ.hpp>
+
+#include "feedback.hh"
+
+FeedbackRecorder::FeedbackRecorder()
+    : latest()
+    , averageLoss(-1)
+    , sampleSent(0)
+    , sampleReceived(0)
+{
+}
+
+void
+FeedbackRecorder::record(uint32_t seq, uint64_t sendTime, uint64_t now)
+{
+    latest.packetsReceived++;
+    if (latest.packetsReceived == 1 || seq > latest.highestSeq) {
+        latest.highestSeq = seq;
+        latest.echoSendTime = sendTime;
+        latest.recvTime = now;
+    }
+
+    uint32_t sent = latest.highestSeq + 1;
+    if (sent - sampleSent < LOSS_SAMPLE_PACKETS) {
+        return;
+    }
+    // Reordering may let a stretch receive more packets than were sent
+    double sample = 1.0 - std::min(1.0,
+            double(latest.packetsReceived - sampleReceived) /
+            double(sent - sampleSent));
+    averageLoss = averageLoss < 0 ? sample
+            : averageLoss + (sample - averageLoss) * LOSS_RATE_GAIN;
+    sampleSent = sent;
+    sampleReceived = latest.packetsReceived;
+}
+
+WireFormat::CongestionFeedback
+FeedbackRecorder::feedback(uint64_t now) const
+{
+    // Kernel timestamps, moved to the monotonic clock, may land a little
+    // after the clock read by the caller
+    WireFormat::CongestionFeedback delayed = latest;
+    delayed.ackDelay = uint32_t(std::min<uint64_t>(
+            now > latest.recvTime ? now - latest.recvTime : 0,
+            UINT32_MAX));
+    return delayed;
+}
+
+double
+FeedbackRecorder::lossRate() const
+{
+    if (averageLoss >= 0) {
+        return averageLoss;
+    }
+    uint32_t sent = latest.highestSeq + 1;
+    return 1.0 - std::min(1.0, double(latest.packetsReceived) /
+                               double(sent));
+}
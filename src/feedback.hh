@@ -0,0 +1,76 @@
+#ifndef FEEDBACK_HH
+#define FEEDBACK_HH
+
+#include <cstdint>
+
+#include "wire_format.hh"
+
+/**
+ * The loss rate reported to the sender is a moving average of the loss
+ * over stretches of this many data packets sent, each weighing
+ * LOSS_RATE_GAIN in it.
+ */
+const uint32_t LOSS_SAMPLE_PACKETS = 64;
+const double LOSS_RATE_GAIN = 1.0 / 8;
+
+/**
+ * Keeps track of the feedback about the data packets received that the
+ * receiver sends back in its ACKs: the congestion feedback and the loss
+ * rate. It takes the time as an argument, so that the simulator can run it
+ * on a virtual clock.
+ */
+class FeedbackRecorder {
+  public:
+    FeedbackRecorder();
+
+    /**
+     * Accounts for a data packet.
+     *
+     * \param seq
+     *      DataPacket::seq of the packet.
+     * \param sendTime
+     *      DataPacket::sendTime of the packet.
+     * \param now
+     *      Time the packet was received, in microseconds.
+     */
+    void record(uint32_t seq, uint64_t sendTime, uint64_t now);
+
+    /**
+     * Returns the congestion feedback to send at a given time, in
+     * microseconds.
+     */
+    WireFormat::CongestionFeedback feedback(uint64_t now) const;
+
+    /**
+     * Returns the fraction of the data packets lost lately; until the first
+     * stretch is over, the loss so far is all we know.
+     */
+    double lossRate() const;
+
+    /**
+     * Highest sequence number received.
+     */
+    uint32_t highestSeq() const
+    {
+        return latest.highestSeq;
+    }
+
+  private:
+    WireFormat::CongestionFeedback latest;
+
+    /**
+     * Moving average of the loss over the stretches of LOSS_SAMPLE_PACKETS
+     * packets sent, seeded with the loss over the first one; -1 until the
+     * first stretch is over.
+     */
+    double averageLoss;
+
+    /**
+     * Number of data packets sent (as told by their sequence numbers) and
+     * received at the end of the latest stretch.
+     */
+    uint32_t sampleSent;
+    uint32_t sampleReceived;
+};
+
+#endif /* FEEDBACK_HH */
@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+
+#include "metrics.hh"
+#include "timestamp.hh"
+
+namespace Metrics {
+
+namespace {
+
+/**
+ * Percentiles reported for each histogram.
+ */
+const struct {
+    const char* name;
+    double fraction;
+} PERCENTILES[] = {{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}};
+
+/**
+ * Protects registry().
+ */
+std::mutex&
+registryMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+/**
+ * All the metrics alive, in the order they were constructed. Metrics are
+ * usually globals, so this is built before main() runs.
+ */
+std::vector<Metric*>&
+registry()
+{
+    static std::vector<Metric*> metrics;
+    return metrics;
+}
+
+/**
+ * Largest value that falls in bucket i of a Histogram.
+ */
+uint64_t
+bucketUpperBound(size_t i)
+{
+    return i == 0 ? 0 : i == 64 ? UINT64_MAX : (uint64_t(1) << i) - 1;
+}
+
+std::string
+toString(uint64_t v)
+{
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%" PRIu64, v);
+    return buffer;
+}
+
+std::string
+toString(int64_t v)
+{
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%" PRId64, v);
+    return buffer;
+}
+
+}
+
+Metric::Metric(const char* name)
+    : metricName(name)
+{
+    std::lock_guard<std::mutex> _(registryMutex());
+    registry().push_back(this);
+}
+
+Metric::~Metric()
+{
+    std::lock_guard<std::mutex> _(registryMutex());
+    std::vector<Metric*>& metrics = registry();
+    metrics.erase(std::remove(metrics.begin(), metrics.end(), this),
+                  metrics.end());
+}
+
+void
+Metric::csvColumns(std::vector<std::string>& columns) const
+{
+    columns.push_back(metricName);
+}
+
+Counter::Counter(const char* name)
+    : Metric(name)
+    , value(0)
+{}
+
+void
+Counter::appendJson(std::string& out) const
+{
+    out += toString(get());
+}
+
+void
+Counter::csvValues(std::vector<std::string>& values) const
+{
+    values.push_back(toString(get()));
+}
+
+Gauge::Gauge(const char* name)
+    : Metric(name)
+    , value(0)
+{}
+
+void
+Gauge::appendJson(std::string& out) const
+{
+    out += toString(get());
+}
+
+void
+Gauge::csvValues(std::vector<std::string>& values) const
+{
+    values.push_back(toString(get()));
+}
+
+Histogram::Histogram(const char* name)
+    : Metric(name)
+    , buckets()
+    , count(0)
+    , sum(0)
+    , max(0)
+{}
+
+uint64_t
+Histogram::percentile(double fraction) const
+{
+    // The buckets are read one by one while other threads may record, so
+    // their total may differ a little from count
+    uint64_t total = 0;
+    for (const auto& bucket : buckets) {
+        total += bucket.load(std::memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, uint64_t(fraction * double(total)));
+    uint64_t seen = 0;
+    uint64_t largest = max.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(bucketUpperBound(i), largest);
+        }
+    }
+    return largest;
+}
+
+void
+Histogram::appendJson(std::string& out) const
+{
+    out += "{\"count\":" + toString(count.load(std::memory_order_relaxed));
+    out += ",\"sum\":" + toString(sum.load(std::memory_order_relaxed));
+    out += ",\"max\":" + toString(max.load(std::memory_order_relaxed));
+    for (const auto& p : PERCENTILES) {
+        out += std::string(",\"") + p.name + "\":" +
+               toString(percentile(p.fraction));
+    }
+
+    // Only the buckets that are not empty, as [upper bound, count]
+    out += ",\"buckets\":[";
+    bool first = true;
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+        uint64_t n = buckets[i].load(std::memory_order_relaxed);
+        if (n == 0) {
+            continue;
+        }
+        out += std::string(first ? "" : ",") + "[" +
+               toString(bucketUpperBound(i)) + "," +
+               toString(n) + "]";
+        first = false;
+    }
+    out += "]}";
+}
+
+void
+Histogram::csvColumns(std::vector<std::string>& columns) const
+{
+    std::string prefix = std::string(name()) + "_";
+    columns.push_back(prefix + "count");
+    columns.push_back(prefix + "sum");
+    columns.push_back(prefix + "max");
+    for (const auto& p : PERCENTILES) {
+        columns.push_back(prefix + p.name);
+    }
+}
+
+void
+Histogram::csvValues(std::vector<std::string>& values) const
+{
+    values.push_back(toString(count.load(std::memory_order_relaxed)));
+    values.push_back(toString(sum.load(std::memory_order_relaxed)));
+    values.push_back(toString(max.load(std::memory_order_relaxed)));
+    for (const auto& p : PERCENTILES) {
+        values.push_back(toString(percentile(p.fraction)));
+    }
+}
+
+Exporter::Exporter(const std::string& path, const char* program,
+                   uint64_t intervalMs)
+    : file(fopen(path.c_str(), "w"))
+    , csv(path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0)
+    , program(program)
+    , intervalMs(intervalMs)
+    , start(timestamp_us())
+    , mutex()
+    , stopped()
+    , stopping(false)
+    , thread()
+{
+    if (!file) {
+        perror(path.c_str());
+        return;
+    }
+    if (csv) {
+        std::vector<std::string> columns {"program", "time_ms", "elapsed_ms",
+                                          "final"};
+        {
+            std::lock_guard<std::mutex> _(registryMutex());
+            for (Metric* metric : registry()) {
+                metric->csvColumns(columns);
+            }
+        }
+        for (size_t i = 0; i < columns.size(); i++) {
+            fprintf(file, "%s%s", i > 0 ? "," : "", columns[i].c_str());
+        }
+        fprintf(file, "\n");
+    }
+    thread = std::thread(&Exporter::exportLoop, this);
+}
+
+Exporter::~Exporter()
+{
+    if (!file) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        stopping = true;
+    }
+    stopped.notify_all();
+    thread.join();
+    dump(true);
+    fclose(file);
+}
+
+void
+Exporter::exportLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopped.wait_for(lock, std::chrono::milliseconds(intervalMs),
+                             [this] { return stopping; })) {
+        dump(false);
+    }
+}
+
+void
+Exporter::dump(bool final)
+{
+    uint64_t time = uint64_t(std::chrono::duration_cast<
+            std::chrono::milliseconds>(std::chrono::system_clock::now()
+            .time_since_epoch()).count());
+    uint64_t elapsed = (timestamp_us() - start) / 1000;
+
+    std::lock_guard<std::mutex> _(registryMutex());
+    std::string line;
+    if (csv) {
+        std::vector<std::string> values {program, toString(time),
+                                         toString(elapsed),
+                                         final ? "1" : "0"};
+        for (Metric* metric : registry()) {
+            metric->csvValues(values);
+        }
+        for (size_t i = 0; i < values.size(); i++) {
+            line += (i > 0 ? "," : "") + values[i];
+        }
+    } else {
+        line = std::string("{\"program\":\"") + program + "\",\"time_ms\":" +
+               toString(time) + ",\"elapsed_ms\":" + toString(elapsed) +
+               ",\"final\":" + (final ? "true" : "false") +
+               ",\"metrics\":{";
+        bool first = true;
+        for (Metric* metric : registry()) {
+            line += std::string(first ? "" : ",") + "\"" + metric->name() +
+                    "\":";
+            metric->appendJson(line);
+            first = false;
+        }
+        line += "}}";
+    }
+    fprintf(file, "%s\n", line.c_str());
+    fflush(file);
+}
+
+}
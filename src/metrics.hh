@@ -0,0 +1,206 @@
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Counters, gauges and histograms updated from the hot paths of the sender
+ * and the receiver, and exported as JSON or CSV by an Exporter. Updates are
+ * relaxed atomic operations: they take no lock and may be made from any
+ * thread. Metrics are meant to be defined as globals, which register
+ * themselves when they are constructed.
+ */
+namespace Metrics {
+
+/**
+ * A named metric. Snapshots of its value are written out by name.
+ */
+class Metric {
+  public:
+    /**
+     * \param name
+     *      Name of the metric in the output, in snake_case; must outlive
+     *      the metric.
+     */
+    explicit Metric(const char* name);
+    virtual ~Metric();
+
+    const char* name() const { return metricName; }
+
+    /**
+     * Appends the current value to out as a JSON value.
+     */
+    virtual void appendJson(std::string& out) const = 0;
+
+    /**
+     * Appends the names of the CSV columns of the metric to columns.
+     */
+    virtual void csvColumns(std::vector<std::string>& columns) const;
+
+    /**
+     * Appends the current value to values, one entry per column.
+     */
+    virtual void csvValues(std::vector<std::string>& values) const = 0;
+
+    Metric(const Metric&) = delete;
+    Metric& operator=(const Metric&) = delete;
+
+  private:
+    const char* metricName;
+};
+
+/**
+ * A count of events or bytes that only goes up.
+ */
+class Counter : public Metric {
+  public:
+    explicit Counter(const char* name);
+
+    void add(uint64_t n = 1)
+    {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    void appendJson(std::string& out) const;
+    void csvValues(std::vector<std::string>& values) const;
+
+  private:
+    std::atomic<uint64_t> value;
+};
+
+/**
+ * The latest value of a quantity that goes up and down, e.g. a window.
+ */
+class Gauge : public Metric {
+  public:
+    explicit Gauge(const char* name);
+
+    void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+
+    int64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    void appendJson(std::string& out) const;
+    void csvValues(std::vector<std::string>& values) const;
+
+  private:
+    std::atomic<int64_t> value;
+};
+
+/**
+ * The distribution of a quantity, e.g. a duration in microseconds, in
+ * power-of-two buckets: bucket 0 counts the zeros, and bucket i > 0 the
+ * values in [2^(i-1), 2^i). Percentiles are reported as the upper bound
+ * of the bucket they fall in.
+ */
+class Histogram : public Metric {
+  public:
+    explicit Histogram(const char* name);
+
+    void record(uint64_t v)
+    {
+        size_t bucket = v == 0 ? 0 : 64 - size_t(__builtin_clzll(v));
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t previous = max.load(std::memory_order_relaxed);
+        while (v > previous && !max.compare_exchange_weak(previous, v,
+                std::memory_order_relaxed)) {
+        }
+    }
+
+    /**
+     * \param fraction
+     *      In [0, 1].
+     * \return
+     *      An upper bound on the given percentile of the values recorded so
+     *      far, no larger than the largest one; 0 if there are none.
+     */
+    uint64_t percentile(double fraction) const;
+
+    void appendJson(std::string& out) const;
+    void csvColumns(std::vector<std::string>& columns) const;
+    void csvValues(std::vector<std::string>& values) const;
+
+  private:
+    static const size_t NUM_BUCKETS = 65;
+
+    std::atomic<uint64_t> buckets[NUM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+/**
+ * Writes snapshots of all the metrics to a file every interval from a
+ * thread of its own, and a last one when destroyed. Files whose name ends
+ * in ".csv" get a header line and one line per snapshot; any other file
+ * gets one JSON object per line and snapshot.
+ */
+class Exporter {
+  public:
+    /**
+     * \param path
+     *      File to write to; truncated.
+     * \param program
+     *      Name of the program, recorded in each snapshot.
+     * \param intervalMs
+     *      Time between two snapshots, in milliseconds.
+     */
+    Exporter(const std::string& path, const char* program,
+             uint64_t intervalMs);
+
+    /**
+     * Writes the final snapshot and closes the file.
+     */
+    ~Exporter();
+
+    /**
+     * \return
+     *      False if the file could not be opened, in which case nothing is
+     *      exported.
+     */
+    bool ok() const { return file != nullptr; }
+
+    Exporter(const Exporter&) = delete;
+    Exporter& operator=(const Exporter&) = delete;
+
+  private:
+    void exportLoop();
+
+    /**
+     * Writes a snapshot of all the metrics to the file.
+     */
+    void dump(bool final);
+
+    FILE* file;
+    bool csv;
+    const char* program;
+    const uint64_t intervalMs;
+
+    /**
+     * When the exporter was created, in microseconds (see timestamp_us()).
+     */
+    const uint64_t start;
+
+    /**
+     * Wakes up the export thread when the exporter is destroyed.
+     */
+    std::mutex mutex;
+    std::condition_variable stopped;
+    bool stopping;
+
+    std::thread thread;
+};
+
+}
+
+#endif /* METRICS_HH */
@@ -0,0 +1,125 @@
+#include <algorithm>
+
+#include "pacer.hh"
+
+/**
+ * Microseconds per second.
+ */
+static const double MICROS_PER_SEC = 1e6;
+
+Pacer::Pacer(uint64_t burstInterval, size_t minBurst, uint64_t lookahead)
+    : rate(1)
+    , burstInterval(burstInterval)
+    , minBurst(minBurst)
+    , lookahead(lookahead)
+    , tokens(static_cast<double>(minBurst))
+    , lastRefill(0)
+    , startTime(0)
+    , bytesSent(0)
+    , lastSendTime(0)
+    , targetBytes(0)
+    , lastRateChange(0)
+{}
+
+void
+Pacer::setRate(uint64_t newRate, uint64_t now)
+{
+    newRate = std::max<uint64_t>(newRate, 1);
+    if (newRate == rate) {
+        return;
+    }
+    refill(now);
+    if (startTime > 0) {
+        targetBytes += static_cast<double>(rate) *
+                static_cast<double>(now - lastRateChange) / MICROS_PER_SEC;
+        lastRateChange = now;
+    }
+    rate = newRate;
+}
+
+size_t
+Pacer::burstSize() const
+{
+    return std::max(minBurst, static_cast<size_t>(
+            static_cast<double>(rate) * static_cast<double>(burstInterval) /
+            MICROS_PER_SEC));
+}
+
+void
+Pacer::refill(uint64_t now)
+{
+    if (now > lastRefill) {
+        // The bucket holds two bursts: one to send, and one to make up for
+        // waking up late, so that scheduler latency does not lower the rate
+        // while an idle period never lets us exceed it by more than that
+        tokens = std::min(tokens + static_cast<double>(rate) *
+                                  static_cast<double>(now - lastRefill) /
+                                  MICROS_PER_SEC,
+                          2 * static_cast<double>(burstSize()));
+    }
+    lastRefill = now;
+}
+
+uint64_t
+Pacer::waitTime(size_t bytes, uint64_t now)
+{
+    refill(now);
+    double credit = tokens + static_cast<double>(rate) *
+                             static_cast<double>(lookahead) / MICROS_PER_SEC;
+    if (credit >= static_cast<double>(bytes)) {
+        return 0;
+    }
+    return std::max<uint64_t>(1, static_cast<uint64_t>(
+            (static_cast<double>(bytes) - credit) * MICROS_PER_SEC /
+            static_cast<double>(rate)));
+}
+
+uint64_t
+Pacer::reserve(size_t bytes, uint64_t now)
+{
+    refill(now);
+    tokens -= static_cast<double>(bytes);
+    if (tokens >= 0) {
+        return now;
+    }
+    return now + static_cast<uint64_t>(-tokens * MICROS_PER_SEC /
+                                       static_cast<double>(rate));
+}
+
+void
+Pacer::onSent(size_t sent, size_t reserved, uint64_t now)
+{
+    if (reserved > sent) {
+        tokens += static_cast<double>(reserved - sent);
+    }
+    if (sent == 0) {
+        return;
+    }
+    if (startTime == 0) {
+        startTime = lastRateChange = now;
+    }
+    bytesSent += sent;
+    lastSendTime = now;
+}
+
+uint64_t
+Pacer::averageTargetRate() const
+{
+    if (lastSendTime <= startTime) {
+        return rate;
+    }
+    double total = targetBytes + static_cast<double>(rate) *
+            static_cast<double>(lastSendTime - lastRateChange) / MICROS_PER_SEC;
+    return static_cast<uint64_t>(total * MICROS_PER_SEC /
+                                 static_cast<double>(lastSendTime - startTime));
+}
+
+uint64_t
+Pacer::achievedRate() const
+{
+    if (lastSendTime <= startTime) {
+        return 0;
+    }
+    return static_cast<uint64_t>(static_cast<double>(bytesSent) *
+            MICROS_PER_SEC / static_cast<double>(lastSendTime - startTime));
+}
@@ -0,0 +1,124 @@
+#ifndef PACER_HH
+#define PACER_HH
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Releases packets at a target rate using a token bucket refilled against
+ * CLOCK_MONOTONIC (see timestamp_us()). Instead of waking up once per
+ * packet, which the scheduler cannot do precisely at high rates, the sender
+ * waits until a micro-burst worth of tokens has accumulated and sends the
+ * whole burst at once.
+ *
+ * When the kernel paces on our behalf (SO_TXTIME), the bucket may also go
+ * into debt by up to a lookahead interval: packets are then handed to the
+ * kernel early, each stamped with the departure time reserve() returns.
+ */
+class Pacer {
+  public:
+    Pacer(uint64_t burstInterval, size_t minBurst, uint64_t lookahead);
+
+    /**
+     * Changes the target rate, in bytes per second.
+     */
+    void setRate(uint64_t rate, uint64_t now);
+
+    /**
+     * Largest number of bytes worth sending in one micro-burst at the
+     * current rate; at least the minimum burst given to the constructor.
+     */
+    size_t burstSize() const;
+
+    /**
+     * \return
+     *      The number of microseconds to wait until the given number of
+     *      bytes may be handed to the kernel; 0 if they may be sent now.
+     */
+    uint64_t waitTime(size_t bytes, uint64_t now);
+
+    /**
+     * Takes the tokens for one packet out of the bucket.
+     *
+     * \return
+     *      The time the packet should leave the host, in microseconds; this
+     *      is after now only if the bucket is in debt (lookahead > 0).
+     */
+    uint64_t reserve(size_t bytes, uint64_t now);
+
+    /**
+     * Records that the kernel accepted the given number of bytes, and
+     * returns the tokens of reserved bytes that it refused.
+     */
+    void onSent(size_t sent, size_t reserved, uint64_t now);
+
+    /**
+     * Current target rate in bytes per second.
+     */
+    uint64_t targetRate() const { return rate; }
+
+    /**
+     * Target rate averaged over the time since the first packet was sent,
+     * in bytes per second.
+     */
+    uint64_t averageTargetRate() const;
+
+    /**
+     * Rate at which bytes were actually sent since the first packet, in
+     * bytes per second.
+     */
+    uint64_t achievedRate() const;
+
+  private:
+    /**
+     * Adds the tokens accumulated since the last refill.
+     */
+    void refill(uint64_t now);
+
+    /**
+     * Target rate in bytes per second.
+     */
+    uint64_t rate;
+
+    /**
+     * Time span covered by one micro-burst, in microseconds.
+     */
+    uint64_t burstInterval;
+
+    /**
+     * Smallest micro-burst in bytes (typically one packet).
+     */
+    size_t minBurst;
+
+    /**
+     * How far ahead of their departure time packets may be handed to the
+     * kernel, in microseconds.
+     */
+    uint64_t lookahead;
+
+    /**
+     * Bytes that may be sent right away; negative while in debt.
+     */
+    double tokens;
+
+    /**
+     * Time tokens were last added to the bucket.
+     */
+    uint64_t lastRefill;
+
+    /**
+     * Time the first packet was sent (0 if none yet) and bytes sent since.
+     */
+    uint64_t startTime;
+    uint64_t bytesSent;
+
+    /**
+     * Time of the latest send, and the integral of the target rate over
+     * time up to the latest rate change, in bytes.
+     */
+    uint64_t lastSendTime;
+    double targetBytes;
+    uint64_t lastRateChange;
+};
+
+#endif /* PACER_HH */
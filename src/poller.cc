@@ -25,7 +25,8 @@ Poller::Result Poller::poll( const int & timeout_ms )
   /* tell poll whether we care about each fd */
   for ( unsigned int i = 0; i < actions_.size(); i++ ) {
     assert( pollfds_.at( i ).fd == actions_.at( i ).fd.fd_num() );
-    pollfds_.at( i ).events = (actions_.at( i ).active and actions_.at( i ).when_interested())
+    pollfds_.at( i ).events = (actions_.at( i ).active
+			       and (not actions_.at( i ).when_interested or actions_.at( i ).when_interested()))
       ? actions_.at( i ).direction : 0;
 
     /* don't poll in on fds that have had EOF */
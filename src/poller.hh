@@ -26,13 +26,13 @@ public:
     FileDescriptor & fd;
     enum PollDirection : short { In = POLLIN, Out = POLLOUT } direction;
     CallbackType callback;
-    std::function<bool(void)> when_interested;
+    std::function<bool(void)> when_interested; /* empty: always interested */
     bool active;
 
     Action( FileDescriptor & s_fd,
 	    const PollDirection & s_direction,
 	    const CallbackType & s_callback,
-	    const std::function<bool(void)> & s_when_interested = [] () { return true; } )
+	    const std::function<bool(void)> & s_when_interested = std::function<bool(void)>() )
       : fd( s_fd ), direction( s_direction ), callback( s_callback ),
 	when_interested( s_when_interested ), active( true ) {}
 
@@ -1,95 +1,990 @@
 #include <iostream>
 #include <RaptorQ.hpp>
-#include <semaphore.h>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <unordered_map>
+#include <sys/statvfs.h>
 
-#include "tub.hh"
 #include "common.hh"
+#include "epoll_poller.hh"
+#include "feedback.hh"
+#include "metrics.hh"
+#include "ring_buffer.hh"
+#include "util.hh"
 #include "wire_format.hh"
 #include "progress.hh"
+#include "session.hh"
+#include "timestamp.hh"
+#include "timerfd.hh"
+#include "tracer.hh"
+#include "writeback.hh"
 
 int DEBUG_F;
 
+/**
+ * Receive over plain UDP instead of DCCP; see -u.
+ */
+int UDP_F;
+
+/**
+ * Keep receiving files from any number of senders at once; see -s and
+ * serve().
+ */
+int SERVE_F;
+
+/**
+ * Approximate ceiling on the memory used to receive a file, in bytes, or 0
+ * for none; see -m and blockWindow().
+ */
+size_t MEMORY_LIMIT;
+
+/**
+ * Largest file accepted, in bytes, or 0 for none but the free space of the
+ * current directory; see -f and checkHandshakeReq().
+ */
+uint64_t MAX_RECEIVE_SIZE;
+
+/**
+ * File to export the metrics to, or empty for none; see -M.
+ */
+std::string METRICS_FILE;
+
+/**
+ * File to write a trace of the transfers to, or empty for none; see -t.
+ */
+std::string TRACE_FILE;
+
+/**
+ * Metrics exported with -M; over all the transfers with -s.
+ */
+static Metrics::Counter packetsReceived("packets_received");
+static Metrics::Counter symbolsUseless("symbols_useless");
+static Metrics::Counter symbolsOutsideWindow("symbols_outside_window");
+static Metrics::Counter blocksDecoded("blocks_decoded");
+static Metrics::Counter bytesWritten("bytes_written");
+static Metrics::Counter acksSent("acks_sent");
+static Metrics::Histogram packetsPerRecv("packets_per_recv");
+static Metrics::Histogram decodeQueueDepth("decode_queue_depth");
+static Metrics::Histogram decodeTimeUs("decode_time_us");
+
+/**
+ * Total number of data packets queued between the network thread and the
+ * decoding workers; it is divided evenly among the workers.
+ */
 const int SHARED_QUEUE_SIZE = 10000;
-std::unique_ptr<WireFormat::DataPacket> symbolQueue[SHARED_QUEUE_SIZE];
-int qIn = 0, qOut = 0;
-sem_t qNonfull, qNonempty;
 
-void decodingLoop(RaptorQDecoder* decoder,      // only accessed from decoderThread
-                  const Address peerAddress,    // const
-                  const Alignment* fileStart,   // const
-                  Bitmask256* decodedBlocks)    // thread-safe
+/**
+ * Number of times an idle decoding worker polls its queue (yielding the CPU
+ * in between) before it goes to sleep until the network thread wakes it up.
+ */
+const int IDLE_POLLS = 100;
+
+/**
+ * Maximum number of datagrams pulled from the socket per recvmmsg() call.
+ */
+const size_t RECV_BATCH_SIZE = 64;
+
+/**
+ * Maximum number of bytes of decoded blocks being written back to disk at
+ * a time; see Writeback.
+ */
+const size_t WRITEBACK_BUDGET = 64 << 20;
+
+/**
+ * A sender that has not been heard from for this long is given up on. Once
+ * a transfer is over, its connection is forgotten after its sender has been
+ * quiet for this long.
+ */
+const uint64_t IDLE_TIMEOUT_US = 10000000;
+
+/**
+ * Returns the number of bytes a segment is encoded from, as told by its OTI
+ * (RFC 6330, section 3.3), or 0 unless it is an OTI our sender makes:
+ * SYMBOL_SIZE-byte symbols, no sub-blocks, Alignment-sized alignment, and
+ * at most a segment split into blocks of 1 to MAX_SYMBOLS_PER_BLOCK
+ * symbols. libRaptorQ divides by these fields without checking them.
+ */
+uint64_t otiBytes(RaptorQ::OTI_Common_Data common,
+                  RaptorQ::OTI_Scheme_Specific_Data scheme)
 {
-    UDPSocket udpSocket;
-    // TODO: avoid hardcode 6331
-    udpSocket.connect(Address(peerAddress.ip(), 6331));
+    uint64_t bytes = common >> 24;
+    uint64_t symbolSize = common & 0xffff;
+    uint64_t numBlocks = scheme >> 24;
+    uint64_t numSubBlocks = (scheme >> 8) & 0xffff;
+    uint64_t alignment = scheme & 0xff;
+    uint64_t numSymbols = (bytes + SYMBOL_SIZE - 1) / SYMBOL_SIZE;
+    if (symbolSize != SYMBOL_SIZE || numSubBlocks != 1 ||
+            alignment != ALIGNMENT_SIZE || bytes == 0 ||
+            bytes > SEGMENT_SIZE || numBlocks == 0 ||
+            numBlocks > numSymbols ||
+            (numSymbols + numBlocks - 1) / numBlocks > MAX_SYMBOLS_PER_BLOCK) {
+        return 0;
+    }
+    return bytes;
+}
+
+/**
+ * Returns why a handshake request cannot be accepted, or nullptr if it can.
+ * Requests come from unauthenticated peers, so nothing is computed from a
+ * request, nor is it printed, before it is checked here: its file name must
+ * end within the field and stay in the current directory, and its segment
+ * table and encoding parameters must describe fileSize bytes the way our
+ * sender does. The file must also be no larger than MAX_RECEIVE_SIZE and
+ * the free space of the current directory, which bounds what a request
+ * makes us allocate.
+ */
+const char* checkHandshakeReq(const WireFormat::HandshakeReq& req)
+{
+    if (!std::memchr(req.fileName, '\0', MAX_FILENAME_LEN) ||
+            !isValidName(req.fileName)) {
+        return "invalid file name";
+    }
+    uint64_t fileSize = req.fileSize;
+    uint32_t numSegments = req.numSegments;
+    if (req.segmentSize != SEGMENT_SIZE || fileSize == 0 ||
+            (fileSize - 1) / SEGMENT_SIZE + 1 != numSegments) {
+        return "invalid segment table";
+    }
+    struct statvfs fileSystem;
+    if ((MAX_RECEIVE_SIZE > 0 && fileSize > MAX_RECEIVE_SIZE) ||
+            statvfs(".", &fileSystem) != 0 ||
+            fileSize > uint64_t(fileSystem.f_bavail) * fileSystem.f_frsize) {
+        return "file too large";
+    }
+    uint64_t bytes = otiBytes(req.otiCommon, req.otiScheme);
+    uint64_t lastBytes = otiBytes(req.lastOtiCommon, req.lastOtiScheme);
+    if (bytes == 0 || (numSegments > 1 && bytes != SEGMENT_SIZE) ||
+            lastBytes < fileSize - (numSegments - 1) * SEGMENT_SIZE) {
+        return "invalid encoding parameters";
+    }
+    return nullptr;
+}
+
+/**
+ * Returns the number of blocks of the file, numbered across segments.
+ */
+size_t totalBlocks(const WireFormat::HandshakeReq& req)
+{
+    return (req.numSegments - 1) *
+           RaptorQDecoder(req.otiCommon, req.otiScheme).blocks() +
+           RaptorQDecoder(req.lastOtiCommon, req.lastOtiScheme).blocks();
+}
+
+/**
+ * Returns how many blocks, from the first one not decoded yet on, are
+ * received at a time. Under MEMORY_LIMIT, half of the memory goes to the
+ * decoder state of these blocks, and the rest to the symbol queues and the
+ * blocks being written back; symbols of later blocks are dropped.
+ */
+size_t blockWindow(const WireFormat::HandshakeReq& req)
+{
+    size_t numBlocks = totalBlocks(req);
+    if (MEMORY_LIMIT == 0) {
+        return numBlocks;
+    }
+    size_t blockSize =
+            RaptorQDecoder(req.otiCommon, req.otiScheme).block_size(0);
+    return std::max<size_t>(1, std::min(numBlocks, MEMORY_LIMIT / 2 /
+            (DECODER_MEMORY_FACTOR * blockSize)));
+}
+
+/**
+ * Returns the total number of data packets that may be queued between the
+ * network thread and the decoding workers.
+ */
+size_t sharedQueueSize()
+{
+    if (MEMORY_LIMIT == 0) {
+        return SHARED_QUEUE_SIZE;
+    }
+    return std::min<size_t>(SHARED_QUEUE_SIZE,
+            MEMORY_LIMIT / 4 / sizeof(WireFormat::DataPacket));
+}
 
-    size_t decoderPaddedSize = 0;
-    std::vector<Alignment*> blockStart(decoder->blocks() + 1);
-    blockStart[0] = const_cast<Alignment*>(fileStart);
-    for (uint8_t sbn = 0; sbn < decoder->blocks(); sbn++) {
-        blockStart[sbn + 1] = blockStart[sbn] +
-                              decoder->block_size(sbn) / ALIGNMENT_SIZE;
-        decoderPaddedSize += decoder->block_size(sbn);
+/**
+ * Returns the size of the file once all its segments are decoded, including
+ * the padding at the end of the last segment.
+ */
+size_t paddedFileSize(const WireFormat::HandshakeReq& req)
+{
+    RaptorQDecoder lastDecoder(req.lastOtiCommon, req.lastOtiScheme);
+    size_t size = (req.numSegments - 1) * req.segmentSize;
+    for (int i = 0; i < lastDecoder.blocks(); i++) {
+        size += lastDecoder.block_size(i);
     }
+    return size;
+}
+
 
-    std::chrono::time_point<std::chrono::system_clock> nextAckTime =
-            std::chrono::system_clock::now() + HEARTBEAT_INTERVAL;
+class DecoderPool;
+
+/**
+ * A file being received: the file itself, which blocks of it are decoded,
+ * and where the ACKs go. The symbols are decoded by a DecoderPool, which
+ * any number of transfers may share.
+ *
+ * To bound memory, the state of each block is freed as soon as it is
+ * decoded, and only the symbols of a window of blocks from the first one not
+ * decoded yet on are accepted; see blockWindow().
+ */
+class Transfer {
+  public:
+    /**
+     * Creates the file the handshake request describes.
+     *
+     * \param req
+     *      Handshake request describing the encoding of the file.
+     * \param ackSocket
+     *      Socket the ACKs are sent from.
+     * \param peer
+     *      Where the ACKs are sent to.
+     * \param showProgress
+     *      True to display a progress bar, which only makes sense when a
+     *      single file is received at a time.
+     * \throw unix_error
+     *      If the file cannot be created.
+     */
+    Transfer(const WireFormat::HandshakeReq& req,
+             UDPSocket* ackSocket,
+             const Address& peer,
+             bool showProgress);
+
+    /**
+     * Closes the file if finish() has not, leaving it as is.
+     */
+    ~Transfer();
+
+    size_t blocks() const
+    {
+        return decodedBlocks.size();
+    }
+
+    bool decoded() const
+    {
+        return decodedBlocks.count() == blocks();
+    }
+
+    /**
+     * Returns the first block whose symbols are dropped, which the sender
+     * should hold back until the window moves on.
+     */
+    size_t windowEnd() const
+    {
+        return std::min(firstUndecoded.load() + window, decodedBlocks.size());
+    }
+
+    /**
+     * Sends an ACK to the sender. Errors are ignored: over UDP, a sender
+     * that has already exited shows up as ECONNREFUSED.
+     */
+    void sendAck();
+
+    /**
+     * Accounts for a data packet in the feedback sent back to the sender:
+     * the congestion feedback and the loss rate. Network thread only.
+     *
+     * \param now
+     *      Time the packet was received, in microseconds.
+     */
+    void recordDataPacket(const WireFormat::DataPacket* dataPacket,
+                          uint64_t now);
+
+    /**
+     * Same as sendAck(), but sends an ExtendedAck, which also carries the
+     * feedback about the data packets received so far: the congestion
+     * feedback, the loss rate, and the number of symbols received for each
+     * block being received, from which the sender works out how many repair
+     * symbols each block still needs. Network thread only.
+     */
+    void sendFeedbackAck();
+
+    /**
+     * Writes the file back to disk and closes it. Once the file is decoded,
+     * the files of a session are extracted as well. The transfer must no
+     * longer be in a DecoderPool.
+     *
+     * \return
+     *      False if the files of the session could not be extracted.
+     */
+    bool finish();
+
+    /**
+     * Segment table of the file.
+     */
+    const WireFormat::HandshakeReq req;
+
+    const Address peer;
+
+    /**
+     * Blocks decoded so far; thread-safe.
+     */
+    Bitmask decodedBlocks;
+
+  private:
+    friend class DecoderPool;
+
+    /**
+     * Decoding state of a segment in a shard: its decoder, and the number
+     * of its blocks in the shard that are not decoded yet.
+     */
+    struct SegmentDecoder {
+        std::unique_ptr<RaptorQDecoder> decoder;
+        uint32_t remainingBlocks;
+
+        SegmentDecoder()
+            : decoder()
+            , remainingBlocks(0)
+        {}
+    };
+
+    /**
+     * Decoding state of the blocks of the file that a worker of the pool is
+     * in charge of, by segment. The state of a segment is created when the
+     * first symbol of the segment arrives and freed once all blocks of the
+     * segment in the shard are decoded, so that a shard only holds the
+     * segments being received rather than one entry per segment of the
+     * file.
+     */
+    typedef std::unordered_map<uint32_t, SegmentDecoder> Shard;
+
+    /**
+     * Records that a block has been decoded and tells the sender; called by
+     * the workers of the pool.
+     */
+    void onBlockDecoded(size_t block);
+
+    /**
+     * See blockWindow().
+     */
+    const size_t window;
+
+    /**
+     * First block not decoded yet; updated as blocks get decoded.
+     */
+    std::atomic<size_t> firstUndecoded;
+
+    /**
+     * Number of the first block of each segment; the last entry is the
+     * total number of blocks.
+     */
+    std::vector<size_t> segmentFirstBlock;
+
+    /**
+     * Start of each block in the file; block i ends where block i + 1
+     * starts.
+     */
+    std::vector<Alignment*> blockStart;
+
+    /**
+     * Block i goes to shard (i + firstShard) % shards.size(), so that the
+     * first blocks of transfers received at the same time go to different
+     * workers.
+     */
+    size_t firstShard;
+    std::vector<Shard> shards;
+
+    UDPSocket* ackSocket;
+
+    /**
+     * Feedback about the data packets received so far; network thread
+     * only, like the members below.
+     */
+    FeedbackRecorder feedback;
+
+    /**
+     * Number of symbols of each block handed to the pool, saturating, and
+     * one past the last block any was handed to the pool for.
+     */
+    std::vector<uint16_t> symbolsReceived;
+    size_t blocksSeen;
+
+    /**
+     * The file being written: a file of its own for the stream of a
+     * session, which is split into the files of the session by finish().
+     * It is mapped at start, including the padding of the last segment.
+     */
+    std::string path;
+    size_t paddedSize;
+    int fd;
+    void* start;
+
+    /**
+     * Writes each block back to disk once it is decoded.
+     */
+    std::unique_ptr<Writeback> writeback;
+
+    /**
+     * Serializes the ACKs and progress updates of the workers.
+     */
+    std::mutex mutex;
+
+    progress_t progress;
+
+    DISALLOW_COPY_AND_ASSIGN(Transfer)
+};
+
+Transfer::Transfer(const WireFormat::HandshakeReq& req,
+                   UDPSocket* ackSocket,
+                   const Address& peer,
+                   bool showProgress)
+    : req(req)
+    , peer(peer)
+    , decodedBlocks(totalBlocks(req))
+    , window(blockWindow(req))
+    , firstUndecoded(0)
+    , segmentFirstBlock()
+    , blockStart()
+    , firstShard(0)
+    , shards()
+    , ackSocket(ackSocket)
+    , feedback()
+    , symbolsReceived(decodedBlocks.size())
+    , blocksSeen(0)
+    , path(std::string(req.fileName) + (req.numFiles > 0 ? ".session" : ""))
+    , paddedSize(paddedFileSize(req))
+    , fd(-1)
+    , start(nullptr)
+    , writeback()
+    , mutex()
+    , progress(decodedBlocks.size(), DEBUG_F || !showProgress)
+{
+    fd = SystemCall("open " + path,
+            open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600));
+    if (lseek(fd, paddedSize - 1, SEEK_SET) < 0 || write(fd, "", 1) != 1 ||
+            (start = mmap(NULL, paddedSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        unix_error error("create " + path);
+        close(fd);
+        throw error;
+    }
+    writeback.reset(new Writeback(fd, start, MEMORY_LIMIT > 0 ?
+            std::min(WRITEBACK_BUDGET, MEMORY_LIMIT / 4) : WRITEBACK_BUDGET));
+
+    // Lay out the blocks; all segments but the last share the same layout
+    Alignment* fileStart = static_cast<Alignment*>(start);
+    RaptorQDecoder decoder(req.otiCommon, req.otiScheme);
+    RaptorQDecoder lastDecoder(req.lastOtiCommon, req.lastOtiScheme);
+    blockStart.push_back(fileStart);
+    for (uint32_t segment = 0; segment < req.numSegments; segment++) {
+        const RaptorQDecoder& layout =
+                segment + 1 == req.numSegments ? lastDecoder : decoder;
+        segmentFirstBlock.push_back(blockStart.size() - 1);
+        blockStart.back() = fileStart + segment * req.segmentSize /
+                                        ALIGNMENT_SIZE;
+        for (uint8_t sbn = 0; sbn < layout.blocks(); sbn++) {
+            blockStart.push_back(blockStart.back() +
+                                 layout.block_size(sbn) / ALIGNMENT_SIZE);
+        }
+    }
+    segmentFirstBlock.push_back(blocks());
 
     // Initialize progress bar
-    progress_t progress {decoder->blocks(), DEBUG_F};
     progress.show();
+}
 
-    while (1) {
-        // Send heartbeat ACK
-        auto currTime = std::chrono::system_clock::now();
-        if (currTime > nextAckTime) {
-            if (DEBUG_F)
-                printf("Sent Heartbeat ACK\n");
+Transfer::~Transfer()
+{
+    if (start) {
+        munmap(start, paddedSize);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
 
-            sendInWireFormat<WireFormat::Ack>(
-                    &udpSocket, decodedBlocks->toBitsetArray(), INIT_REPAIR_SYMBOL_INTERVAL);
-            nextAckTime = currTime + HEARTBEAT_INTERVAL;
+void
+Transfer::sendAck()
+{
+    // Report the blocks from the first one not decoded yet on
+    size_t firstWord = decodedBlocks.firstClear() / 64;
+    try {
+        sendInWireFormatTo<WireFormat::Ack>(ackSocket, peer,
+                uint32_t(req.connectionId),
+                downCast<uint32_t>(firstWord * 64),
+                decodedBlocks.snapshot(firstWord, 4),
+                downCast<uint32_t>(windowEnd()));
+        acksSent.add();
+        Tracer::record(Tracer::ACK_SENT,
+                       downCast<uint32_t>(firstWord * 64));
+    } catch (const unix_error& e) {
+        if (DEBUG_F)
+            printf("sendAck: %s\n", e.what());
+    }
+}
+
+void
+Transfer::recordDataPacket(const WireFormat::DataPacket* dataPacket,
+                           uint64_t now)
+{
+    feedback.record(dataPacket->seq, dataPacket->sendTime, now);
+}
+
+void
+Transfer::sendFeedbackAck()
+{
+    size_t firstWord = decodedBlocks.firstClear() / 64;
+    size_t first = firstWord * 64;
+    WireFormat::Ack ack(uint32_t(req.connectionId), downCast<uint32_t>(first),
+                        decodedBlocks.snapshot(firstWord, 4),
+                        downCast<uint32_t>(windowEnd()),
+                        feedback.feedback(timestamp_us()));
+    std::vector<uint16_t> received;
+    if (blocksSeen > first) {
+        received.assign(symbolsReceived.begin() + first,
+                        symbolsReceived.begin() +
+                        std::min(first + 64 * 4, blocksSeen));
+    }
+    WireFormat::ExtendedAck extendedAck(ack,
+            uint16_t(std::min(feedback.lossRate() * 65536.0, 65535.0)),
+            received);
+    try {
+        ackSocket->sendbytesto(peer, reinterpret_cast<char*>(&extendedAck),
+                               extendedAck.length());
+        acksSent.add();
+        Tracer::record(Tracer::ACK_SENT, downCast<uint32_t>(first),
+                       feedback.highestSeq());
+    } catch (const unix_error& e) {
+        if (DEBUG_F)
+            printf("sendFeedbackAck: %s\n", e.what());
+    }
+}
+
+void
+Transfer::onBlockDecoded(size_t block)
+{
+    Guard _(mutex);
+    if (DEBUG_F)
+        printf("Block %zu decoded.\n", block);
+
+    decodedBlocks.set(block);
+    firstUndecoded = decodedBlocks.firstClear();
+    sendAck();
+    progress.update(decodedBlocks.count());
+}
+
+bool
+Transfer::finish()
+{
+    bool extracted = true;
+    SystemCall("msync", msync(start, paddedSize, MS_SYNC));
+    if (decoded() && req.numFiles > 0) {
+        if (extractSession(req.fileName, fd, static_cast<const char*>(start),
+                           req.fileSize)) {
+            printf("Extracted %u files into %s/\n", uint32_t(req.numFiles),
+                   req.fileName);
+            SystemCall("unlink", unlink(path.c_str()));
+        } else {
+            printf("Failed to extract the files of the session; "
+                   "the stream is left in %s\n", path.c_str());
+            extracted = false;
         }
+    }
+    SystemCall("munmap", munmap(start, paddedSize));
+    start = nullptr;
+    SystemCall("truncate the padding at the end of the file",
+            ftruncate(fd, req.fileSize));
+    SystemCall("close fd", close(fd));
+    fd = -1;
+    return extracted;
+}
 
-        if (decodedBlocks->count() == decoder->blocks()) {
-            break;
+/**
+ * Decodes the blocks of the files being received on a pool of worker
+ * threads while the network thread keeps receiving; any number of transfers
+ * may share the pool. Symbols are sharded among the workers by block
+ * number. Each worker feeds decoders of its own with the blocks of its
+ * shard only, so the workers share no decoding state and up to one block
+ * per worker is decoded at a time.
+ *
+ * The pool also sends heartbeat ACKs for each transfer every
+ * HEARTBEAT_INTERVAL.
+ */
+class DecoderPool {
+  public:
+    explicit DecoderPool(unsigned numWorkers);
+
+    /**
+     * Stops the workers, abandoning the symbols still queued.
+     */
+    ~DecoderPool();
+
+    /**
+     * Starts accepting the symbols of a transfer. Network thread only.
+     */
+    void add(Transfer* transfer);
+
+    /**
+     * Stops sending heartbeat ACKs for a transfer, and waits until the
+     * workers are done with the symbols of it queued so far, after which
+     * the transfer can be destroyed. Network thread only.
+     */
+    void remove(Transfer* transfer);
+
+    /**
+     * Queues a data packet of a transfer for the worker in charge of its
+     * block, unless the block has already been decoded. Waits while that
+     * worker's queue is full. The packet only reaches the worker after the
+     * next flush(). Network thread only.
+     */
+    void enqueue(Transfer* transfer,
+                 const WireFormat::DataPacket* dataPacket);
+
+    /**
+     * Hands the packets queued since the last call over to the workers.
+     */
+    void flush();
+
+  private:
+    /**
+     * A symbol queued for a worker, and the transfer it belongs to.
+     */
+    struct QueuedSymbol {
+        Transfer* transfer;
+        uint32_t segment;
+        uint32_t id;
+        char raw[SYMBOL_SIZE];
+
+        QueuedSymbol(Transfer* transfer,
+                     const WireFormat::DataPacket* dataPacket)
+            : transfer(transfer)
+            , segment(dataPacket->segment)
+            , id(dataPacket->id)
+        {
+            std::memcpy(raw, dataPacket->raw, SYMBOL_SIZE);
         }
+    };
 
-        // TODO(YilongL): it could block here and not sending ACK in time!
-        sem_wait(&qNonempty);
-        auto dataPacket = std::move(symbolQueue[qOut]);
-        qOut = (qOut + 1) % SHARED_QUEUE_SIZE;
-        sem_post(&qNonfull);
+    /**
+     * A decoding thread and the lock-free queue of symbols it consumes. The
+     * mutex and condition variable are only used to put the thread to sleep
+     * when it runs out of symbols.
+     */
+    struct Worker {
+        /**
+         * Index of the worker, and of its shard in each transfer.
+         */
+        size_t index;
 
-        Alignment* begin = reinterpret_cast<Alignment*>(dataPacket->raw);
-        if (!decoder->add_symbol(begin,
-                reinterpret_cast<Alignment*>(dataPacket->raw + SYMBOL_SIZE),
-                dataPacket->id)) {
-            continue;
+        SpscRing<QueuedSymbol> symbolQueue;
+        std::mutex mutex;
+        std::condition_variable nonempty;
+        std::atomic<bool> sleeping;
+        std::thread thread;
+
+        Worker(size_t index, size_t queueSize)
+            : index(index)
+            , symbolQueue(queueSize)
+            , mutex()
+            , nonempty()
+            , sleeping(false)
+            , thread()
+        {}
+
+        DISALLOW_COPY_AND_ASSIGN(Worker)
+    };
+
+    void decodingLoop(Worker* worker);
+    void decodeSymbol(Worker* worker, QueuedSymbol& symbol);
+
+    /**
+     * Blocks until the worker's queue is not empty or the pool stops.
+     */
+    void waitForSymbols(Worker* worker);
+
+    /**
+     * Publishes the packets queued for the worker and wakes it up if it is
+     * sleeping.
+     */
+    void wakeUp(Worker* worker);
+
+    void heartbeatLoop();
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    /**
+     * Shard of the first block of the next transfer added.
+     */
+    size_t nextShard;
+
+    /**
+     * Transfers in the pool, which get heartbeat ACKs.
+     */
+    std::vector<Transfer*> transfers;
+
+    /**
+     * Protects transfers, and wakes up the heartbeat thread when the pool
+     * stops.
+     */
+    std::mutex mutex;
+    std::condition_variable stopped;
+    std::atomic<bool> stopping;
+
+    std::thread heartbeatThread;
+
+    DISALLOW_COPY_AND_ASSIGN(DecoderPool)
+};
+
+DecoderPool::DecoderPool(unsigned numWorkers)
+    : workers()
+    , nextShard(0)
+    , transfers()
+    , mutex()
+    , stopped()
+    , stopping(false)
+    , heartbeatThread()
+{
+    for (unsigned i = 0; i < numWorkers; i++) {
+        workers.emplace_back(new Worker(i, std::max<size_t>(
+                sharedQueueSize() / numWorkers, RECV_BATCH_SIZE)));
+    }
+    for (auto& worker : workers) {
+        worker->thread = std::thread(&DecoderPool::decodingLoop, this,
+                                     worker.get());
+    }
+    heartbeatThread = std::thread(&DecoderPool::heartbeatLoop, this);
+}
+
+DecoderPool::~DecoderPool()
+{
+    {
+        Guard _(mutex);
+        stopping = true;
+    }
+    stopped.notify_all();
+    heartbeatThread.join();
+    for (auto& worker : workers) {
+        {
+            Guard _(worker->mutex);
         }
+        worker->nonempty.notify_one();
+        worker->thread.join();
+    }
+}
 
-        uint8_t sbn = downCast<uint8_t>(dataPacket->id >> 24);
-        if (!decodedBlocks->test(sbn)) {
-            Alignment* begin =  blockStart[sbn];
-            if (decoder->decode(begin, blockStart[sbn + 1], sbn) > 0) {
-                // send ACK for block sbn
-                if (DEBUG_F)
-                    printf("Block %u decoded.\n", static_cast<int>(sbn));
+void
+DecoderPool::add(Transfer* transfer)
+{
+    transfer->firstShard = nextShard++ % workers.size();
+    transfer->shards.resize(workers.size());
+
+    Guard _(mutex);
+    transfers.push_back(transfer);
+}
+
+void
+DecoderPool::remove(Transfer* transfer)
+{
+    {
+        Guard _(mutex);
+        transfers.erase(std::remove(transfers.begin(), transfers.end(),
+                                    transfer), transfers.end());
+    }
+
+    // Each worker consumes its symbols in order, so once it has consumed
+    // those queued so far it is done with the transfer
+    for (auto& worker : workers) {
+        size_t queued = worker->symbolQueue.produced();
+        wakeUp(worker.get());
+        while (worker->symbolQueue.consumed() < queued) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void
+DecoderPool::enqueue(Transfer* transfer,
+                     const WireFormat::DataPacket* dataPacket)
+{
+    uint32_t segment = dataPacket->segment;
+    uint32_t id = dataPacket->id;
+    uint8_t sbn = downCast<uint8_t>(id >> 24);
+    uint32_t esi = (id << 8) >> 8;
+    packetsReceived.add();
+    Tracer::record(Tracer::PACKET_RECEIVED, dataPacket->seq,
+                   uint64_t(segment) << 32 | id);
+    if (DEBUG_F) {
+        printf("Received segment = %u, sbn = %u, esi = %u\n", segment,
+               static_cast<uint32_t>(sbn), esi);
+    }
+
+    const std::vector<size_t>& segmentFirstBlock = transfer->segmentFirstBlock;
+    if (dataPacket->connectionId != transfer->req.connectionId ||
+            segment >= transfer->req.numSegments ||
+            sbn >= segmentFirstBlock[segment + 1] - segmentFirstBlock[segment]) {
+        return;
+    }
+    size_t block = segmentFirstBlock[segment] + sbn;
+    if (transfer->decodedBlocks.test(block)) {
+        // Useless symbol: block already decoded
+        symbolsUseless.add();
+        return;
+    }
+    if (block >= transfer->windowEnd()) {
+        // No room for the block yet
+        symbolsOutsideWindow.add();
+        return;
+    }
+    uint16_t& received = transfer->symbolsReceived[block];
+    if (received < UINT16_MAX) {
+        received++;
+    }
+    transfer->blocksSeen = std::max(transfer->blocksSeen, block + 1);
+    Worker* worker = workers[(block + transfer->firstShard) %
+                             workers.size()].get();
+    while (!worker->symbolQueue.tryEmplace(transfer, dataPacket)) {
+        // The worker is falling behind; hand it what we have and let it
+        // catch up
+        wakeUp(worker);
+        std::this_thread::yield();
+    }
+    Tracer::record(Tracer::SYMBOL_ENQUEUED,
+                   downCast<uint32_t>(worker->index), block);
+}
+
+void
+DecoderPool::flush()
+{
+    for (auto& worker : workers) {
+        decodeQueueDepth.record(worker->symbolQueue.produced() -
+                                worker->symbolQueue.consumed());
+        wakeUp(worker.get());
+    }
+}
 
-                decodedBlocks->set(sbn);
-                sendInWireFormat<WireFormat::Ack>(
-                        &udpSocket, decodedBlocks->toBitsetArray(), INIT_REPAIR_SYMBOL_INTERVAL);
-                progress.update(decodedBlocks->count());
+void
+DecoderPool::wakeUp(Worker* worker)
+{
+    worker->symbolQueue.publish();
+    // Pairs with the fence in waitForSymbols(): either the worker sees the
+    // new symbols, or we see that it is going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (worker->sleeping.load(std::memory_order_relaxed)) {
+        {
+            Guard _(worker->mutex);
+        }
+        worker->nonempty.notify_one();
+    }
+}
+
+void
+DecoderPool::waitForSymbols(Worker* worker)
+{
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    worker->sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    worker->nonempty.wait(lock, [this, worker] {
+        return !worker->symbolQueue.empty() || stopping;
+    });
+    worker->sleeping.store(false, std::memory_order_relaxed);
+}
+
+void
+DecoderPool::decodingLoop(Worker* worker)
+{
+    Tracer::nameThread("decoder " + std::to_string(worker->index));
+    int idlePolls = 0;
+    while (!stopping) {
+        size_t consumed = worker->symbolQueue.consume(
+                [this, worker] (QueuedSymbol& symbol) {
+                    decodeSymbol(worker, symbol);
+                }, RECV_BATCH_SIZE);
+        if (consumed > 0) {
+            idlePolls = 0;
+        } else if (++idlePolls < IDLE_POLLS) {
+            std::this_thread::yield();
+        } else {
+            waitForSymbols(worker);
+            idlePolls = 0;
+        }
+    }
+}
+
+void
+DecoderPool::decodeSymbol(Worker* worker, QueuedSymbol& symbol)
+{
+    Transfer* transfer = symbol.transfer;
+    uint32_t segment = symbol.segment;
+    uint32_t id = symbol.id;
+    uint8_t sbn = downCast<uint8_t>(id >> 24);
+    size_t block = transfer->segmentFirstBlock[segment] + sbn;
+    Tracer::record(Tracer::SYMBOL_DEQUEUED, downCast<uint32_t>(worker->index),
+                   block);
+    if (transfer->decodedBlocks.test(block)) {
+        // The block was decoded while the symbol was queued
+        symbolsUseless.add();
+        return;
+    }
+
+    Transfer::Shard& shard = transfer->shards[worker->index];
+    Transfer::SegmentDecoder& state = shard[segment];
+    std::unique_ptr<RaptorQDecoder>& decoder = state.decoder;
+    if (!decoder) {
+        decoder.reset(new RaptorQDecoder(
+                transfer->req.segmentOtiCommon(segment),
+                transfer->req.segmentOtiScheme(segment)));
+        for (size_t i = transfer->segmentFirstBlock[segment];
+                i < transfer->segmentFirstBlock[segment + 1]; i++) {
+            if ((i + transfer->firstShard) % workers.size() ==
+                    worker->index) {
+                state.remainingBlocks++;
             }
         }
     }
+    Alignment* begin = reinterpret_cast<Alignment*>(symbol.raw);
+    if (!decoder->add_symbol(begin,
+            reinterpret_cast<Alignment*>(symbol.raw + SYMBOL_SIZE), id)) {
+        return;
+    }
+    Tracer::record(Tracer::SYMBOL_ADDED, id, block);
+
+    Alignment** blockStart = transfer->blockStart.data();
+    begin = blockStart[block];
+    uint64_t decodeStart = timestamp_us();
+    Tracer::record(Tracer::DECODE_START, 0, block);
+    uint64_t decodedBytes = decoder->decode(begin, blockStart[block + 1], sbn);
+    Tracer::record(Tracer::DECODE_END, decodedBytes > 0, block);
+    if (decodedBytes > 0) {
+        decodeTimeUs.record(timestamp_us() - decodeStart);
+        blocksDecoded.add();
+        bytesWritten.add(decodedBytes);
+        decoder->free(sbn);
+        transfer->onBlockDecoded(block);
+        if (--state.remainingBlocks == 0) {
+            shard.erase(segment);
+        }
+        transfer->writeback->add(blockStart[block], blockStart[block + 1]);
+    }
+}
+
+void
+DecoderPool::heartbeatLoop()
+{
+    Tracer::nameThread("heartbeat");
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopped.wait_for(lock, HEARTBEAT_INTERVAL,
+                             [this] { return stopping.load(); })) {
+        if (DEBUG_F)
+            printf("Sent Heartbeat ACK\n");
+
+        for (Transfer* transfer : transfers) {
+            transfer->sendAck();
+        }
+    }
 }
 
 void printUsage(char *command) 
 {
-    std::cerr << "Usage: " << command << " [-dh]" << std::endl;
+    std::cerr << "Usage: " << command << " [-dhus] [-m megabytes] [-f megabytes] [-M FILE] [-t FILE]" << std::endl;
     std::cerr << "\t-h: help" << std::endl;
     std::cerr << "\t-d: debug (per-symbol messages instead of a progress bar)" << std::endl;
+    std::cerr << "\t-u: receive over UDP (the sender must use -u as well)" << std::endl;
+    std::cerr << "\t-m: approximate ceiling on the memory used per file, in megabytes" << std::endl;
+    std::cerr << "\t-f: largest file accepted, in megabytes (default: the free space of the current directory)" << std::endl;
+    std::cerr << "\t-s: serve any number of senders at once until killed (implies -u)" << std::endl;
+    std::cerr << "\t-M: export metrics to FILE every second and at exit (CSV if FILE ends in .csv, JSON lines otherwise)" << std::endl;
+    std::cerr << "\t-t: trace every packet to FILE, to be converted with trace2json" << std::endl;
 }
 
 int parseArgs(int argc, char *argv[]) 
@@ -99,12 +994,37 @@ int parseArgs(int argc, char *argv[])
 
     // check options
     DEBUG_F = 0;
+    UDP_F = 0;
+    SERVE_F = 0;
+    MEMORY_LIMIT = 0;
+    MAX_RECEIVE_SIZE = 0;
+    METRICS_FILE.clear();
+    TRACE_FILE.clear();
     int c = 0;
-    while ((c = getopt(argc, argv, "dh")) != -1) {
+    while ((c = getopt(argc, argv, "dusm:f:M:t:h")) != -1) {
         switch (c) {
             case 'd':
                 DEBUG_F = 1;
                 break;
+            case 'u':
+                UDP_F = 1;
+                break;
+            case 's':
+                SERVE_F = 1;
+                UDP_F = 1;
+                break;
+            case 'm':
+                MEMORY_LIMIT = std::stoul(optarg) << 20;
+                break;
+            case 'f':
+                MAX_RECEIVE_SIZE = uint64_t(std::stoull(optarg)) << 20;
+                break;
+            case 'M':
+                METRICS_FILE = optarg;
+                break;
+            case 't':
+                TRACE_FILE = optarg;
+                break;
             case 'h':
             case '?':
                 printUsage(argv[0]);
@@ -121,7 +1041,7 @@ int parseArgs(int argc, char *argv[])
     return 0;
 }
 
-bool pollin(DCCPSocket* socket, int timeoutMs = -1)
+bool pollin(FileDescriptor* socket, int timeoutMs = -1)
 {
     struct pollfd ufds {socket->fd_num(), POLLIN, 0};
     int rv = SystemCall("poll", poll(&ufds, 1, timeoutMs));
@@ -134,120 +1054,543 @@ bool pollin(DCCPSocket* socket, int timeoutMs = -1)
     }
 }
 
-std::unique_ptr<DCCPSocket>
-respondHandshake(std::unique_ptr<WireFormat::HandshakeReq>& req)
+void printHandshakeReq(const WireFormat::HandshakeReq& req)
+{
+    printf("Received handshake request: {connection id = %u, file name = %s, "
+           "file size = %zu, files = %u, segments = %u, OTI_COMMON = %lu, "
+           "OTI_SCHEME_SPECIFIC = %u, last OTI_COMMON = %lu, "
+           "last OTI_SCHEME_SPECIFIC = %u}\n",
+           uint32_t(req.connectionId), req.fileName, size_t(req.fileSize),
+           uint32_t(req.numFiles), uint32_t(req.numSegments), uint64_t(req.otiCommon),
+           uint32_t(req.otiScheme), uint64_t(req.lastOtiCommon),
+           uint32_t(req.lastOtiScheme));
+}
+
+
+/**
+ * Binds the socket senders connect to, to port 6330 if available.
+ */
+void bindDataPort(Socket& socket)
 {
-    DCCPSocket localSocket;
     try {
-        localSocket.bind(Address("0", 6330));
+        socket.bind(Address("0", 6330));
     }
-    catch (unix_error e) {
+    catch (const unix_error& e) {
         std::cerr << "Port 6330 is already used. ";
         std::cerr << "Picking a random port..." << std::endl;
-        localSocket.bind(Address("0", 0));
+        socket.bind(Address("0", 0));
     }
-    printf("%s\n", localSocket.local_address().to_string().c_str());
+    // Flushed for whoever waits for the port in a redirected output
+    printf("%s\n", socket.local_address().to_string().c_str());
+    fflush(stdout);
+}
+
+std::unique_ptr<DCCPSocket>
+respondHandshake(std::unique_ptr<WireFormat::HandshakeReq>& req)
+{
+    DCCPSocket localSocket;
+    bindDataPort(localSocket);
 
     localSocket.listen();
-    DCCPSocket* socket = new DCCPSocket(localSocket.accept());
+    DCCPSocket* socket = nullptr;
+    while (!req) {
+        delete socket;
+        socket = new DCCPSocket(localSocket.accept());
 
-    // Wait for handshake request
-    pollin(socket);
-    req = receive<WireFormat::HandshakeReq>(socket);
+        // Wait for handshake request
+        pollin(socket);
+        req = receive<WireFormat::HandshakeReq>(socket);
+        const char* invalid = req ? checkHandshakeReq(*req) : nullptr;
+        if (invalid) {
+            printf("Refusing connection %u: %s\n",
+                   uint32_t(req->connectionId), invalid);
+            req.reset();
+        }
+    }
 
-    printf("Received handshake request: {connection id = %u, file name = %s, "
-           "file size = %zu, OTI_COMMON = %lu, OTI_SCHEME_SPECIFIC = %u}\n",
-           req->connectionId, req->fileName, req->fileSize, req->otiCommon,
-           req->otiScheme);
+    printHandshakeReq(*req);
 
     // Send handshake response
+    uint32_t window = downCast<uint32_t>(blockWindow(*req));
     sendInWireFormat<WireFormat::HandshakeResp>(
-            socket, uint32_t(req->connectionId));
-    printf("Sent handshake response: {connection id = %u}\n",
-            req->connectionId);
+            socket, uint32_t(req->connectionId), window);
+    printf("Sent handshake response: {connection id = %u, block window = %u}\n",
+            req->connectionId, window);
 
     return std::unique_ptr<DCCPSocket>(socket);
 }
 
-void receive(RaptorQDecoder& decoder,
-             DCCPSocket* socket,
-             Alignment* recvFileStart)
+/**
+ * Same as respondHandshake() but over UDP. The returned socket is connected
+ * to the sender, and carries both the data packets and the ACKs.
+ */
+std::unique_ptr<UDPSocket>
+respondHandshakeOverUdp(std::unique_ptr<WireFormat::HandshakeReq>& req)
 {
-    const uint8_t numBlocks = decoder.blocks();
-    Bitmask256 decodedBlocks;
+    std::unique_ptr<UDPSocket> socket {new UDPSocket};
+    bindDataPort(*socket);
+    socket->set_timestamps();
+
+    // Wait for handshake request
+    while (!req) {
+        UDPSocket::received_datagram datagram = socket->recv();
+        WireFormat::HandshakeReq* request =
+                reinterpret_cast<WireFormat::HandshakeReq*>(datagram.payload);
+        bool accepted = false;
+        if (datagram.recvlen == sizeof(WireFormat::HandshakeReq) &&
+                WireFormat::getOpcode(datagram.payload) ==
+                WireFormat::HANDSHAKE_REQ) {
+            const char* invalid = checkHandshakeReq(*request);
+            if (invalid) {
+                printf("Refusing connection %u: %s\n",
+                       uint32_t(request->connectionId), invalid);
+            }
+            accepted = !invalid;
+        }
+        if (accepted) {
+            req.reset(request);
+            // Ignore everyone else from now on
+            socket->connect(datagram.source_address);
+        } else {
+            delete[] datagram.payload;
+        }
+    }
+
+    printHandshakeReq(*req);
 
-    std::thread decoderThread(decodingLoop, &decoder, socket->peer_address(),
-            recvFileStart, &decodedBlocks);
-    decoderThread.detach();
+    // Send handshake response
+    uint32_t window = downCast<uint32_t>(blockWindow(*req));
+    sendInWireFormat<WireFormat::HandshakeResp>(
+            socket.get(), uint32_t(req->connectionId), window);
+    printf("Sent handshake response: {connection id = %u, block window = %u}\n",
+            req->connectionId, window);
 
-    std::unique_ptr<WireFormat::DataPacket> dataPacket;
-    while (decodedBlocks.count() < numBlocks) {
-        // Receive one symbol
+    return socket;
+}
+
+/**
+ * Receives the symbols of the file and hands them to the pool until the
+ * file is decoded or the connection is closed.
+ */
+void receive(Transfer& transfer, DecoderPool& pool, DCCPSocket* socket)
+{
+    DatagramSlab slab {sizeof(WireFormat::DataPacket), RECV_BATCH_SIZE};
+    while (!transfer.decoded()) {
+        // Receive a batch of symbols
         if (!pollin(socket)) {
             continue;
         }
-        dataPacket = receive<WireFormat::DataPacket>(socket);
-        uint8_t sbn = downCast<uint8_t>(dataPacket->id >> 24);
-        uint32_t esi = (dataPacket->id << 8) >> 8;
-        if (DEBUG_F) {
-            printf("Received sbn = %u, esi = %u\n", static_cast<uint32_t>(sbn), esi);
+        socket->recvbatch(slab);
+        if (socket->eof()) {
+            break;
+        }
+        packetsPerRecv.record(slab.size());
+
+        for (size_t i = 0; i < slab.size(); i++) {
+            if (slab[i].length == sizeof(WireFormat::DataPacket)) {
+                pool.enqueue(&transfer,
+                        reinterpret_cast<const WireFormat::DataPacket*>(
+                        slab[i].payload));
+            }
         }
+        pool.flush();
+    }
 
-        if (decodedBlocks.test(sbn)) {
-            // Useless symbol: block already decoded
+    if (!transfer.decoded()) {
+        printf("Connection closed before the file was decoded.\n");
+        return;
+    }
+    printf("File decoded successfully.\n");
+}
+
+/**
+ * Same as receive() but over UDP, where the socket also carries the ACKs.
+ * Besides the decoded blocks, the ACKs sent from this thread report the
+ * feedback the sender needs to pace itself and schedule repair symbols.
+ */
+void receiveOverUdp(Transfer& transfer, DecoderPool& pool, UDPSocket* socket)
+{
+    const WireFormat::HandshakeReq& req = transfer.req;
+    DatagramSlab slab {sizeof(WireFormat::DataPacket), RECV_BATCH_SIZE};
+    uint64_t lastHeard = timestamp_us();
+    while (!transfer.decoded()) {
+        // Receive a batch of symbols; wake up regularly since nothing tells
+        // us when the sender is gone, and give up on it once it has been
+        // quiet for IDLE_TIMEOUT_US
+        if (timestamp_us() - lastHeard > IDLE_TIMEOUT_US) {
+            printf("Sender gone before the file was decoded.\n");
+            return;
+        }
+        if (!pollin(socket, HEARTBEAT_INTERVAL.count())) {
             continue;
         }
-        sem_wait(&qNonfull);
-        symbolQueue[qIn] = std::move(dataPacket);
-        qIn = (qIn + 1) % SHARED_QUEUE_SIZE;
-        sem_post(&qNonempty);
+        try {
+            socket->recvbatch(slab);
+        } catch (const unix_error& e) {
+            // An earlier ACK bounced off the sender (ECONNREFUSED)
+            continue;
+        }
+        uint64_t now = timestamp_us();
+        lastHeard = now;
+        packetsPerRecv.record(slab.size());
+
+        bool gotData = false;
+        for (size_t i = 0; i < slab.size(); i++) {
+            WireFormat::Opcode opcode = WireFormat::getOpcode(slab[i].payload);
+            if (opcode == WireFormat::HANDSHAKE_REQ) {
+                // Our handshake response was lost
+                sendInWireFormat<WireFormat::HandshakeResp>(
+                        socket, uint32_t(req.connectionId),
+                        downCast<uint32_t>(blockWindow(req)));
+                continue;
+            }
+            if (opcode != WireFormat::DATA_PACKET ||
+                    slab[i].length != sizeof(WireFormat::DataPacket)) {
+                continue;
+            }
+
+            const WireFormat::DataPacket* dataPacket =
+                    reinterpret_cast<const WireFormat::DataPacket*>(
+                    slab[i].payload);
+            uint64_t receivedAt = slab.timestamp(i);
+            transfer.recordDataPacket(dataPacket,
+                                      receivedAt ? receivedAt : now);
+            gotData = true;
+            pool.enqueue(&transfer, dataPacket);
+        }
+        pool.flush();
+
+        if (gotData) {
+            transfer.sendFeedbackAck();
+        }
     }
 
+    for (int i = 0; i < FINAL_ACK_COPIES; i++) {
+        transfer.sendAck();
+    }
     printf("File decoded successfully.\n");
 }
 
+/**
+ * A sender served by serve(), from its handshake request until its transfer
+ * is over and it has gone quiet.
+ */
+struct Connection {
+    std::unique_ptr<Transfer> transfer;
+
+    /**
+     * Valid once the transfer is over, while and after its file is finished
+     * on a thread of its own; see Transfer::finish().
+     */
+    std::future<bool> finished;
+
+    /**
+     * Time the latest datagram from the sender was received, in
+     * microseconds.
+     */
+    uint64_t lastHeard;
+
+    /**
+     * True if data packets arrived in the current batch, which are then
+     * acknowledged.
+     */
+    bool gotData;
+
+    Connection(std::unique_ptr<Transfer> transfer, uint64_t now)
+        : transfer(std::move(transfer))
+        , finished()
+        , lastHeard(now)
+        , gotData(false)
+    {}
+
+    /**
+     * Returns true while the file is being received or finished.
+     */
+    bool busy() const
+    {
+        return !finished.valid() ||
+               finished.wait_for(std::chrono::seconds(0)) !=
+               std::future_status::ready;
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(Connection)
+};
+
+typedef std::map<uint32_t, std::unique_ptr<Connection>> ConnectionMap;
+
+/**
+ * Handles a handshake request received by serve(): starts receiving the
+ * file unless the request is a retransmission, in which case the response
+ * is sent again. Requests that fail checkHandshakeReq(), or for a file
+ * that is already being received, are refused.
+ */
+void acceptConnection(UDPSocket& socket,
+                      const Address& source,
+                      const WireFormat::HandshakeReq& req,
+                      DecoderPool& pool,
+                      ConnectionMap& connections)
+{
+    uint32_t connectionId = req.connectionId;
+    auto it = connections.find(connectionId);
+    if (it != connections.end()) {
+        // Our handshake response was lost; the request was checked when
+        // the connection was accepted, but the file now takes up space
+        const Transfer& transfer = *it->second->transfer;
+        if (transfer.peer == source &&
+                std::memcmp(&transfer.req, &req, sizeof(req)) == 0) {
+            sendInWireFormatTo<WireFormat::HandshakeResp>(&socket, source,
+                    connectionId, downCast<uint32_t>(blockWindow(req)));
+        }
+        return;
+    }
+    const char* invalid = checkHandshakeReq(req);
+    if (invalid) {
+        printf("Refusing connection %u: %s\n", connectionId, invalid);
+        return;
+    }
+    uint32_t window = downCast<uint32_t>(blockWindow(req));
+
+    printHandshakeReq(req);
+    for (auto& entry : connections) {
+        if (entry.second->busy() &&
+                strcmp(entry.second->transfer->req.fileName,
+                       req.fileName) == 0) {
+            printf("Refusing connection %u: %s is already being received\n",
+                   connectionId, req.fileName);
+            return;
+        }
+    }
+
+    std::unique_ptr<Transfer> transfer;
+    try {
+        transfer.reset(new Transfer(req, &socket, source, false));
+    } catch (const std::exception& e) {
+        printf("Refusing connection %u: %s\n", connectionId, e.what());
+        return;
+    }
+    pool.add(transfer.get());
+    connections[connectionId].reset(
+            new Connection(std::move(transfer), timestamp_us()));
+
+    sendInWireFormatTo<WireFormat::HandshakeResp>(&socket, source,
+                                                  connectionId, window);
+    printf("Sent handshake response to %s: {connection id = %u, "
+           "block window = %u}\n", source.to_string().c_str(), connectionId,
+           window);
+}
+
+/**
+ * Handles a batch of datagrams received by serve(): handshake requests open
+ * connections, and data packets go to the transfer of their connection id.
+ */
+void serveBatch(UDPSocket& socket,
+                const DatagramSlab& slab,
+                DecoderPool& pool,
+                ConnectionMap& connections)
+{
+    uint64_t now = timestamp_us();
+    packetsPerRecv.record(slab.size());
+    for (size_t i = 0; i < slab.size(); i++) {
+        WireFormat::Opcode opcode = WireFormat::getOpcode(slab[i].payload);
+        if (opcode == WireFormat::HANDSHAKE_REQ &&
+                slab[i].length == sizeof(WireFormat::HandshakeReq)) {
+            acceptConnection(socket, slab.source(i),
+                    *reinterpret_cast<const WireFormat::HandshakeReq*>(
+                    slab[i].payload), pool, connections);
+            continue;
+        }
+        if (opcode != WireFormat::DATA_PACKET ||
+                slab[i].length != sizeof(WireFormat::DataPacket)) {
+            continue;
+        }
+
+        const WireFormat::DataPacket* dataPacket =
+                reinterpret_cast<const WireFormat::DataPacket*>(
+                slab[i].payload);
+        auto it = connections.find(dataPacket->connectionId);
+        if (it == connections.end() ||
+                !(it->second->transfer->peer == slab.source(i))) {
+            continue;
+        }
+        Connection& connection = *it->second;
+        connection.lastHeard = now;
+        uint64_t receivedAt = slab.timestamp(i);
+        connection.transfer->recordDataPacket(dataPacket,
+                                              receivedAt ? receivedAt : now);
+        connection.gotData = true;
+        if (!connection.finished.valid()) {
+            pool.enqueue(connection.transfer.get(), dataPacket);
+        } else {
+            packetsReceived.add();
+            symbolsUseless.add();
+        }
+    }
+    pool.flush();
+
+    // Senders whose transfer is over keep getting ACKs until they stop
+    for (auto& entry : connections) {
+        Connection& connection = *entry.second;
+        if (connection.gotData) {
+            connection.transfer->sendFeedbackAck();
+            connection.gotData = false;
+        }
+    }
+}
+
+/**
+ * Ends the transfers that are decoded or whose sender has gone quiet, and
+ * forgets the connections that are over.
+ */
+void reapConnections(DecoderPool& pool, ConnectionMap& connections)
+{
+    uint64_t now = timestamp_us();
+    for (auto it = connections.begin(); it != connections.end();) {
+        Connection& connection = *it->second;
+        Transfer* transfer = connection.transfer.get();
+        uint32_t connectionId = it->first;
+        bool idle = now - connection.lastHeard > IDLE_TIMEOUT_US;
+
+        if (!connection.finished.valid()) {
+            if (transfer->decoded()) {
+                for (int i = 0; i < FINAL_ACK_COPIES; i++) {
+                    transfer->sendAck();
+                }
+                printf("Connection %u: %s decoded successfully.\n",
+                       connectionId, transfer->req.fileName);
+            } else if (idle) {
+                printf("Connection %u: sender gone before %s was decoded.\n",
+                       connectionId, transfer->req.fileName);
+            } else {
+                ++it;
+                continue;
+            }
+            pool.remove(transfer);
+            connection.finished = std::async(std::launch::async,
+                                             &Transfer::finish, transfer);
+            ++it;
+            continue;
+        }
+
+        // Linger until the sender has stopped, so that it keeps getting
+        // ACKs if the final ones are lost
+        if ((idle || !transfer->decoded()) && !connection.busy()) {
+            try {
+                connection.finished.get();
+            } catch (const std::exception& e) {
+                printf("Connection %u: %s\n", connectionId, e.what());
+            }
+            it = connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/**
+ * Receives files from any number of senders at once over a single UDP
+ * socket, until killed. Datagrams are routed to the transfer of their
+ * connection id, and all transfers share a pool of decoding workers.
+ */
+int serve()
+{
+    // Keep the log in order when it goes to a file
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    UDPSocket socket;
+    bindDataPort(socket);
+    socket.set_timestamps();
+
+    DecoderPool pool {std::max(1u, std::thread::hardware_concurrency())};
+    ConnectionMap connections;
+    DatagramSlab slab {sizeof(WireFormat::DataPacket), RECV_BATCH_SIZE};
+
+    // Look for transfers that are over every HEARTBEAT_INTERVAL, rather
+    // than after every batch
+    TimerFD reapTimer;
+    reapTimer.set_interval(HEARTBEAT_INTERVAL);
+
+    EpollPoller poller;
+    poller.add_action(EpollPoller::Action(socket, Poller::Action::In,
+            [&] () -> Poller::Action::Result {
+                socket.recvbatch(slab);
+                serveBatch(socket, slab, pool, connections);
+                return Poller::Action::Result::Type::Continue;
+            }));
+    poller.add_action(EpollPoller::Action(reapTimer, Poller::Action::In,
+            [&] () -> Poller::Action::Result {
+                reapTimer.read_expirations();
+                reapConnections(pool, connections);
+                return Poller::Action::Result::Type::Continue;
+            }));
+    while (true) {
+        try {
+            poller.poll(-1);
+        } catch (const std::exception& e) {
+            // E.g. an oversized datagram; drop the batch
+            printf("%s\n", e.what());
+        }
+    }
+}
+
 int main(int argc, char *argv[])
 {
     if (parseArgs(argc, argv) == -1)
         return EXIT_FAILURE;
 
 //    DEBUG_F = 1;
-    // Wait for handshake request and send back handshake response
-    std::unique_ptr<WireFormat::HandshakeReq> req;
-    std::unique_ptr<DCCPSocket> socket = respondHandshake(req);
-
-    // Set up the RaptorQ decoder
-    RaptorQDecoder decoder(req->otiCommon, req->otiScheme);
-    size_t decoderPaddedSize = 0;
-    for (int i = 0; i < decoder.blocks(); i++) {
-        decoderPaddedSize += decoder.block_size(i);
-    }
-
-    // Create the receiving file
-    int fd = SystemCall("open the file to be written",
-             open(req->fileName, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600));
-    SystemCall("lseek", lseek(fd, decoderPaddedSize - 1, SEEK_SET));
-    SystemCall("write", write(fd, "", 1));
-    void* start = mmap(NULL, decoderPaddedSize, PROT_WRITE, MAP_SHARED, fd, 0);
-    if (start == MAP_FAILED) {
-        printf("mmap failed:%s\n", strerror(errno));
-        return EXIT_FAILURE;
+    std::unique_ptr<Metrics::Exporter> metrics;
+    if (!METRICS_FILE.empty()) {
+        metrics.reset(new Metrics::Exporter(METRICS_FILE, "receiver",
+                                            METRICS_INTERVAL_MS));
+        if (!metrics->ok()) {
+            return EXIT_FAILURE;
+        }
+    }
+    std::unique_ptr<Tracer::Writer> trace;
+    if (!TRACE_FILE.empty()) {
+        trace.reset(new Tracer::Writer(TRACE_FILE, "receiver"));
+        if (!trace->ok()) {
+            return EXIT_FAILURE;
+        }
+        Tracer::nameThread("network");
     }
 
-    sem_init(&qNonfull, 0, SHARED_QUEUE_SIZE);
-    sem_init(&qNonempty, 0, 0);
+    if (SERVE_F) {
+        return serve();
+    }
 
-    // Receive file
-    receive(decoder, socket.get(), reinterpret_cast<Alignment*>(start));
+    // Wait for handshake request and send back handshake response
+    std::unique_ptr<WireFormat::HandshakeReq> req;
+    std::unique_ptr<DCCPSocket> socket;
+    std::unique_ptr<UDPSocket> udpSocket;
+    UDPSocket ackSocket;
+    if (UDP_F) {
+        udpSocket = respondHandshakeOverUdp(req);
+    } else {
+        socket = respondHandshake(req);
+    }
 
-    SystemCall("msync", msync(start, decoderPaddedSize, MS_SYNC));
-    SystemCall("munmap", munmap(start, decoderPaddedSize));
-    SystemCall("truncate the padding at the end of the file",
-            ftruncate(fd, req->fileSize));
-    SystemCall("close fd", close(fd));
+    // Over DCCP, the ACKs go to port 6331 of the sender
+    // TODO: avoid hardcode 6331
+    Transfer transfer {*req, UDP_F ? udpSocket.get() : &ackSocket,
+                       UDP_F ? udpSocket->peer_address()
+                             : Address(socket->peer_address().ip(), 6331),
+                       true};
+    {
+        // One worker per core, but no more than there are blocks
+        DecoderPool pool {downCast<unsigned>(std::min<size_t>(
+                transfer.blocks(),
+                std::max(1u, std::thread::hardware_concurrency())))};
+        pool.add(&transfer);
 
-    sem_destroy(&qNonfull);
-    sem_destroy(&qNonempty);
+        // Receive file, writing it back to disk as the blocks get decoded
+        if (UDP_F) {
+            receiveOverUdp(transfer, pool, udpSocket.get());
+        } else {
+            receive(transfer, pool, socket.get());
+        }
+    }
 
-    return EXIT_SUCCESS;
+    bool extracted = transfer.finish();
+    return extracted && transfer.decoded() ? EXIT_SUCCESS : EXIT_FAILURE;
 }
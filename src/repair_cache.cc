@@ -0,0 +1,192 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <RaptorQ.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "repair_cache.hh"
+
+static const char MAGIC[8] = {'R', 'Q', 'R', 'E', 'P', 'A', 'I', 'R'};
+static const uint32_t VERSION = 1;
+
+/**
+ * Returns the path of the cache file of a key in a directory, named after
+ * the 64-bit FNV-1a hash of the key.
+ */
+static std::string
+cachePath(const std::string& directory, const std::string& key)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : key) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016lx.rqcache",
+             static_cast<unsigned long>(hash));
+    return directory + "/" + name;
+}
+
+/**
+ * Returns the offsets of the repair symbols of each block, and the end of
+ * the file; see RepairCache::FileHeader.
+ */
+static std::vector<uint64_t>
+layout(const std::string& key, const std::vector<uint32_t>& blockSymbols)
+{
+    uint64_t offset = sizeof(RepairCache::FileHeader) +
+                      (key.size() + 7) / 8 * 8 +
+                      (blockSymbols.size() + 1) * sizeof(uint64_t);
+    std::vector<uint64_t> offsets;
+    for (uint32_t symbols : blockSymbols) {
+        offsets.push_back(offset);
+        offset += uint64_t(std::ceil(symbols * CACHED_REPAIR_FRACTION)) *
+                  SYMBOL_SIZE;
+    }
+    offsets.push_back(offset);
+    return offsets;
+}
+
+RepairCache::RepairCache(const std::string& directory,
+                         const std::string& key,
+                         const std::vector<uint32_t>& blockSymbols)
+    : path(cachePath(directory, key))
+    , tempPath()
+    , start(nullptr)
+    , length(0)
+    , offsets(nullptr)
+    , found(false)
+    , committed(false)
+    , filledBlocks(blockSymbols.size())
+    , numFilled(0)
+{
+    std::vector<uint64_t> expectedOffsets = layout(key, blockSymbols);
+    if (open(key, expectedOffsets)) {
+        found = true;
+        return;
+    }
+    mkdir(directory.c_str(), 0755);
+    create(key, expectedOffsets);
+}
+
+RepairCache::~RepairCache()
+{
+    if (start) {
+        munmap(start, length);
+    }
+    if (!tempPath.empty() && !committed) {
+        unlink(tempPath.c_str());
+    }
+}
+
+bool
+RepairCache::open(const std::string& key,
+                  const std::vector<uint64_t>& expectedOffsets)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat statBuf;
+    if (fstat(fd, &statBuf) != 0 ||
+            uint64_t(statBuf.st_size) != expectedOffsets.back()) {
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, expectedOffsets.back(), PROT_READ, MAP_SHARED,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const char* data = static_cast<const char*>(map);
+    FileHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    const char* fileOffsets = data + expectedOffsets.front() -
+            expectedOffsets.size() * sizeof(uint64_t);
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            header.version != VERSION || header.symbolSize != SYMBOL_SIZE ||
+            header.numBlocks + 1 != expectedOffsets.size() ||
+            header.keySize != key.size() ||
+            std::memcmp(data + sizeof(header), key.data(), key.size()) != 0 ||
+            std::memcmp(fileOffsets, expectedOffsets.data(),
+                        expectedOffsets.size() * sizeof(uint64_t)) != 0) {
+        munmap(map, expectedOffsets.back());
+        return false;
+    }
+    start = static_cast<char*>(map);
+    length = expectedOffsets.back();
+    offsets = reinterpret_cast<const uint64_t*>(fileOffsets);
+    return true;
+}
+
+bool
+RepairCache::create(const std::string& key,
+                    const std::vector<uint64_t>& expectedOffsets)
+{
+    tempPath = path + ".tmp." + std::to_string(getpid());
+    int fd = ::open(tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(tempPath.c_str());
+        tempPath.clear();
+        return false;
+    }
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, expectedOffsets.back()) == 0) {
+        map = mmap(NULL, expectedOffsets.back(), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        perror(tempPath.c_str());
+        close(fd);
+        unlink(tempPath.c_str());
+        tempPath.clear();
+        return false;
+    }
+    close(fd);
+
+    start = static_cast<char*>(map);
+    length = expectedOffsets.back();
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.symbolSize = SYMBOL_SIZE;
+    header.numBlocks = expectedOffsets.size() - 1;
+    header.keySize = key.size();
+    std::memcpy(start, &header, sizeof(header));
+    std::memcpy(start + sizeof(header), key.data(), key.size());
+    char* fileOffsets = start + expectedOffsets.front() -
+            expectedOffsets.size() * sizeof(uint64_t);
+    std::memcpy(fileOffsets, expectedOffsets.data(),
+                expectedOffsets.size() * sizeof(uint64_t));
+    offsets = reinterpret_cast<const uint64_t*>(fileOffsets);
+    return true;
+}
+
+void
+RepairCache::fill(size_t block)
+{
+    filledBlocks.set(block);
+    numFilled++;
+}
+
+bool
+RepairCache::commit()
+{
+    if (found || committed || tempPath.empty() ||
+            numFilled != filledBlocks.size()) {
+        return false;
+    }
+    if (msync(start, length, MS_SYNC) != 0 ||
+            rename(tempPath.c_str(), path.c_str()) != 0) {
+        perror(path.c_str());
+        return false;
+    }
+    committed = true;
+    return true;
+}
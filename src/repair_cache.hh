@@ -0,0 +1,179 @@
+#ifndef REPAIR_CACHE_HH
+#define REPAIR_CACHE_HH
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "common.hh"
+
+/**
+ * The cache keeps this fraction of the source symbols of a block (rounded
+ * up) as repair symbols: enough for the block to make it through 20% of
+ * losses without being precomputed, since 1.25 * (1 - 0.2) = 1.
+ */
+#define CACHED_REPAIR_FRACTION 0.25
+
+/**
+ * The first repair symbols of each block of a payload, kept on disk from
+ * one send to the next, so that sending the same payload again starts
+ * without precomputing any block: like the source symbols, which come from
+ * the file, the repair symbols come from a mapping of the cache file, and
+ * a block is precomputed only once it runs out of them. The first send
+ * fills the cache as it precomputes the blocks, and the cache is only
+ * found by later sends once complete. Caches are never evicted: a payload
+ * that changes gets a new one, and the old one stays until the directory
+ * is cleaned up.
+ *
+ * A cache file is named after a hash of its key, which identifies the
+ * payload and its encoding parameters, and starts with the key itself to
+ * tell collisions apart. libRaptorQ does not expose the intermediate
+ * symbols of a block, so repair symbols are what is kept of the
+ * precomputation.
+ */
+class RepairCache {
+  public:
+    /**
+     * Start of a cache file. It is followed by the key, padded to a
+     * multiple of 8 bytes, then by numBlocks + 1 offsets in the file, as
+     * uint64_t: where the repair symbols of each block start, and the end
+     * of the file. The symbols of a block are SYMBOL_SIZE bytes each, in
+     * the order of their ids.
+     */
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t symbolSize;
+        uint64_t numBlocks;
+        uint64_t keySize;
+    };
+
+    /**
+     * Maps the cache file of a payload if it is in a directory, or else
+     * creates one under a temporary name, to be filled in with fill() and
+     * made visible with commit().
+     *
+     * \param key
+     *      Identifies the payload, its contents (e.g. by modification and
+     *      status change times) and its encoding parameters.
+     * \param blockSymbols
+     *      Number of source symbols of each block, numbered across
+     *      segments.
+     */
+    RepairCache(const std::string& directory,
+                const std::string& key,
+                const std::vector<uint32_t>& blockSymbols);
+
+    /**
+     * Unmaps the cache file, and removes it if it was never committed.
+     */
+    ~RepairCache();
+
+    /**
+     * False if the cache file could be neither mapped nor created.
+     */
+    bool ok() const
+    {
+        return start != nullptr;
+    }
+
+    /**
+     * True if a previous send filled in the cache.
+     */
+    bool complete() const
+    {
+        return found;
+    }
+
+    /**
+     * Number of repair symbols the cache holds for a block; thread-safe.
+     */
+    uint32_t numRepairs(size_t block) const
+    {
+        return downCast<uint32_t>((offsets[block + 1] - offsets[block]) /
+                                  SYMBOL_SIZE);
+    }
+
+    /**
+     * Number of repair symbols of a block that can be read yet: all of them
+     * if the cache is complete or the block has been filled in, and none
+     * otherwise; thread-safe.
+     */
+    uint32_t numAvailable(size_t block) const
+    {
+        return found || filledBlocks.test(block) ? numRepairs(block) : 0;
+    }
+
+    /**
+     * Returns the index-th repair symbol of a block, i.e. the one of id
+     * (sbn, K + index) where K is the number of source symbols of the
+     * block.
+     */
+    const char* symbol(size_t block, uint32_t index) const
+    {
+        return start + offsets[block] + uint64_t(index) * SYMBOL_SIZE;
+    }
+
+    /**
+     * Returns where the index-th repair symbol of a block goes while the
+     * cache is being filled in.
+     */
+    Alignment* slot(size_t block, uint32_t index)
+    {
+        return reinterpret_cast<Alignment*>(start + offsets[block] +
+                                            uint64_t(index) * SYMBOL_SIZE);
+    }
+
+    /**
+     * Tells that all the repair symbols of a block have been written to
+     * their slots; thread-safe.
+     */
+    void fill(size_t block);
+
+    /**
+     * Makes the cache file visible to later sends, once all the blocks
+     * have been filled in.
+     *
+     * \return
+     *      False if some block is missing or the file cannot be renamed.
+     */
+    bool commit();
+
+  private:
+    /**
+     * Maps the cache file at path if it holds the same key and blocks.
+     */
+    bool open(const std::string& key,
+              const std::vector<uint64_t>& expectedOffsets);
+
+    /**
+     * Creates a cache file under a temporary name, with the header, key
+     * and offsets filled in.
+     */
+    bool create(const std::string& key,
+                const std::vector<uint64_t>& expectedOffsets);
+
+    /**
+     * Where the cache file goes, and where it is filled in.
+     */
+    const std::string path;
+    std::string tempPath;
+
+    char* start;
+    size_t length;
+
+    /**
+     * The offsets that follow the key in the file.
+     */
+    const uint64_t* offsets;
+
+    bool found;
+    bool committed;
+    Bitmask filledBlocks;
+    std::atomic<size_t> numFilled;
+
+    DISALLOW_COPY_AND_ASSIGN(RepairCache)
+};
+
+#endif /* REPAIR_CACHE_HH */
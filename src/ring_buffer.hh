@@ -0,0 +1,193 @@
+#ifndef RING_BUFFER_HH
+#define RING_BUFFER_HH
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+/**
+ * Size of a cache line. The indices updated by the producer and by the
+ * consumer of a ring are kept this far apart so that they do not falsely
+ * share a cache line.
+ */
+#define CACHE_LINE_SIZE 64
+
+/**
+ * Returns the smallest power of two that is no less than n (and at least 1).
+ */
+inline size_t
+roundUpToPowerOfTwo(size_t n)
+{
+    size_t power = 1;
+    while (power < n) {
+        power <<= 1;
+    }
+    return power;
+}
+
+/**
+ * A bounded lock-free queue between exactly one producer thread and one
+ * consumer thread. Items are stored by value in preallocated slots, so
+ * passing an item costs one copy and, amortized over a batch, a couple of
+ * atomic loads and stores; no system call is ever made.
+ *
+ * Items pushed with tryEmplace() only become visible to the consumer once
+ * the producer calls publish(), so that a whole batch is handed over with a
+ * single store.
+ */
+template<typename T>
+class SpscRing {
+  public:
+    /**
+     * \param minCapacity
+     *      Minimum number of items the ring can hold; rounded up to a power
+     *      of two.
+     */
+    explicit SpscRing(size_t minCapacity)
+        : mask(roundUpToPowerOfTwo(minCapacity) - 1)
+        , slots(new Slot[mask + 1])
+        , padding0()
+        , head(0)
+        , cachedTail(0)
+        , padding1()
+        , tail(0)
+        , stagedTail(0)
+        , cachedHead(0)
+        , padding2()
+    {}
+
+    ~SpscRing()
+    {
+        for (size_t i = head.load(); i != stagedTail; i++) {
+            item(i)->~T();
+        }
+    }
+
+    size_t capacity() const
+    {
+        return mask + 1;
+    }
+
+    /**
+     * Constructs an item in the next free slot. Producer only.
+     *
+     * \return
+     *      False if the ring is full.
+     */
+    template<typename... Args>
+    bool tryEmplace(Args&&... args)
+    {
+        if (stagedTail - cachedHead == capacity()) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (stagedTail - cachedHead == capacity()) {
+                return false;
+            }
+        }
+        new(item(stagedTail)) T(static_cast<Args&&>(args)...);
+        stagedTail++;
+        return true;
+    }
+
+    /**
+     * Makes the items emplaced so far visible to the consumer. Producer
+     * only.
+     */
+    void publish()
+    {
+        tail.store(stagedTail, std::memory_order_release);
+    }
+
+    /**
+     * Invokes f on up to max items in FIFO order, then frees their slots.
+     * Consumer only.
+     *
+     * \return
+     *      The number of items consumed.
+     */
+    template<typename Function>
+    size_t consume(Function&& f,
+                   size_t max = std::numeric_limits<size_t>::max())
+    {
+        size_t first = head.load(std::memory_order_relaxed);
+        if (cachedTail == first) {
+            cachedTail = tail.load(std::memory_order_acquire);
+        }
+        size_t count = std::min(cachedTail - first, max);
+        for (size_t i = first; i != first + count; i++) {
+            f(*item(i));
+            item(i)->~T();
+        }
+        head.store(first + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * Returns true if no published item is waiting. Consumer only.
+     */
+    bool empty()
+    {
+        cachedTail = tail.load(std::memory_order_acquire);
+        return cachedTail == head.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns the number of items emplaced so far. Producer only.
+     */
+    size_t produced() const
+    {
+        return stagedTail;
+    }
+
+    /**
+     * Returns the number of items consumed so far; an item counts once f
+     * has returned for it. Thread-safe.
+     */
+    size_t consumed() const
+    {
+        return head.load(std::memory_order_acquire);
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+  private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    T* item(size_t index)
+    {
+        return reinterpret_cast<T*>(&slots[index & mask]);
+    }
+
+    const size_t mask;
+
+    std::unique_ptr<Slot[]> slots;
+
+    char padding0[CACHE_LINE_SIZE];
+
+    /**
+     * Consumer side: index of the next item to consume, and the latest
+     * value of tail it has seen.
+     */
+    std::atomic<size_t> head;
+    size_t cachedTail;
+
+    char padding1[CACHE_LINE_SIZE];
+
+    /**
+     * Producer side: index up to which items have been published, index up
+     * to which they have been constructed, and the latest value of head it
+     * has seen.
+     */
+    std::atomic<size_t> tail;
+    size_t stagedTail;
+    size_t cachedHead;
+
+    char padding2[CACHE_LINE_SIZE];
+};
+
+#endif /* RING_BUFFER_HH */
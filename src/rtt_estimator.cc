@@ -0,0 +1,65 @@
+#include <algorithm>
+
+#include "rtt_estimator.hh"
+
+RttEstimator::RttEstimator()
+    : numSamples(0)
+    , latestRtt(0)
+    , minRtt(0)
+    , srtt(0)
+    , rttvar(0)
+    , latestDelay(0)
+    , baseDelay(0)
+    , maxQueueing(0)
+    , totalAckDelay(0)
+{}
+
+void
+RttEstimator::addSample(uint64_t rtt, uint64_t ackDelay, int64_t oneWayDelay)
+{
+    // The smallest RTT is taken before leaving out the ACK delay, which the
+    // receiver measures on a clock of its own
+    rtt = std::max<uint64_t>(rtt, 1);
+    minRtt = numSamples == 0 ? rtt : std::min(minRtt, rtt);
+    if (rtt >= minRtt + ackDelay) {
+        rtt -= ackDelay;
+    }
+    latestRtt = rtt;
+
+    if (numSamples == 0) {
+        srtt = rtt;
+        rttvar = rtt / 2;
+        baseDelay = oneWayDelay;
+    } else {
+        uint64_t deviation = srtt > rtt ? srtt - rtt : rtt - srtt;
+        rttvar = (3 * rttvar + deviation) / 4;
+        srtt = (7 * srtt + rtt) / 8;
+        baseDelay = std::min(baseDelay, oneWayDelay);
+    }
+    latestDelay = oneWayDelay;
+    maxQueueing = std::max(maxQueueing, queueingDelay());
+    totalAckDelay += ackDelay;
+    numSamples++;
+}
+
+uint64_t
+RttEstimator::retransmissionTimeout(uint64_t minTimeout,
+                                    uint64_t initialTimeout) const
+{
+    if (numSamples == 0) {
+        return initialTimeout;
+    }
+    return std::max(minTimeout, srtt + 4 * rttvar);
+}
+
+uint64_t
+RttEstimator::queueingDelay() const
+{
+    return static_cast<uint64_t>(latestDelay - baseDelay);
+}
+
+uint64_t
+RttEstimator::averageAckDelay() const
+{
+    return numSamples == 0 ? 0 : totalAckDelay / numSamples;
+}
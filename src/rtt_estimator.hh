@@ -0,0 +1,87 @@
+#ifndef RTT_ESTIMATOR_HH
+#define RTT_ESTIMATOR_HH
+
+#include <cstdint>
+
+/**
+ * Estimates the round-trip time of the path and the queueing delay along it
+ * from the timestamps the receiver echoes in its ACKs: a smoothed RTT and
+ * its variation as in RFC 6298, and the one-way delay above the smallest
+ * one seen, as LEDBAT does (RFC 6817).
+ *
+ * RTT samples leave out the time the receiver held the packet before
+ * acknowledging it, unless that would make them smaller than the smallest
+ * RTT seen, which is then more likely due to clock jitter.
+ */
+class RttEstimator {
+  public:
+    RttEstimator();
+
+    /**
+     * Takes in the timestamps carried by one ACK.
+     *
+     * \param rtt
+     *      Time from sending the packet to receiving its ACK, in
+     *      microseconds.
+     * \param ackDelay
+     *      Time the receiver held the packet before acknowledging it, in
+     *      microseconds.
+     * \param oneWayDelay
+     *      Time from sending the packet to its receipt, in microseconds,
+     *      including the unknown offset between the clocks of the two
+     *      hosts.
+     */
+    void addSample(uint64_t rtt, uint64_t ackDelay, int64_t oneWayDelay);
+
+    bool hasSamples() const { return numSamples > 0; }
+
+    /**
+     * The latest RTT sample, the smallest one, their smoothed value and its
+     * variation, in microseconds; 0 until the first sample.
+     */
+    uint64_t latest() const { return latestRtt; }
+    uint64_t minimum() const { return minRtt; }
+    uint64_t smoothed() const { return srtt; }
+    uint64_t variation() const { return rttvar; }
+
+    /**
+     * Time after which packets in flight without news from the receiver
+     * are considered lost, in microseconds: the smoothed RTT plus four
+     * times its variation, but at least minTimeout; initialTimeout until
+     * the first sample.
+     */
+    uint64_t retransmissionTimeout(uint64_t minTimeout,
+                                   uint64_t initialTimeout) const;
+
+    /**
+     * One-way delay of the latest sample above the smallest one seen, in
+     * microseconds: the time the packet spent in queues along the path.
+     */
+    uint64_t queueingDelay() const;
+
+    /**
+     * Largest queueing delay seen, in microseconds.
+     */
+    uint64_t maxQueueingDelay() const { return maxQueueing; }
+
+    /**
+     * Average time the receiver held the packets before acknowledging
+     * them, in microseconds.
+     */
+    uint64_t averageAckDelay() const;
+
+  private:
+    uint64_t numSamples;
+    uint64_t latestRtt;
+    uint64_t minRtt;
+    uint64_t srtt;
+    uint64_t rttvar;
+
+    int64_t latestDelay;
+    int64_t baseDelay;
+    uint64_t maxQueueing;
+
+    uint64_t totalAckDelay;
+};
+
+#endif /* RTT_ESTIMATOR_HH */
@@ -0,0 +1,281 @@
+#include <cmath>
+#include <cstring>
+#include <RaptorQ.hpp>
+
+#include "scheduler.hh"
+
+TransmissionState::TransmissionState(
+        std::unique_ptr<CongestionController> controller,
+        size_t numBlocks,
+        size_t blockWindow,
+        uint32_t overhead,
+        uint64_t now)
+    : controller(std::move(controller))
+    , lossRate(INIT_LOSS_RATE)
+    , reportFirstBlock(0)
+    , reportReceived()
+    , overhead(overhead)
+    , decodedBlocks(numBlocks)
+    , numDecoded(0)
+    , decodedPrefix(0)
+    , windowEnd(blockWindow)
+    , nextSeq(0)
+    , accountedSeq(0)
+    , packetsReceived(0)
+    , packetsLost(0)
+    , lastFeedbackTime(now)
+    , rtt()
+{
+}
+
+void
+TransmissionState::checkTimeout(uint64_t now)
+{
+    if (inflight() > 0 &&
+            now - lastFeedbackTime > retransmissionTimeout()) {
+        controller->onTimeout();
+        accountedSeq = nextSeq;
+        lastFeedbackTime = now;
+    }
+}
+
+void
+TransmissionState::onAck(const WireFormat::Ack& ack)
+{
+    uint64_t bitmask[4];
+    std::memcpy(bitmask, ack.bitmask, sizeof(bitmask));
+    if (ack.firstBlock > decodedPrefix) {
+        numDecoded += decodedBlocks.setRange(decodedPrefix, ack.firstBlock);
+        decodedPrefix = ack.firstBlock;
+    }
+    numDecoded += decodedBlocks.bitwiseOr(bitmask, 4, ack.firstBlock / 64);
+    // The window never shrinks; a smaller one comes from a stale ACK
+    windowEnd = std::max<size_t>(windowEnd, ack.windowEnd);
+}
+
+bool
+TransmissionState::onFeedback(const WireFormat::CongestionFeedback& feedback,
+                              uint64_t now)
+{
+    if (feedback.echoSendTime == 0 ||
+            feedback.packetsReceived <= packetsReceived) {
+        // No feedback, or a stale ACK that was reordered
+        return false;
+    }
+
+    uint32_t received = feedback.packetsReceived;
+    uint32_t sentUpToHighest = feedback.highestSeq + 1;
+    uint32_t lost = sentUpToHighest > received ? sentUpToHighest - received : 0;
+
+    AckSample sample;
+    sample.now = now;
+    sample.newlyAcked = received - packetsReceived;
+    sample.newlyLost = lost > packetsLost ? lost - packetsLost : 0;
+    accountedSeq = std::max(accountedSeq, sentUpToHighest);
+    sample.inflight = inflight();
+    sample.highestSeq = feedback.highestSeq;
+    sample.nextSeq = nextSeq;
+    int64_t oneWayDelay = static_cast<int64_t>(feedback.recvTime) -
+                          static_cast<int64_t>(feedback.echoSendTime);
+    rtt.addSample(now - feedback.echoSendTime, feedback.ackDelay,
+                  oneWayDelay);
+    sample.rtt = rtt.latest();
+    sample.oneWayDelay = oneWayDelay;
+    controller->onAck(sample);
+
+    packetsReceived = received;
+    packetsLost = std::max(packetsLost, lost);
+    lastFeedbackTime = now;
+    return true;
+}
+
+bool
+TransmissionState::onLossReport(const WireFormat::ExtendedAck& extendedAck,
+                                size_t length)
+{
+    const WireFormat::CongestionFeedback& feedback = extendedAck.ack.feedback;
+    if (feedback.echoSendTime == 0 ||
+            feedback.packetsReceived <= packetsReceived) {
+        return false;
+    }
+    lossRate = extendedAck.lossRate / 65536.0;
+    reportFirstBlock = extendedAck.ack.firstBlock;
+    reportReceived = extendedAck.symbolCounts(length);
+    return true;
+}
+
+Scheduler::Scheduler(const TransmissionState& tx,
+                     std::vector<uint32_t> blockSymbols,
+                     std::function<bool(size_t)> precomputed,
+                     bool feedback)
+    : tx(tx)
+    , blockSymbols(std::move(blockSymbols))
+    , precomputed(std::move(precomputed))
+    , feedback(feedback)
+    , symbolsSent(this->blockSymbols.size(), 0)
+    , symbolsInFlight(this->blockSymbols.size(), 0)
+    , lastSendTime(this->blockSymbols.size(), 0)
+    , inFlight()
+    , repairCredit(0)
+    , oldestBlock(0)
+    , currBlock(0)
+    , esi(0)
+    , phase(ROUND)
+    , started(false)
+    , cursor(0)
+    , roundSent(false)
+    , stalledBlock(0)
+    , stalledLeft(0)
+{
+}
+
+Scheduler::Decision
+Scheduler::next(uint64_t now, uint32_t seq)
+{
+    while (1) {
+        switch (phase) {
+            case ROUND:
+                if (!started) {
+                    // Between rounds: hold back the next block until the
+                    // receiver has room for it
+                    if (tx.finished()) {
+                        return {DONE, 0, 0};
+                    }
+                    settle();
+                    if (currBlock < blockSymbols.size() &&
+                            currBlock < tx.windowEnd) {
+                        phase = STALLED;
+                        cursor = oldestBlock;
+                        continue;
+                    }
+                    started = true;
+                    cursor = oldestBlock;
+                    roundSent = false;
+                }
+                while (cursor < currBlock) {
+                    size_t block = cursor++;
+                    if (sendable(block, now)) {
+                        roundSent = true;
+                        return send(REPAIR, block, 0, seq, now);
+                    }
+                }
+                started = false;
+                if (!roundSent && !tx.finished()) {
+                    return {WAIT, 0, 0};
+                }
+                break;
+
+            case STALLED:
+                if (stalledLeft > 0 && !tx.finished()) {
+                    stalledLeft--;
+                    return send(REPAIR, stalledBlock, 0, seq, now);
+                }
+                stalledLeft = 0;
+                while (cursor < currBlock && stalledLeft == 0) {
+                    size_t block = cursor++;
+                    if (symbolsInFlight[block] == 0 && sendable(block, now)) {
+                        stalledBlock = block;
+                        stalledLeft = repairsNeeded(block, now);
+                    }
+                }
+                if (stalledLeft == 0) {
+                    phase = SOURCE_SYMBOL;
+                    esi = 0;
+                }
+                break;
+
+            case SOURCE_SYMBOL:
+                phase = CREDIT;
+                started = false;
+                return send(SOURCE, currBlock, esi++, seq, now);
+
+            case CREDIT:
+                if (!started) {
+                    double p = lossRate();
+                    repairCredit += p / (1 - p);
+                    settle();
+                    started = true;
+                    cursor = oldestBlock;
+                }
+                if (repairCredit >= 1 && !tx.finished()) {
+                    // Does not hold up the source symbols for blocks not
+                    // precomputed
+                    while (cursor < currBlock && !sendable(cursor, now)) {
+                        cursor++;
+                    }
+                    if (cursor < currBlock) {
+                        repairCredit--;
+                        return send(REPAIR, cursor, 0, seq, now);
+                    }
+                    repairCredit = std::min(repairCredit, 1.0);
+                }
+                started = false;
+                if (esi < blockSymbols[currBlock]) {
+                    phase = SOURCE_SYMBOL;
+                } else {
+                    currBlock++;
+                    phase = ROUND;
+                }
+                break;
+        }
+    }
+}
+
+void
+Scheduler::settle()
+{
+    while (!inFlight.empty() &&
+            static_cast<int32_t>(tx.accountedSeq -
+                                 inFlight.front().first) > 0) {
+        symbolsInFlight[inFlight.front().second]--;
+        inFlight.pop_front();
+    }
+    while (oldestBlock < currBlock && tx.decodedBlocks.test(oldestBlock)) {
+        oldestBlock++;
+    }
+}
+
+uint32_t
+Scheduler::repairsNeeded(size_t block, uint64_t now) const
+{
+    if (block >= currBlock || tx.decodedBlocks.test(block)) {
+        return 0;
+    }
+    double p = lossRate();
+    uint32_t inFlightCount = symbolsInFlight[block];
+    double received = (symbolsSent[block] - inFlightCount) * (1 - p);
+    int reported = tx.reportedReceived(block);
+    if (reported >= 0) {
+        received = reported;
+    }
+    double missing = blockSymbols[block] + tx.overhead - received -
+                     inFlightCount * (1 - p);
+    if (missing <= 0) {
+        if (inFlightCount > 0) {
+            return 0;
+        }
+        // The receiver should have enough symbols; give it about a round
+        // trip to finish decoding the block before sending more (without
+        // feedback, we cannot tell)
+        uint64_t grace = tx.rtt.hasSamples() ? 2 * tx.rtt.smoothed()
+                                             : tx.retransmissionTimeout();
+        if (feedback && now - lastSendTime[block] < grace) {
+            return 0;
+        }
+        missing = 1;
+    }
+    return static_cast<uint32_t>(std::ceil(missing / (1 - p)));
+}
+
+Scheduler::Decision
+Scheduler::send(Action action, size_t block, uint32_t esi, uint32_t seq,
+                uint64_t now)
+{
+    symbolsSent[block]++;
+    lastSendTime[block] = now;
+    if (feedback) {
+        inFlight.emplace_back(seq, block);
+        symbolsInFlight[block]++;
+    }
+    return {action, block, esi};
+}
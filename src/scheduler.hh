@@ -0,0 +1,335 @@
+#ifndef SCHEDULER_HH
+#define SCHEDULER_HH
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "common.hh"
+#include "congestion_control.hh"
+#include "rtt_estimator.hh"
+#include "wire_format.hh"
+
+/**
+ * Bounds of the retransmission timeout after which packets in flight are
+ * considered lost if no feedback arrives, in microseconds.
+ */
+#define MIN_RTO_US 200000
+#define INITIAL_RTO_US 1000000
+
+/**
+ * Loss rates reported by the receiver are capped at this value when working
+ * out the number of repair symbols to send, which grows without bound as the
+ * loss rate nears 1.
+ */
+#define MAX_LOSS_RATE 0.9
+
+/**
+ * What the sender knows of a transfer from the receiver's ACKs: the blocks
+ * decoded, the receiver's window, the symbols it has received, and the
+ * congestion feedback, which drives the congestion controller. It has no
+ * sockets and takes the time as an argument, so that the simulator can
+ * run it on a virtual clock.
+ */
+struct TransmissionState {
+    /**
+     * Decides the pacing rate and the number of packets in flight.
+     */
+    std::unique_ptr<CongestionController> controller;
+
+    /**
+     * Fraction of the data packets lost, as last reported by the receiver.
+     */
+    double lossRate;
+
+    /**
+     * Number of symbols received for each of the blocks from
+     * reportFirstBlock on, as last reported by the receiver (-1 for the
+     * decoded ones); empty until the first report.
+     */
+    size_t reportFirstBlock;
+    std::vector<int> reportReceived;
+
+    /**
+     * Number of symbols beyond its source symbols each block should reach
+     * the receiver with; see Scheduler.
+     */
+    uint32_t overhead;
+
+    /**
+     * Represents blocks that are decoded by the receiver, numbered across
+     * segments, and how many there are.
+     */
+    Bitmask decodedBlocks;
+    size_t numDecoded;
+
+    /**
+     * All blocks before this one have been reported decoded as such, so
+     * that each ACK only sets the bits of the blocks after it.
+     */
+    size_t decodedPrefix;
+
+    /**
+     * The receiver drops the symbols of blocks from this one on.
+     */
+    size_t windowEnd;
+
+    /**
+     * Sequence number of the next data packet to send.
+     */
+    uint32_t nextSeq;
+
+    /**
+     * Packets with a sequence number below this one have either been
+     * reported received or are considered lost.
+     */
+    uint32_t accountedSeq;
+
+    /**
+     * Packet counters of the latest feedback from the receiver.
+     */
+    uint32_t packetsReceived;
+    uint32_t packetsLost;
+
+    /**
+     * Time of the latest feedback from the receiver (or of the start of the
+     * transmission), in microseconds.
+     */
+    uint64_t lastFeedbackTime;
+
+    /**
+     * Round-trip time and queueing delay of the path.
+     */
+    RttEstimator rtt;
+
+    TransmissionState(std::unique_ptr<CongestionController> controller,
+                      size_t numBlocks,
+                      size_t blockWindow,
+                      uint32_t overhead,
+                      uint64_t now);
+
+    bool finished() const
+    {
+        return numDecoded == decodedBlocks.size();
+    }
+
+    /**
+     * Marks all blocks as decoded to stop the transmission, e.g. because
+     * the receiver has gone away.
+     */
+    void markAllDecoded()
+    {
+        numDecoded += decodedBlocks.setRange(0, decodedBlocks.size());
+    }
+
+    uint32_t inflight() const
+    {
+        return nextSeq - accountedSeq;
+    }
+
+    uint64_t retransmissionTimeout() const
+    {
+        return rtt.retransmissionTimeout(MIN_RTO_US, INITIAL_RTO_US);
+    }
+
+    /**
+     * Considers all packets in flight lost if no feedback has arrived for a
+     * retransmission timeout.
+     */
+    void checkTimeout(uint64_t now);
+
+    /**
+     * Returns the number of symbols of a block the receiver has reported
+     * received, or -1 if the latest report does not cover the block.
+     */
+    int reportedReceived(size_t block) const
+    {
+        if (block < reportFirstBlock ||
+                block - reportFirstBlock >= reportReceived.size()) {
+            return -1;
+        }
+        return reportReceived[block - reportFirstBlock];
+    }
+
+    /**
+     * Takes in the blocks an ACK reports decoded, and the receiver's
+     * window.
+     */
+    void onAck(const WireFormat::Ack& ack);
+
+    /**
+     * Feeds the congestion feedback carried by an ACK to the RTT estimator
+     * and the congestion controller.
+     *
+     * \param now
+     *      Time the ACK arrived, in microseconds.
+     * \return
+     *      False if the ACK carries no feedback, or stale feedback.
+     */
+    bool onFeedback(const WireFormat::CongestionFeedback& feedback,
+                    uint64_t now);
+
+    /**
+     * Takes in the loss rate and the symbol counts carried by an extended
+     * ACK, unless the ACK is stale; to be called before onFeedback().
+     *
+     * \param length
+     *      Size of the datagram the ACK came in.
+     * \return
+     *      False if the ACK is stale.
+     */
+    bool onLossReport(const WireFormat::ExtendedAck& extendedAck,
+                      size_t length);
+
+    DISALLOW_COPY_AND_ASSIGN(TransmissionState)
+};
+
+/**
+ * Decides which symbol the sender sends next. It sends the source symbols
+ * of the blocks in order, then repair symbols until the receiver has
+ * decoded them all. A block needs enough symbols for the receiver to get
+ * TransmissionState::overhead symbols more than its source symbols,
+ * counting those the receiver has reported and, at the latest loss rate,
+ * those still in flight. Its repair symbols are interleaved with the source
+ * symbols of the next blocks, and stop as soon as enough are in flight.
+ */
+class Scheduler {
+  public:
+    enum Action {
+        // Send source symbol esi of the block
+        SOURCE,
+        // Send the next repair symbol of the block
+        REPAIR,
+        // Nothing is worth sending until more blocks are precomputed, ACKs
+        // come in or the receiver's window moves on
+        WAIT,
+        // The receiver has decoded all the blocks
+        DONE
+    };
+
+    struct Decision {
+        Action action;
+        size_t block;
+        uint32_t esi;
+    };
+
+    /**
+     * \param tx
+     *      What the sender knows of the transfer, kept up to date by the
+     *      caller as ACKs come in.
+     * \param blockSymbols
+     *      Number of source symbols of each block, numbered across
+     *      segments.
+     * \param precomputed
+     *      Tells whether the repair symbols of a block can be generated
+     *      without waiting; only asked of blocks that need some.
+     * \param feedback
+     *      False if the receiver gives no congestion feedback (over DCCP),
+     *      in which case no symbols are deemed in flight.
+     */
+    Scheduler(const TransmissionState& tx,
+              std::vector<uint32_t> blockSymbols,
+              std::function<bool(size_t)> precomputed,
+              bool feedback);
+
+    /**
+     * Decides what to send next. The symbol returned, if any, is accounted
+     * as sent.
+     *
+     * \param now
+     *      Current time, in microseconds.
+     * \param seq
+     *      Sequence number the symbol will be sent with.
+     */
+    Decision next(uint64_t now, uint32_t seq);
+
+  private:
+    enum Phase {
+        // Rounds of one repair symbol per block that needs some, until the
+        // receiver has room for the next block (or has decoded them all)
+        ROUND,
+        // All the repair symbols needed by blocks with none in flight,
+        // before the source symbols of the next block
+        STALLED,
+        // The next source symbol of the current block
+        SOURCE_SYMBOL,
+        // Repair symbols of previous blocks worth the share of the packets
+        // that gets lost, after each source symbol
+        CREDIT
+    };
+
+    /**
+     * Forgets the symbols the receiver has accounted for, and the blocks
+     * it has decoded.
+     */
+    void settle();
+
+    /**
+     * Returns the number of repair symbols a block needs on top of those in
+     * flight.
+     */
+    uint32_t repairsNeeded(size_t block, uint64_t now) const;
+
+    /**
+     * Returns true if a repair symbol of a block should be sent right away.
+     */
+    bool sendable(size_t block, uint64_t now) const
+    {
+        return block < tx.windowEnd && repairsNeeded(block, now) > 0 &&
+               precomputed(block);
+    }
+
+    Decision send(Action action, size_t block, uint32_t esi, uint32_t seq,
+                  uint64_t now);
+
+    double lossRate() const
+    {
+        return std::min(tx.lossRate, MAX_LOSS_RATE);
+    }
+
+    const TransmissionState& tx;
+    const std::vector<uint32_t> blockSymbols;
+    const std::function<bool(size_t)> precomputed;
+    const bool feedback;
+
+    // Per block: the number of symbols sent, the number of those the
+    // receiver has not accounted for yet, and the time the latest one was
+    // sent
+    std::vector<uint32_t> symbolsSent;
+    std::vector<uint32_t> symbolsInFlight;
+    std::vector<uint64_t> lastSendTime;
+
+    // Sequence number and block of the symbols in flight, oldest first
+    std::deque<std::pair<uint32_t, size_t>> inFlight;
+
+    // Number of repair symbols that may be sent before the next source
+    // symbol
+    double repairCredit;
+
+    // All blocks before this one are known to be decoded
+    size_t oldestBlock;
+
+    // Blocks before this one have had all their source symbols sent
+    size_t currBlock;
+
+    // Next source symbol of currBlock
+    uint32_t esi;
+
+    Phase phase;
+
+    // Whether a round, or the spending of the credit, is under way: the
+    // next block to consider, and whether the round has sent anything
+    bool started;
+    size_t cursor;
+    bool roundSent;
+
+    // Block whose stalled repair symbols are being sent, and how many
+    // more it needs
+    size_t stalledBlock;
+    uint32_t stalledLeft;
+
+    DISALLOW_COPY_AND_ASSIGN(Scheduler)
+};
+
+#endif /* SCHEDULER_HH */
@@ -1,27 +1,235 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <RaptorQ.hpp>
 #include <unistd.h>
+#include <sys/prctl.h>
 
 #include "tub.hh"
 #include "common.hh"
 #include "wire_format.hh"
 #include "progress.hh"
+#include "congestion_control.hh"
+#include "encoder_planner.hh"
+#include "metrics.hh"
+#include "pacer.hh"
+#include "repair_cache.hh"
+#include "rtt_estimator.hh"
+#include "scheduler.hh"
+#include "timestamp.hh"
+#include "tracer.hh"
+#include "session.hh"
 
 int DEBUG_F;
 
+/**
+ * Metrics exported with -M.
+ */
+static Metrics::Counter packetsSent("packets_sent");
+static Metrics::Counter bytesSent("bytes_sent");
+static Metrics::Counter sendCalls("send_calls");
+static Metrics::Counter sendEagain("send_eagain");
+static Metrics::Counter sourceSymbols("source_symbols");
+static Metrics::Counter repairSymbols("repair_symbols");
+static Metrics::Counter acksReceived("acks_received");
+static Metrics::Gauge congestionWindow("congestion_window");
+static Metrics::Gauge pacingRate("pacing_rate");
+static Metrics::Gauge reportedLossRate("loss_rate_ppm");
+static Metrics::Histogram packetsPerSend("packets_per_send");
+static Metrics::Histogram rttUs("rtt_us");
+static Metrics::Histogram queueingDelayUs("queueing_delay_us");
+
+/**
+ * Default number of DataPackets handed to the kernel per sendmmsg() call.
+ * Over UDP, the pacer releases packets in micro-bursts anyway, and GSO
+ * sends a batch as a few large datagrams; over DCCP, and with the "fixed"
+ * controller, whose rate is a batch per FIXED_BATCH_INTERVAL_US, packets
+ * go one by one unless -b is given.
+ */
+#define DEFAULT_BATCH_SIZE 1
+#define DEFAULT_UDP_BATCH_SIZE 32
+
+/**
+ * Congestion controller used over UDP unless one is given with -c. Not
+ * LEDBAT, which halves its window on every loss and so crawls on links
+ * with random loss, which RaptorQ otherwise rides through.
+ */
+#define DEFAULT_UDP_CONGESTION_CONTROL "bbr"
+
+/**
+ * Interval between two batches sent by the "fixed" congestion controller,
+ * in microseconds. This used to be a hardcoded usleep() after every send.
+ */
+#define FIXED_BATCH_INTERVAL_US 350
+
+/**
+ * Time to back off when the DCCP socket refuses a packet, in microseconds.
+ * ACKs are still processed in the meantime.
+ */
+#define EAGAIN_BACKOFF_US 350
+
+/**
+ * With SO_TXTIME, packets are handed to the kernel up to this many
+ * microseconds before their departure time.
+ */
+#define TXTIME_LOOKAHEAD_US 2000
+
+/**
+ * Handshake requests over UDP are retransmitted after this many
+ * milliseconds without a response, up to HANDSHAKE_MAX_ATTEMPTS times.
+ */
+#define HANDSHAKE_TIMEOUT_MS 200
+#define HANDSHAKE_MAX_ATTEMPTS 25
+
+/**
+ * A part of the file that is encoded on its own; see SEGMENT_SIZE.
+ */
+struct Segment {
+    std::unique_ptr<RaptorQEncoder> encoder;
+
+    /**
+     * Number of the first block of the segment, counting the blocks of all
+     * segments in order.
+     */
+    size_t firstBlock;
+
+    /**
+     * Data of the segment in the file.
+     */
+    const Alignment* begin;
+    const Alignment* end;
+};
+
+/**
+ * Settings of the sender given on the command line.
+ */
+struct Options {
+    std::string host;
+    std::string port;
+    std::string filename;
+
+    /**
+     * Number of DataPackets handed to the kernel per sendmmsg() call; 0
+     * until parseOptions() picks the default of the transport.
+     */
+    size_t batchSize;
+
+    /**
+     * True to send data over plain UDP with user-space congestion control
+     * instead of DCCP.
+     */
+    bool udp;
+
+    /**
+     * Name of the congestion controller; see makeCongestionController().
+     */
+    std::string congestionControl;
+
+    /**
+     * Upper bound on the pacing rate in bytes per second, or 0 for none.
+     * This is the sending rate of the "fixed" congestion controller.
+     */
+    uint64_t maxRate;
+
+    /**
+     * True to let the kernel pace the packets (SO_TXTIME and the fq qdisc)
+     * instead of waking up for every micro-burst.
+     */
+    bool txtime;
+
+    /**
+     * True if FILE lists the files to send rather than being one; see
+     * readFileList().
+     */
+    bool fileList;
+
+    /**
+     * Number of symbols beyond its source symbols each block should reach
+     * the receiver with; see Scheduler.
+     */
+    uint32_t overhead;
+
+    /**
+     * Memory limit of the receiver (its -m) in bytes, or 0 for none; the
+     * blocks are sized for it. See EncoderPlanner.
+     */
+    size_t receiverMemory;
+
+    /**
+     * Directory of the repair symbol caches, or empty for none; see
+     * RepairCache.
+     */
+    std::string cacheDirectory;
+
+    /**
+     * File to export the metrics to; none if empty.
+     */
+    std::string metricsFile;
+
+    /**
+     * File to write a trace of the transfer to; none if empty.
+     */
+    std::string traceFile;
+
+    Options()
+        : host()
+        , port("6330")
+        , filename()
+        , batchSize(0)
+        , udp(false)
+        , congestionControl()
+        , maxRate(0)
+        , txtime(false)
+        , fileList(false)
+        , overhead(0)
+        , receiverMemory(0)
+        , cacheDirectory()
+        , metricsFile()
+        , traceFile()
+    {}
+};
+
+/**
+ * What is being transferred, as described in the handshake request.
+ */
+struct Payload {
+    const char* name;
+    uint64_t size;
+
+    /**
+     * 0 for a single file; see WireFormat::HandshakeReq::numFiles.
+     */
+    uint32_t numFiles;
+};
+
 void printUsage(char *command) 
 {
-    std::cerr << "Usage: " << command << " HOST [PORT] FILE [-dh]" << std::endl;
+    std::cerr << "Usage: " << command << " HOST [PORT] FILE [-dhuTl] [-b BATCH] [-c CC] [-r RATE] [-o OVERHEAD] [-m MB] [-C DIR] [-M FILE] [-t FILE]" << std::endl;
+    std::cerr << "\tFILE may be a directory, whose files are sent in one session" << std::endl;
     std::cerr << "\t-h: help" << std::endl;
     std::cerr << "\t-d: debug (per-symbol messages instead of a progress bar)" << std::endl;
+    std::cerr << "\t-b: number of packets sent per sendmmsg() call (default "
+              << DEFAULT_UDP_BATCH_SIZE << " over UDP, " << DEFAULT_BATCH_SIZE
+              << " over DCCP or with -c fixed)" << std::endl;
+    std::cerr << "\t-u: send over UDP with user-space congestion control instead of DCCP" << std::endl;
+    std::cerr << "\t-c: congestion controller: fixed, ledbat or bbr (default "
+              << DEFAULT_UDP_CONGESTION_CONTROL << " over UDP, fixed over DCCP)" << std::endl;
+    std::cerr << "\t-r: maximum sending rate in Mbit/s (the rate of the fixed controller)" << std::endl;
+    std::cerr << "\t-T: pace in the kernel with SO_TXTIME (needs -u and the fq qdisc)" << std::endl;
+    std::cerr << "\t-l: FILE lists the files to send in one session, one path per line" << std::endl;
+    std::cerr << "\t-o: extra repair symbols per block, against decoding failures (default 0)" << std::endl;
+    std::cerr << "\t-m: memory limit of the receiver in MB (its -m), to size the blocks for" << std::endl;
+    std::cerr << "\t-C: keep repair symbols in DIR, so that the same files are sent again without precomputing them" << std::endl;
+    std::cerr << "\t-M: export metrics to FILE every second and at exit (CSV if FILE ends in .csv, JSON lines otherwise)" << std::endl;
+    std::cerr << "\t-t: trace every packet to FILE, to be converted with trace2json" << std::endl;
 }
 
 int parseArgs(int argc,
               char *argv[],
-              std::string& host,
-              std::string& port,
-              char*& filename)
+              Options& options)
 {
     /* check the command-line arguments */
     if ( argc < 1 ) { abort(); } /* for sticklers */
@@ -38,25 +246,67 @@ int parseArgs(int argc,
     }
 
     if (argsNum == 3) {
-        host = argv[1];
-        port = "6330";
-        filename = argv[2];
+        options.host = argv[1];
+        options.filename = argv[2];
     } else if (argsNum == 4) {
-        host = argv[1];
-        port = argv[2];
-        filename = argv[3];
+        options.host = argv[1];
+        options.port = argv[2];
+        options.filename = argv[3];
     } else {
         printUsage(argv[0]);
         return -1;
     }
 
     optind = argsNum;
-    while ((c = getopt(argc, argv, "dh")) != -1) {
+    while ((c = getopt(argc, argv, "db:uc:r:Tlo:m:C:M:t:h")) != -1) {
         switch (c) {
             case 'd':
                 DEBUG_F = 1;
                 printf("RIGHT\n");
                 break;
+            case 'b':
+                options.batchSize = std::strtoul(optarg, NULL, 10);
+                if (options.batchSize == 0) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'u':
+                options.udp = true;
+                break;
+            case 'c':
+                options.congestionControl = optarg;
+                break;
+            case 'r':
+                options.maxRate = static_cast<uint64_t>(
+                        std::strtod(optarg, NULL) * 1000000 / 8);
+                if (options.maxRate == 0) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'T':
+                options.txtime = true;
+                break;
+            case 'l':
+                options.fileList = true;
+                break;
+            case 'o':
+                options.overhead = downCast<uint32_t>(
+                        std::strtoul(optarg, NULL, 10));
+                break;
+            case 'm':
+                options.receiverMemory = std::strtoul(optarg, NULL, 10) << 20;
+                break;
+            case 'C':
+                options.cacheDirectory = optarg;
+                break;
+            case 'M':
+                options.metricsFile = optarg;
+                break;
+            case 't':
+                options.traceFile = optarg;
+                break;
             case 'h':
             case '?':
                 printUsage(argv[0]);
@@ -70,221 +320,1180 @@ int parseArgs(int argc,
         return -1;
     }
 
+    if (options.congestionControl.empty()) {
+        options.congestionControl =
+                options.udp ? DEFAULT_UDP_CONGESTION_CONTROL : "fixed";
+    } else if (!options.udp && options.congestionControl != "fixed") {
+        // Only the receiving thread of a UDP receiver sends feedback
+        std::cerr << "Congestion controller " << options.congestionControl
+                  << " requires -u" << std::endl;
+        return -1;
+    }
+    if (options.txtime && !options.udp) {
+        std::cerr << "-T requires -u" << std::endl;
+        return -1;
+    }
+    if (options.batchSize == 0) {
+        options.batchSize =
+                options.udp && options.congestionControl != "fixed" ?
+                DEFAULT_UDP_BATCH_SIZE : DEFAULT_BATCH_SIZE;
+    }
+
     return 0;
 }
 
+/**
+ * Sends the handshake request describing the payload and how its segments
+ * are encoded.
+ */
+template<typename Socket>
+void sendHandshakeReq(Socket* socket,
+                      uint32_t connectionId,
+                      const std::vector<Segment>& segments,
+                      const Payload& payload)
+{
+    const RaptorQEncoder& first = *segments.front().encoder;
+    const RaptorQEncoder& last = *segments.back().encoder;
+    sendInWireFormat<WireFormat::HandshakeReq>(
+            socket,
+            connectionId, payload.name, payload.size, payload.numFiles,
+            SEGMENT_SIZE,
+            downCast<uint32_t>(segments.size()),
+            first.OTI_Common(), first.OTI_Scheme_Specific(),
+            last.OTI_Common(), last.OTI_Scheme_Specific());
+}
+
+void printHandshakeReq(uint32_t connectionId,
+                       const std::vector<Segment>& segments,
+                       const Payload& payload)
+{
+    const RaptorQEncoder& first = *segments.front().encoder;
+    const RaptorQEncoder& last = *segments.back().encoder;
+    printf("Handshake request: {connection id = %u, file name = %s, "
+           "file size = %lu, files = %u, segments = %zu, OTI_COMMON = %lu, "
+           "OTI_SCHEME_SPECIFIC = %u, last OTI_COMMON = %lu, "
+           "last OTI_SCHEME_SPECIFIC = %u}\n",
+           connectionId, payload.name, payload.size, payload.numFiles,
+           segments.size(),
+           first.OTI_Common(), first.OTI_Scheme_Specific(),
+           last.OTI_Common(), last.OTI_Scheme_Specific());
+}
+
 /**
  * Starts the handshake procedure with the receiver. This method needs to
  * handle retries automatically in the face of lost handshake request and/or
  * response.
  * TODO: implement retry strategy to counteract lost request/response.
  *
+ * \param[out] blockWindow
+ *      Number of blocks the receiver accepts symbols for at first.
  * \return
- *      A reference to a blocking DCCP socket if the handshake procedure
- *      succeeds; nullptr otherwise.
+ *      A blocking DCCP socket connected to the receiver if the handshake
+ *      procedure succeeds; nullptr otherwise.
  */
 std::unique_ptr<DCCPSocket>
-initiateHandshake(const RaptorQEncoder& encoder,
+initiateHandshake(const std::vector<Segment>& segments,
                   const std::string& host,
                   const std::string& port,
-                  const FileWrapper<Alignment>& file)
+                  uint32_t connectionId,
+                  const Payload& payload,
+                  uint32_t& blockWindow)
 {
-    DCCPSocket* socket = new DCCPSocket;
+    std::unique_ptr<DCCPSocket> socket {new DCCPSocket};
     socket->connect(Address(host, port));
 
     // Send handshake request
-    uint32_t connectionId = generateRandom();
-    sendInWireFormat<WireFormat::HandshakeReq>(
-            socket,
-            connectionId, file.name(), file.size(), 
-            encoder.OTI_Common(), encoder.OTI_Scheme_Specific());
-    printf("Sent handshake request: {connection id = %u, file name = %s, "
-           "file size = %zu, OTI_COMMON = %lu, OTI_SCHEME_SPECIFIC = %u}\n",
-           connectionId, file.name(), file.size(), encoder.OTI_Common(),
-           encoder.OTI_Scheme_Specific());
-
-    // Wait for handshake response
+    sendHandshakeReq(socket.get(), connectionId, segments, payload);
+    printf("Sent ");
+    printHandshakeReq(connectionId, segments, payload);
+
+    // Wait for handshake response; a receiver that refuses the request
+    // closes the connection instead
     std::unique_ptr<WireFormat::HandshakeResp> resp =
-            receive<WireFormat::HandshakeResp>(socket);
-    if (connectionId == resp->connectionId) {
-        printf("Received handshake response: {connection id = %u}\n",
-               resp->connectionId);
-        return std::unique_ptr<DCCPSocket>(socket);
+            receive<WireFormat::HandshakeResp>(socket.get());
+    if (resp && resp->header.opcode == WireFormat::HANDSHAKE_RESP &&
+            resp->connectionId == connectionId) {
+        blockWindow = resp->blockWindow;
+        printf("Received handshake response: {connection id = %u, "
+               "block window = %u}\n", connectionId, blockWindow);
+        return socket;
     }
 
     return nullptr;
 }
 
 /**
- * Send a single symbol to the given DCCP socket.
+ * Same as initiateHandshake() but over UDP, for when DCCP is not available.
+ * The request is retransmitted until a matching response arrives.
  *
- * \param[in]
- *      The DCCP socket.
- * \param[in,out] symbolIterator
- *      A symbol iterator referencing the symbol about to send; the position
- *      of the iterator will be advanced by one after this function is called.
+ * \return
+ *      A UDP socket connected to the receiver if the handshake procedure
+ *      succeeds; nullptr otherwise.
  */
-void sendSymbol(DCCPSocket *socket,
-                UDPSocket* udpSocket,
-                RaptorQSymbolIterator &symbolIterator,
-                uint32_t& repairSymbolInterval,
-                Bitmask256 &decodedBlocks,
-                progress_t &progress)
+std::unique_ptr<UDPSocket>
+initiateHandshakeOverUdp(const std::vector<Segment>& segments,
+                         const std::string& host,
+                         const std::string& port,
+                         uint32_t connectionId,
+                         const Payload& payload,
+                         uint32_t& blockWindow)
+{
+    std::unique_ptr<UDPSocket> socket {new UDPSocket};
+    socket->connect(Address(host, port));
+
+    printf("Sending ");
+    printHandshakeReq(connectionId, segments, payload);
+    for (int attempt = 0; attempt < HANDSHAKE_MAX_ATTEMPTS; attempt++) {
+        try {
+            sendHandshakeReq(socket.get(), connectionId, segments, payload);
+
+            struct pollfd ufds {socket->fd_num(), POLLIN, 0};
+            if (SystemCall("poll", poll(&ufds, 1, HANDSHAKE_TIMEOUT_MS)) == 0) {
+                continue;
+            }
+
+            // Wait for handshake response
+            std::unique_ptr<WireFormat::HandshakeResp> resp =
+                    receive<WireFormat::HandshakeResp>(socket.get());
+            if (resp && resp->header.opcode == WireFormat::HANDSHAKE_RESP &&
+                    resp->connectionId == connectionId) {
+                blockWindow = resp->blockWindow;
+                printf("Received handshake response: {connection id = %u, "
+                       "block window = %u}\n", connectionId, blockWindow);
+                return socket;
+            }
+        } catch (const unix_error& e) {
+            // The receiver is not listening yet (ECONNREFUSED)
+            usleep(HANDSHAKE_TIMEOUT_MS * 1000);
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * Size of the part of a DataPacket that precedes the symbol.
+ */
+#define DATA_PACKET_HEADER_SIZE offsetof(WireFormat::DataPacket, raw)
+
+/**
+ * A ring of DataPackets that is handed to the kernel in a single sendmmsg()
+ * call once it fills up. Each packet is gathered from two iovecs, its
+ * header and its symbol, so that no symbol is ever copied on its way to the
+ * kernel: source symbols are sent straight from the mmap'ed file, and
+ * repair symbols are generated in place.
+ */
+struct PacketBatch {
+
+    /**
+     * Raw storage of the packet headers; slot i holds the i-th DataPacket,
+     * of which only the header is used.
+     */
+    std::vector<char> slab;
+
+    /**
+     * Storage of the repair symbols; symbol i belongs to packet i.
+     */
+    std::vector<RaptorQSymbol> symbols;
+
+    /**
+     * Two iovecs per packet (header and symbol), passed to sendbatch() as
+     * is.
+     */
+    std::vector<iovec> iovecs;
+
+    /**
+     * Number of packets at the front of the batch that have already been
+     * accepted by the kernel.
+     */
+    size_t numSent;
+
+    /**
+     * Stamped on every packet.
+     */
+    uint32_t connectionId;
+
+    PacketBatch(size_t capacity, uint32_t connectionId)
+        : slab(capacity * sizeof(WireFormat::DataPacket))
+        , symbols(capacity)
+        , iovecs()
+        , numSent(0)
+        , connectionId(connectionId)
+    {
+        iovecs.reserve(2 * capacity);
+    }
+
+    size_t size() const
+    {
+        return iovecs.size() / 2;
+    }
+
+    bool full() const
+    {
+        return size() == symbols.size();
+    }
+
+    /**
+     * Queues the symbol referenced by the iterator, which belongs to the
+     * given segment, in the next free slot of the batch.
+     *
+     * \param data
+     *      The content of the symbol if it is readily available (e.g. a
+     *      source symbol in the file), which must stay valid until the
+     *      batch is sent; nullptr to generate the symbol into the batch.
+     */
+    void append(uint32_t segment, RaptorQSymbolIterator& symbolIterator,
+                const char* data)
+    {
+        size_t i = size();
+        if (!data) {
+            RaptorQSymbol& symbol = symbols[i];
+            auto begin = symbol.begin();
+            (*symbolIterator)(begin, symbol.end());
+            data = reinterpret_cast<const char*>(symbol.data());
+        }
+
+        char* slot = &slab[i * sizeof(WireFormat::DataPacket)];
+        new(slot) WireFormat::DataPacket(connectionId, segment,
+                                         (*symbolIterator).id());
+        iovecs.push_back({slot, DATA_PACKET_HEADER_SIZE});
+        iovecs.push_back({const_cast<char*>(data), SYMBOL_SIZE});
+    }
+
+    WireFormat::DataPacket* packet(size_t i) const
+    {
+        return reinterpret_cast<WireFormat::DataPacket*>(
+                iovecs[2 * i].iov_base);
+    }
+
+    void clear()
+    {
+        iovecs.clear();
+        numSent = 0;
+    }
+};
+
+/**
+ * State of an ongoing transmission, shared by the functions that send
+ * symbols and process ACKs.
+ */
+struct Transmission : public TransmissionState {
+
+    /**
+     * Socket the data packets are sent over in DCCP mode; nullptr in UDP
+     * mode.
+     */
+    DCCPSocket* dccpSocket;
+
+    /**
+     * Socket the ACKs are received from; in UDP mode, the data packets are
+     * sent over it as well.
+     */
+    UDPSocket* udpSocket;
+
+    /**
+     * Set by the sender in the handshake request; the receiver uses it to
+     * tell our packets apart from other senders'.
+     */
+    uint32_t connectionId;
+
+    PacketBatch batch;
+
+    progress_t progress;
+
+    /**
+     * Spaces out the data packets at the pacing rate.
+     */
+    Pacer pacer;
+
+    /**
+     * Upper bound on the pacing rate in bytes per second, or 0 for none.
+     */
+    uint64_t maxRate;
+
+    /**
+     * True if the kernel holds each packet until the departure time given
+     * by the pacer; the departure times of a batch are staged in txtimes.
+     */
+    bool txtime;
+    std::vector<uint64_t> txtimes;
+
+    /**
+     * No packets are sent before this time (in microseconds) after the
+     * DCCP socket has refused one.
+     */
+    uint64_t backoffUntil;
+
+    Transmission(DCCPSocket* dccpSocket,
+                 UDPSocket* udpSocket,
+                 uint32_t connectionId,
+                 size_t batchSize,
+                 std::unique_ptr<CongestionController> controller,
+                 size_t numBlocks,
+                 size_t blockWindow,
+                 uint64_t maxRate,
+                 bool txtime,
+                 uint32_t overhead)
+        : TransmissionState(std::move(controller), numBlocks, blockWindow,
+                            overhead, timestamp_us())
+        , dccpSocket(dccpSocket)
+        , udpSocket(udpSocket)
+        , connectionId(connectionId)
+        , batch(batchSize, connectionId)
+        , progress(numBlocks, DEBUG_F)
+        , pacer(PACER_BURST_INTERVAL_US, sizeof(WireFormat::DataPacket),
+                txtime ? TXTIME_LOOKAHEAD_US : 0)
+        , maxRate(maxRate)
+        , txtime(txtime)
+        , txtimes(batchSize)
+        , backoffUntil(0)
+    {}
+
+    /**
+     * Marks all blocks as decoded to stop the transmission, e.g. because
+     * the receiver has gone away.
+     */
+    void finish()
+    {
+        markAllDecoded();
+        progress.update(numDecoded);
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(Transmission)
+};
+
+/**
+ * Feeds the congestion feedback carried by an ACK to the congestion
+ * controller.
+ */
+void processFeedback(Transmission& tx,
+                     const WireFormat::CongestionFeedback& feedback)
+{
+    if (tx.onFeedback(feedback, timestamp_us())) {
+        rttUs.record(tx.rtt.latest());
+        queueingDelayUs.record(tx.rtt.queueingDelay());
+    }
+}
+
+/**
+ * Takes in the loss rate and the symbol counts carried by an extended ACK,
+ * unless the ACK is stale.
+ */
+void processLossReport(Transmission& tx,
+                       const WireFormat::ExtendedAck& extendedAck,
+                       size_t length)
+{
+    if (tx.onLossReport(extendedAck, length)) {
+        reportedLossRate.set(int64_t(tx.lossRate * 1e6));
+    }
+}
+
+/**
+ * Processes one datagram from the receiver, which is expected to be an ACK
+ * or an extended ACK.
+ */
+void processAck(Transmission& tx)
+{
+    UDPSocket::received_datagram datagram = {Address(), 0, nullptr, 0};
+    try {
+        datagram = tx.udpSocket->recv();
+    } catch (const unix_error& e) {
+        // Over UDP, the receiver exiting shows up as ECONNREFUSED
+    }
+    std::unique_ptr<char[]> payload(datagram.payload);
+    if (!payload) { // receiver has closed connection
+        tx.finish();
+        return;
+    }
+
+    const WireFormat::Ack* ack = nullptr;
+    WireFormat::Opcode opcode = WireFormat::getOpcode(payload.get());
+    size_t length = static_cast<size_t>(datagram.recvlen);
+    if (opcode == WireFormat::ACK && length == sizeof(WireFormat::Ack)) {
+        ack = reinterpret_cast<const WireFormat::Ack*>(payload.get());
+    } else if (opcode == WireFormat::EXTENDED_ACK &&
+               length >= offsetof(WireFormat::ExtendedAck, counts)) {
+        // The datagram stops where the counts do
+        const WireFormat::ExtendedAck* extendedAck =
+                reinterpret_cast<const WireFormat::ExtendedAck*>(
+                payload.get());
+        ack = &extendedAck->ack;
+        if (ack->connectionId == tx.connectionId) {
+            processLossReport(tx, *extendedAck, length);
+        }
+    }
+
+    if (ack && ack->connectionId == tx.connectionId) {
+        acksReceived.add();
+        size_t decodedBefore = tx.numDecoded;
+        tx.onAck(*ack);
+        if (DEBUG_F)
+            printf("Received ACK, count = %zu\n", tx.numDecoded);
+        processFeedback(tx, ack->feedback);
+        Tracer::record(Tracer::ACK_RECEIVED,
+                       downCast<uint32_t>(tx.numDecoded),
+                       ack->feedback.highestSeq);
+        if (tx.numDecoded != decodedBefore) {
+            tx.progress.update(tx.numDecoded);
+        }
+    }
+}
+
+/**
+ * Hands up to count packets from the batch to the kernel, stamping them
+ * with their sequence numbers and departure time first.
+ *
+ * \return
+ *      The number of packets sent, -1 if the socket buffer is full, or -2
+ *      if the connection is broken.
+ */
+int sendPackets(Transmission& tx, size_t count)
 {
-    static RaptorQSymbol symbol {0};
-    auto begin = symbol.begin();
-    (*symbolIterator)(begin, symbol.end());
+    PacketBatch& batch = tx.batch;
+    uint64_t now = timestamp_us();
+    for (size_t i = 0; i < count; i++) {
+        WireFormat::DataPacket* packet = batch.packet(batch.numSent + i);
+        packet->seq = tx.nextSeq + downCast<uint32_t>(i);
+        packet->sendTime = tx.pacer.reserve(sizeof(WireFormat::DataPacket),
+                                            now);
+        tx.txtimes[i] = packet->sendTime * 1000;
+    }
+
+    int rv;
+    if (tx.dccpSocket) {
+        rv = tx.dccpSocket->sendbatch(&batch.iovecs[2 * batch.numSent],
+                                      count, 2);
+    } else {
+        try {
+            size_t sent = tx.udpSocket->sendbatch(
+                    &batch.iovecs[2 * batch.numSent], count,
+                    tx.txtime ? tx.txtimes.data() : nullptr, 2);
+            rv = sent > 0 ? downCast<int>(sent) : -1;
+        } catch (const unix_error& e) {
+            rv = -2;
+        }
+    }
 
+    size_t sent = rv > 0 ? rv : 0;
+    sendCalls.add();
+    if (rv == -1) {
+        sendEagain.add();
+    }
+    packetsSent.add(sent);
+    bytesSent.add(sent * sizeof(WireFormat::DataPacket));
+    packetsPerSend.record(sent);
+    if (Tracer::active()) {
+        for (size_t i = 0; i < sent; i++) {
+            const WireFormat::DataPacket* packet =
+                    batch.packet(batch.numSent + i);
+            Tracer::record(Tracer::PACKET_SENT, packet->seq,
+                           uint64_t(packet->segment) << 32 | packet->id);
+        }
+    }
+    tx.pacer.onSent(sent * sizeof(WireFormat::DataPacket),
+                    count * sizeof(WireFormat::DataPacket), now);
+    tx.nextSeq += downCast<uint32_t>(sent);
+    return rv;
+}
+
+/**
+ * Hands all the packets in the batch to the data socket as fast as the
+ * congestion controller allows, processing ACKs from the receiver while
+ * waiting.
+ */
+void flushBatch(Transmission& tx)
+{
+    PacketBatch& batch = tx.batch;
+    int dataFd = tx.dccpSocket ? tx.dccpSocket->fd_num()
+                               : tx.udpSocket->fd_num();
     struct pollfd ufds[2];
-    ufds[0] = {udpSocket->fd_num(), POLLIN, 0};
-    ufds[1] = {socket->fd_num(), POLLOUT, 0};
-    while (1) {
+    ufds[0] = {tx.udpSocket->fd_num(), POLLIN, 0};
+    ufds[1] = {dataFd, 0, 0};
+    while (batch.numSent < batch.size() && !tx.finished()) {
+        uint64_t now = timestamp_us();
+        tx.checkTimeout(now);
+
+        uint64_t rate = tx.controller->pacingRate();
+        if (tx.maxRate > 0) {
+            rate = std::min(rate, tx.maxRate);
+        }
+        tx.pacer.setRate(rate, now);
+        pacingRate.set(int64_t(rate));
+
+        // Figure out how many packets we may send as the next micro-burst
+        // and how long to wait for them
+        uint32_t window = tx.controller->congestionWindow();
+        congestionWindow.set(window);
+        size_t count = 0;
+        uint64_t waitUs;
+        if (now < tx.backoffUntil) {
+            waitUs = tx.backoffUntil - now;
+        } else if (tx.inflight() >= window) {
+            waitUs = std::max<uint64_t>(1, tx.lastFeedbackTime +
+                    tx.retransmissionTimeout() - now);
+        } else {
+            count = std::min<size_t>(batch.size() - batch.numSent,
+                                     window - tx.inflight());
+            count = std::min(count, tx.pacer.burstSize() /
+                                    sizeof(WireFormat::DataPacket));
+            waitUs = tx.pacer.waitTime(count * sizeof(WireFormat::DataPacket),
+                                       now);
+        }
+        ufds[1].events = waitUs == 0 ? POLLOUT : 0;
         ufds[0].revents = ufds[1].revents = 0;
-        SystemCall("poll", poll(ufds, 2, -1));
-        if (ufds[0].revents & POLLIN) {
-            std::unique_ptr<WireFormat::Ack> ack =
-                    receive<WireFormat::Ack>(udpSocket);
-
-            if (!ack) { // receiver has closed connection
-                decodedBlocks.setFirstN(downCast<uint8_t>(progress.workSize));
-                progress.update(decodedBlocks.count());
-                break;
-            } else {
-                decodedBlocks.bitwiseOr(Bitmask256(ack->bitmask));
-                if (DEBUG_F)
-                    printf("Received ACK, count = %d\n", int(decodedBlocks.count()));
-                repairSymbolInterval = ack->repairSymbolInterval;
-                progress.update(decodedBlocks.count());
-            }
+        timespec timeout {static_cast<time_t>(waitUs / 1000000),
+                          static_cast<long>(waitUs % 1000000 * 1000)};
+        SystemCall("ppoll", ppoll(ufds, 2, waitUs == 0 ? NULL : &timeout,
+                                  NULL));
+        if (ufds[0].revents & (POLLIN | POLLERR)) {
+            processAck(tx);
         }
 
         if (ufds[1].revents & POLLOUT) {
-            int rv = sendInWireFormat<WireFormat::DataPacket>(
-                    socket, (*symbolIterator).id(), symbol.data());
+            int rv = sendPackets(tx, count);
             if (rv >= 0) {
                 if (DEBUG_F) {
-                    uint32_t pktId = (*symbolIterator).id(); 
-                    uint8_t sbn = downCast<uint8_t>(pktId >> 24);
-                    uint32_t esi = (pktId << 8) >> 8;
-                    printf("Sent sbn = %u, esi = %u\n", static_cast<uint32_t>(sbn), esi);
+                    for (int i = 0; i < rv; i++) {
+                        WireFormat::DataPacket* packet =
+                                batch.packet(batch.numSent + i);
+                        uint32_t pktId = packet->id;
+                        uint8_t sbn = downCast<uint8_t>(pktId >> 24);
+                        uint32_t esi = (pktId << 8) >> 8;
+                        printf("Sent segment = %u, sbn = %u, esi = %u\n",
+                               uint32_t(packet->segment),
+                               static_cast<uint32_t>(sbn), esi);
+                    }
                 }
 
-                ++symbolIterator;
-                usleep(350);
-                break;
+                batch.numSent += rv;
             } else if (rv == -1) {
-                usleep(350);
+                tx.backoffUntil = timestamp_us() + EAGAIN_BACKOFF_US;
                 if (DEBUG_F) 
-                    printf("sendInWireFormat: failed\n");
+                    printf("sendbatch: failed\n");
             } else {
-                decodedBlocks.setFirstN(downCast<uint8_t>(progress.workSize));
-                progress.update(decodedBlocks.count());
-                break;
+                tx.finish();
             }
         }
     }
+    batch.clear();
 }
 
-void transmit(RaptorQEncoder& encoder,
-              DCCPSocket* socket,
-              UDPSocket* udpSocket)
+/**
+ * Send a single symbol to the receiver. The symbol is queued in the batch
+ * and actually transmitted once the batch is full.
+ *
+ * \param[in,out] symbolIterator
+ *      A symbol iterator referencing the symbol about to send; the position
+ *      of the iterator will be advanced by one after this function is called.
+ * \param data
+ *      Where the symbol is in the file, or nullptr to generate it; see
+ *      PacketBatch::append().
+ */
+void sendSymbol(Transmission& tx,
+                uint32_t segment,
+                RaptorQSymbolIterator &symbolIterator,
+                const char* data = nullptr)
 {
-    // Initialize progress bar
-    progress_t progress {encoder.blocks(), DEBUG_F};
-    progress.show();
+    tx.batch.append(segment, symbolIterator, data);
+    ++symbolIterator;
+    if (tx.batch.full()) {
+        flushBatch(tx);
+    }
+}
 
-    // Set up repair symbol iterators of all blocks
-    std::vector<RaptorQSymbolIterator> repairSymbolIters;
-    for (const auto& block : encoder) {
-        repairSymbolIters.push_back(block.begin_repair());
-    }
-
-    // Represents blocks that are decoded by the receiver
-    Bitmask256 decodedBlocks;
-    uint32_t sourceSymbolCounter = 0;
-    uint32_t repairSymbolInterval = INIT_REPAIR_SYMBOL_INTERVAL;
-
-    for (uint8_t currBlock = 0; currBlock < encoder.blocks(); currBlock++) {
-        const auto &block = *encoder.begin().operator++(currBlock);
-        RaptorQSymbolIterator sourceSymbolIter = block.begin_source();
-        for (int esi = 0; esi < block.symbols(); esi++) {
-            // Send i-th source symbol of block sbn
-            sendSymbol(socket, udpSocket, sourceSymbolIter,
-                    repairSymbolInterval, decodedBlocks, progress);
-            sourceSymbolCounter++;
-
-            if (sourceSymbolCounter % repairSymbolInterval == 0) {
-                // Send repair symbols of previous blocks
-                for (uint8_t prevBlock = 0; prevBlock < currBlock; prevBlock++) {
-                    if (!decodedBlocks.test(prevBlock)) {
-                        sendSymbol(socket, udpSocket,
-                                repairSymbolIters[prevBlock],
-                                repairSymbolInterval, decodedBlocks, progress);
-                    }
-                }
+/**
+ * Computes the intermediate symbols of the blocks on a pool of threads, in
+ * the order the blocks are transmitted, and tells the transmission which
+ * blocks are ready. Source symbols are sent straight from the file, so only
+ * the repair symbols of a block have to wait for it. Precomputing a block
+ * is cubic in its number of symbols, so this also spreads the bulk of the
+ * encoding cost over all cores.
+ *
+ * With a RepairCache being filled in, the first repair symbols of each
+ * block are written to the cache as it is precomputed. With a complete
+ * one, blocks are only precomputed once they are requested, when the
+ * transmission runs out of their cached repair symbols.
+ */
+class PrecomputePool {
+  public:
+    PrecomputePool(std::vector<Segment>& segments, unsigned numThreads,
+                   RepairCache* cache)
+        : segments(segments)
+        , cache(cache)
+        , blockSegment()
+        , readyBlocks(segments.back().firstBlock +
+                      segments.back().encoder->blocks())
+        , requestedBlocks(readyBlocks.size())
+        , claimedBlocks(readyBlocks.size())
+        , mutex()
+        , requestsChanged()
+        , requests()
+        , nextBlock(cache && cache->complete() ? readyBlocks.size() : 0)
+        , stopping(false)
+        , threads()
+    {
+        for (uint32_t segment = 0; segment < segments.size(); segment++) {
+            blockSegment.insert(blockSegment.end(),
+                                segments[segment].encoder->blocks(), segment);
+        }
+        for (unsigned i = 0; i < numThreads; i++) {
+            threads.emplace_back(&PrecomputePool::precomputeLoop, this);
+        }
+    }
+
+    /**
+     * Waits for the blocks being precomputed, but does not start any other.
+     */
+    ~PrecomputePool()
+    {
+        {
+            Guard _(mutex);
+            stopping = true;
+        }
+        requestsChanged.notify_all();
+        for (auto& thread : threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+    /**
+     * Returns true if the repair symbols of a block, numbered across
+     * segments, can be generated without waiting; thread-safe.
+     */
+    bool ready(size_t block) const
+    {
+        return readyBlocks.test(block);
+    }
+
+    /**
+     * Has a block precomputed ahead of the others, if it has not been yet.
+     */
+    void request(size_t block)
+    {
+        if (requestedBlocks.test(block) || readyBlocks.test(block)) {
+            return;
+        }
+        requestedBlocks.set(block);
+        {
+            Guard _(mutex);
+            requests.push_back(block);
+        }
+        requestsChanged.notify_one();
+    }
+
+    /**
+     * Waits until all the blocks are precomputed, e.g. to finish filling in
+     * the cache after the transmission; not with a complete cache, whose
+     * blocks are only precomputed on request.
+     */
+    void finish()
+    {
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+  private:
+    void precomputeLoop()
+    {
+        Tracer::nameThread("precompute");
+        size_t block;
+        while (nextTask(block)) {
+            Tracer::record(Tracer::PRECOMPUTE_START, 0, block);
+            if (cache && !cache->complete()) {
+                cacheBlock(block);
+            } else {
+                precomputeBlock(block);
             }
+            Tracer::record(Tracer::PRECOMPUTE_END, 0, block);
+            readyBlocks.set(block);
+            if (DEBUG_F)
+                printf("Block %zu precomputed.\n", block);
         }
     }
 
-    while (decodedBlocks.count() < encoder.blocks()) {
-        // Send repair symbols for in round-robin
-        for (uint8_t sbn = 0; sbn < encoder.blocks(); sbn++) {
-            if (!decodedBlocks.test(sbn)) {
-                sendSymbol(socket, udpSocket, repairSymbolIters[sbn],
-                        repairSymbolInterval, decodedBlocks, progress);
+    /**
+     * Picks the next block to precompute: the oldest request, or else the
+     * next block in order, skipping those done already. With a complete
+     * cache, waits for requests until the pool is stopped.
+     *
+     * \return
+     *      False if there is nothing left to do.
+     */
+    bool nextTask(size_t& block)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (!requests.empty()) {
+                block = requests.front();
+                requests.pop_front();
+            } else if (nextBlock < blockSegment.size()) {
+                block = nextBlock++;
+            } else if (cache && cache->complete()) {
+                requestsChanged.wait(lock);
+                continue;
+            } else {
+                return false;
             }
+            if (!claimedBlocks.test(block)) {
+                claimedBlocks.set(block);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Computes the intermediate symbols of a block. The encoder has no call
+     * for a single block, but computes them on the first repair symbol.
+     */
+    void precomputeBlock(size_t block)
+    {
+        const Segment& segment = segments[blockSegment[block]];
+        uint8_t sbn = downCast<uint8_t>(block - segment.firstBlock);
+        RaptorQSymbol symbol;
+        Alignment* begin = symbol.data();
+        segment.encoder->encode(begin, symbol.data() + symbol.size(),
+                                segment.encoder->symbols(sbn), sbn);
+    }
+
+    /**
+     * Same as precomputeBlock(), but generates all the repair symbols of
+     * the block the cache keeps, right into the cache.
+     */
+    void cacheBlock(size_t block)
+    {
+        const Segment& segment = segments[blockSegment[block]];
+        uint8_t sbn = downCast<uint8_t>(block - segment.firstBlock);
+        uint32_t numSymbols = segment.encoder->symbols(sbn);
+        for (uint32_t i = 0; i < cache->numRepairs(block); i++) {
+            Alignment* begin = cache->slot(block, i);
+            segment.encoder->encode(begin, begin + NUM_ALIGN_PER_SYMBOL,
+                                    numSymbols + i, sbn);
         }
+        cache->fill(block);
+    }
+
+    std::vector<Segment>& segments;
+
+    RepairCache* cache;
+
+    /**
+     * Segment of each block, numbered across segments.
+     */
+    std::vector<uint32_t> blockSegment;
+
+    Bitmask readyBlocks;
+    Bitmask requestedBlocks;
+
+    /**
+     * Blocks taken up by a thread, so that a block requested ahead of its
+     * turn is not precomputed again.
+     */
+    Bitmask claimedBlocks;
+
+    /**
+     * Protects everything below but the threads.
+     */
+    std::mutex mutex;
+    std::condition_variable requestsChanged;
+
+    /**
+     * Blocks requested but not precomputed yet, oldest first.
+     */
+    std::deque<size_t> requests;
+
+    /**
+     * Index of the next block to precompute in order.
+     */
+    size_t nextBlock;
+
+    bool stopping;
+
+    std::vector<std::thread> threads;
+
+    DISALLOW_COPY_AND_ASSIGN(PrecomputePool)
+};
+
+/**
+ * Sends what is left in the batch, then processes ACKs for a while; for
+ * when no symbol is worth sending until more blocks are precomputed or the
+ * receiver's window moves on.
+ */
+void waitForSendableBlocks(Transmission& tx)
+{
+    flushBatch(tx);
+    struct pollfd ufd = {tx.udpSocket->fd_num(), POLLIN, 0};
+    if (SystemCall("poll", poll(&ufd, 1, PRECOMPUTE_POLL_MS)) > 0) {
+        processAck(tx);
     }
+    tx.checkTimeout(timestamp_us());
 }
 
 /**
- * Instantiates a RaptorQ encoder with an (near) optimal setting.
+ * Sends the symbols of the blocks in the order the Scheduler decides, until
+ * the receiver has decoded them all.
  */
-std::unique_ptr<RaptorQEncoder> getEncoder(FileWrapper<Alignment>& file)
+void transmit(std::vector<Segment>& segments,
+              PrecomputePool& precomputePool,
+              const RepairCache* cache,
+              Transmission& tx)
 {
-    int numOfSymbolsPerBlock = 64;
-    while (numOfSymbolsPerBlock <= 1024) {
-        std::unique_ptr<RaptorQEncoder> encoder {
-                new RaptorQEncoder(file.begin(),
-                                   file.end(),
-                                   SYMBOL_SIZE, /* no interleaving */
-                                   SYMBOL_SIZE,
-                                   numOfSymbolsPerBlock * SYMBOL_SIZE)
-        };
-        if (*encoder) {
-            return encoder;
+    // Initialize progress bar
+    tx.progress.show();
+
+    // Set up the symbol iterators of all blocks, numbered across segments.
+    // Source symbols are sent from the file, except for a last one that is
+    // padded past the end of the segment.
+    std::vector<RaptorQSymbolIterator> sourceSymbolIters;
+    std::vector<RaptorQSymbolIterator> repairSymbolIters;
+    std::vector<uint32_t> blockSegment;
+    std::vector<uint32_t> blockSymbols;
+    std::vector<const char*> blockData;
+    for (uint32_t segment = 0; segment < segments.size(); segment++) {
+        const char* data =
+                reinterpret_cast<const char*>(segments[segment].begin);
+        for (const auto& block : *segments[segment].encoder) {
+            sourceSymbolIters.push_back(block.begin_source());
+            repairSymbolIters.push_back(block.begin_repair());
+            blockSegment.push_back(segment);
+            blockSymbols.push_back(block.symbols());
+            blockData.push_back(data);
+            data += block.block_size();
         }
-        numOfSymbolsPerBlock += 64;
     }
-    printf("Unable to instantiate a RaptorQ encoder.\n");
-    exit(EXIT_FAILURE);
+
+    // Repair symbols are sent from the cache, if any, until a block runs
+    // out of them; blocks of a complete cache are precomputed only then
+    std::vector<uint32_t> repairsSent(blockSymbols.size(), 0);
+    auto cached = [&](size_t block) {
+        return cache && repairsSent[block] < cache->numAvailable(block);
+    };
+    Scheduler scheduler(tx, std::move(blockSymbols),
+                        [&](size_t block) {
+                            if (precomputePool.ready(block) ||
+                                    cached(block)) {
+                                return true;
+                            }
+                            if (cache && cache->complete()) {
+                                precomputePool.request(block);
+                            }
+                            return false;
+                        },
+                        tx.dccpSocket == nullptr);
+    while (1) {
+        Scheduler::Decision decision = scheduler.next(
+                timestamp_us(),
+                tx.nextSeq + downCast<uint32_t>(tx.batch.size()));
+        size_t block = decision.block;
+        if (decision.action == Scheduler::DONE) {
+            break;
+        } else if (decision.action == Scheduler::WAIT) {
+            waitForSendableBlocks(tx);
+        } else if (decision.action == Scheduler::SOURCE) {
+            const char* data = blockData[block] + decision.esi * SYMBOL_SIZE;
+            const char* segmentEnd = reinterpret_cast<const char*>(
+                    segments[blockSegment[block]].end);
+            sourceSymbols.add();
+            sendSymbol(tx, blockSegment[block], sourceSymbolIters[block],
+                       data + SYMBOL_SIZE <= segmentEnd ? data : nullptr);
+        } else {
+            repairSymbols.add();
+            const char* data = cached(block) ?
+                    cache->symbol(block, repairsSent[block]) : nullptr;
+            repairsSent[block]++;
+            sendSymbol(tx, blockSegment[block], repairSymbolIters[block],
+                       data);
+        }
+    }
+
+    printf("Pacing rate: target %.1f Mbit/s, achieved %.1f Mbit/s\n",
+           static_cast<double>(tx.pacer.averageTargetRate()) * 8 / 1e6,
+           static_cast<double>(tx.pacer.achievedRate()) * 8 / 1e6);
+    if (tx.rtt.hasSamples()) {
+        printf("RTT: min %.2f ms, smoothed %.2f ms; queueing delay: "
+               "max %.2f ms; receiver ACK delay: average %.3f ms\n",
+               static_cast<double>(tx.rtt.minimum()) / 1e3,
+               static_cast<double>(tx.rtt.smoothed()) / 1e3,
+               static_cast<double>(tx.rtt.maxQueueingDelay()) / 1e3,
+               static_cast<double>(tx.rtt.averageAckDelay()) / 1e3);
+    }
+}
+
+/**
+ * Once the transmission is over, finishes filling in a new repair symbol
+ * cache for the next send of the payload.
+ */
+void completeCache(PrecomputePool& precomputePool, RepairCache* cache)
+{
+    if (!cache || cache->complete()) {
+        return;
+    }
+    printf("Filling in the repair symbol cache\n");
+    precomputePool.finish();
+    if (cache->commit()) {
+        printf("Repair symbols cached\n");
+    }
+}
+
+/**
+ * Instantiates a RaptorQ encoder for the data in [begin, end) with
+ * makeEncoder(), or exits if there is none.
+ */
+std::unique_ptr<RaptorQEncoder> getEncoder(Alignment* begin, Alignment* end,
+                                           uint32_t symbolsPerBlock)
+{
+    std::unique_ptr<RaptorQEncoder> encoder =
+            makeEncoder(begin, end, symbolsPerBlock);
+    if (!encoder) {
+        printf("Unable to instantiate a RaptorQ encoder.\n");
+        exit(EXIT_FAILURE);
+    }
+    return encoder;
+}
+
+/**
+ * Splits a file into segments of SEGMENT_SIZE bytes (the last one may be
+ * shorter).
+ */
+std::vector<std::pair<Alignment*, Alignment*>>
+splitFile(FileWrapper<Alignment>& file)
+{
+    const uint64_t alignmentsPerSegment = SEGMENT_SIZE / ALIGNMENT_SIZE;
+    std::vector<std::pair<Alignment*, Alignment*>> data;
+    Alignment* begin = file.begin();
+    do {
+        Alignment* end = file.end() - begin > int64_t(alignmentsPerSegment) ?
+                begin + alignmentsPerSegment : file.end();
+        data.emplace_back(begin, end);
+        begin = end;
+    } while (begin < file.end());
+    return data;
+}
+
+/**
+ * Instantiates an encoder for the data of each segment, with blocks of at
+ * most symbolsPerBlock symbols.
+ */
+std::vector<Segment>
+getSegments(const std::vector<std::pair<Alignment*, Alignment*>>& data,
+            uint32_t symbolsPerBlock)
+{
+    std::vector<Segment> segments;
+    size_t firstBlock = 0;
+    for (const auto& range : data) {
+        segments.push_back({getEncoder(range.first, range.second,
+                                       symbolsPerBlock),
+                            firstBlock, range.first, range.second});
+        firstBlock += segments.back().encoder->blocks();
+    }
+    return segments;
+}
+
+/**
+ * Returns the key of the repair symbol cache of a payload: the name, path,
+ * size, modification time and status change time of each of its files
+ * (the contents themselves are not hashed), then the encoding parameters
+ * of the segments. The modification time can be set back, e.g. by a copy
+ * that preserves it, but the change time cannot, so a file rewritten in
+ * place never matches the cache of its former contents.
+ */
+std::string
+cacheKey(const Payload& payload,
+         const std::vector<SessionFile>& files,
+         const std::vector<Segment>& segments)
+{
+    std::ostringstream key;
+    key << payload.name << '\n';
+    for (const SessionFile& file : files) {
+        struct stat statBuf;
+        std::memset(&statBuf, 0, sizeof(statBuf));
+        stat(file.path.c_str(), &statBuf);
+        char* path = realpath(file.path.c_str(), NULL);
+        key << file.name << '\t' << (path ? path : file.path) << '\t'
+            << statBuf.st_dev << ':' << statBuf.st_ino << '\t'
+            << statBuf.st_size << '\t' << statBuf.st_mtim.tv_sec << '.'
+            << statBuf.st_mtim.tv_nsec << '\t' << statBuf.st_ctim.tv_sec
+            << '.' << statBuf.st_ctim.tv_nsec << '\n';
+        free(path);
+    }
+    const RaptorQEncoder& first = *segments.front().encoder;
+    const RaptorQEncoder& last = *segments.back().encoder;
+    key << SEGMENT_SIZE << ' ' << segments.size() << ' '
+        << first.OTI_Common() << ' ' << first.OTI_Scheme_Specific() << ' '
+        << last.OTI_Common() << ' ' << last.OTI_Scheme_Specific() << '\n';
+    return key.str();
+}
+
+/**
+ * Returns the name of a session sent from a directory or a file list: the
+ * last component of the path, without the extension of a list.
+ */
+std::string sessionName(const std::string& path, bool fileList)
+{
+    std::string name = path.substr(0, path.find_last_not_of('/') + 1);
+    name = name.substr(name.find_last_of('/') + 1);
+    if (fileList && name.find('.') != std::string::npos &&
+            name.find('.') > 0) {
+        name = name.substr(0, name.find_last_of('.'));
+    }
+    return name;
 }
 
 int main(int argc, char *argv[])
 {
-    std::string host, port;
-    char *filename;
+    Options options;
 
-    if (parseArgs(argc, argv, host, port, filename) == -1)
+    if (parseArgs(argc, argv, options) == -1)
         return EXIT_FAILURE;
 
 //    DEBUG_F = 1;
-    // Read the file to transfer
-    FileWrapper<Alignment> file {filename};
+    std::unique_ptr<Metrics::Exporter> metrics;
+    if (!options.metricsFile.empty()) {
+        metrics.reset(new Metrics::Exporter(options.metricsFile, "sender",
+                                            METRICS_INTERVAL_MS));
+        if (!metrics->ok()) {
+            return EXIT_FAILURE;
+        }
+    }
+    std::unique_ptr<Tracer::Writer> trace;
+    if (!options.traceFile.empty()) {
+        trace.reset(new Tracer::Writer(options.traceFile, "sender"));
+        if (!trace->ok()) {
+            return EXIT_FAILURE;
+        }
+        Tracer::nameThread("sender");
+    }
+
+    // Read the file to transfer, or the files of a session
+    std::unique_ptr<FileWrapper<Alignment>> file;
+    std::unique_ptr<SessionStream> session;
+    std::vector<std::pair<Alignment*, Alignment*>> segmentData;
+    std::vector<SessionFile> sources;
+    Payload payload;
+    struct stat statBuf;
+    if (options.fileList || (stat(options.filename.c_str(), &statBuf) == 0 &&
+                             S_ISDIR(statBuf.st_mode))) {
+        std::vector<SessionFile> files;
+        if (!(options.fileList ? readFileList(options.filename, files)
+                               : listDirectory(options.filename, files)) ||
+                files.empty()) {
+            printf("No files to send in %s\n", options.filename.c_str());
+            return EXIT_FAILURE;
+        }
+        sources = files;
+        session.reset(new SessionStream(
+                sessionName(options.filename, options.fileList),
+                std::move(files)));
+        segmentData = session->segments();
+        payload = {session->name(), session->size(), session->numFiles()};
+    } else {
+        file.reset(new FileWrapper<Alignment>(options.filename));
+        segmentData = splitFile(*file);
+        payload = {file->name(), file->size(), 0};
+        sources.push_back({file->name(), options.filename, file->size(), 0});
+    }
     printf("Done reading file\n");
 
     // Setup parameters of the RaptorQ protocol
-    std::unique_ptr<RaptorQEncoder> encoder = getEncoder(file);
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    uint64_t dataSize = 0;
+    for (const auto& range : segmentData) {
+        dataSize += (range.second - range.first) * ALIGNMENT_SIZE;
+    }
+    EncoderPlanner::Plan plan =
+            EncoderPlanner(cores, options.receiverMemory, options.maxRate,
+                           options.overhead).plan(dataSize);
+    printf("Encoding plan: %u symbols per block, %zu blocks; predicted "
+           "precomputation %.1f ms, decoding %.1f ms\n",
+           plan.symbolsPerBlock, plan.numBlocks, plan.precomputeUs / 1e3,
+           plan.decodeUs / 1e3);
+    std::vector<Segment> segments =
+            getSegments(segmentData, plan.symbolsPerBlock);
+    size_t numBlocks = segments.back().firstBlock +
+                       segments.back().encoder->blocks();
+
+    // Send the repair symbols of a previous send of the same payload, or
+    // keep those of this one for the next
+    std::unique_ptr<RepairCache> cache;
+    if (!options.cacheDirectory.empty()) {
+        std::vector<uint32_t> blockSymbols;
+        for (const Segment& segment : segments) {
+            for (uint8_t sbn = 0; sbn < segment.encoder->blocks(); sbn++) {
+                blockSymbols.push_back(segment.encoder->symbols(sbn));
+            }
+        }
+        cache.reset(new RepairCache(options.cacheDirectory,
+                                    cacheKey(payload, sources, segments),
+                                    blockSymbols));
+        if (!cache->ok()) {
+            printf("Unable to open the repair symbol cache in %s\n",
+                   options.cacheDirectory.c_str());
+            cache.reset();
+        } else if (cache->complete()) {
+            printf("Sending repair symbols from the cache\n");
+        }
+    }
+
+    // Precompute intermediate symbols in background while the source
+    // symbols are sent
+    PrecomputePool precomputePool {segments, cores, cache.get()};
+
+    std::unique_ptr<CongestionController> controller =
+            makeCongestionController(options.congestionControl,
+                    sizeof(WireFormat::DataPacket),
+                    options.maxRate > 0 ? options.maxRate :
+                    options.batchSize * sizeof(WireFormat::DataPacket) *
+                    1000000 / FIXED_BATCH_INTERVAL_US);
+    if (!controller) {
+        printf("Unknown congestion controller %s\n",
+               options.congestionControl.c_str());
+        return EXIT_FAILURE;
+    }
 
-    // Precompute intermediate symbols in background
-    encoder->precompute(0, true);
+    // Wake up from ppoll() as close as possible to the pacing deadlines
+    // rather than within the default 50us timer slack
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    uint32_t connectionId = generateRandom();
+    uint32_t blockWindow;
+    if (options.udp) {
+        // Initiate handshake process; data and ACKs share the socket
+        std::unique_ptr<UDPSocket> socket = initiateHandshakeOverUdp(
+                segments, options.host, options.port, connectionId, payload,
+                blockWindow);
+        if (!socket) {
+            printf("Handshake failure!\n");
+            return EXIT_FAILURE;
+        }
+        if (options.txtime && !socket->set_txtime()) {
+            printf("SO_TXTIME is not supported; pacing in user space\n");
+            options.txtime = false;
+        }
+        if (!socket->set_gso_segment(sizeof(WireFormat::DataPacket))) {
+            printf("UDP GSO is not supported; "
+                   "sending one datagram per packet\n");
+        }
+
+        // Start transmission
+        Transmission tx {nullptr, socket.get(), connectionId,
+                         options.batchSize, std::move(controller), numBlocks,
+                         blockWindow, options.maxRate, options.txtime,
+                         options.overhead};
+        transmit(segments, precomputePool, cache.get(), tx);
+        completeCache(precomputePool, cache.get());
+        return EXIT_SUCCESS;
+    }
 
     // Initiate handshake process
     std::unique_ptr<DCCPSocket> socket = initiateHandshake(
-            *encoder, host, port, file);
+            segments, options.host, options.port, connectionId, payload,
+            blockWindow);
     if (!socket) {
         printf("Handshake failure!\n");
-        return EXIT_SUCCESS;
+        return EXIT_FAILURE;
     }
 
     // UDPSocket for receiving ACK
@@ -293,7 +1502,11 @@ int main(int argc, char *argv[])
     udpSocket.bind(Address("0", 6331));
 
     // Start transmission
-    transmit(*encoder, socket.get(), &udpSocket);
+    Transmission tx {socket.get(), &udpSocket, connectionId,
+                     options.batchSize, std::move(controller), numBlocks,
+                     blockWindow, options.maxRate, false, options.overhead};
+    transmit(segments, precomputePool, cache.get(), tx);
+    completeCache(precomputePool, cache.get());
 
     return EXIT_SUCCESS;
 }
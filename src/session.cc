@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <unistd.h>
+
+#include "session.hh"
+#include "util.hh"
+#include "wire_format.hh"
+
+/**
+ * Rounds n up to a multiple of the given number.
+ */
+static uint64_t
+roundUp(uint64_t n, uint64_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+bool
+isValidName(const std::string& name)
+{
+    if (name.empty() || name[0] == '/') {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= name.size()) {
+        size_t end = std::min(name.find('/', start), name.size());
+        if (name.compare(start, end - start, "..") == 0 && end - start == 2) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+/**
+ * Reads exactly length bytes at the given offset of a file.
+ */
+static void
+readFully(int fd, char* buffer, size_t length, uint64_t offset)
+{
+    while (length > 0) {
+        ssize_t n = SystemCall("pread", pread(fd, buffer, length, offset));
+        if (n == 0) {
+            throw std::runtime_error("file shrank while being sent");
+        }
+        buffer += n;
+        length -= n;
+        offset += n;
+    }
+}
+
+SessionStream::SessionStream(const std::string& name,
+                             std::vector<SessionFile> files)
+    : sessionName(name)
+    , files(std::move(files))
+    , manifest()
+    , streamSize(0)
+    , mappings()
+    , buffers()
+{
+    // Serialize the manifest, leaving the offsets for later
+    size_t namesSize = 0;
+    for (const SessionFile& file : this->files) {
+        namesSize += file.name.size();
+    }
+    size_t manifestSize = sizeof(WireFormat::ManifestHeader) +
+                          this->files.size() * sizeof(WireFormat::ManifestEntry) +
+                          namesSize;
+
+    // Large files start on a segment boundary if the small ones, largest
+    // first, can fill the gaps before them; otherwise they start right
+    // away rather than leave the gap empty
+    std::vector<SessionFile*> small;
+    std::vector<SessionFile*> large;
+    for (SessionFile& file : this->files) {
+        (file.size >= SEGMENT_SIZE ? large : small).push_back(&file);
+    }
+    std::stable_sort(small.begin(), small.end(),
+            [](const SessionFile* a, const SessionFile* b) {
+                return a->size > b->size;
+            });
+
+    uint64_t cursor = roundUp(manifestSize, ALIGNMENT_SIZE);
+    for (SessionFile* file : large) {
+        uint64_t start = roundUp(cursor, SEGMENT_SIZE);
+        auto fits = [&](SessionFile* smallFile) {
+            uint64_t end = roundUp(cursor + smallFile->size, ALIGNMENT_SIZE);
+            if (end > start) {
+                return false;
+            }
+            smallFile->offset = cursor;
+            cursor = end;
+            return true;
+        };
+        small.erase(std::remove_if(small.begin(), small.end(), fits),
+                    small.end());
+        file->offset = cursor;
+        cursor = roundUp(cursor + file->size, ALIGNMENT_SIZE);
+    }
+    for (SessionFile* file : small) {
+        file->offset = cursor;
+        cursor = roundUp(cursor + file->size, ALIGNMENT_SIZE);
+    }
+    streamSize = cursor;
+
+    manifest.resize(manifestSize);
+    char* out = manifest.data();
+    WireFormat::ManifestHeader header {numFiles(), namesSize};
+    std::memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    for (const SessionFile& file : this->files) {
+        WireFormat::ManifestEntry entry {file.offset, file.size,
+                downCast<uint16_t>(file.name.size())};
+        std::memcpy(out, &entry, sizeof(entry));
+        out += sizeof(entry);
+    }
+    for (const SessionFile& file : this->files) {
+        out = std::copy(file.name.begin(), file.name.end(), out);
+    }
+}
+
+SessionStream::~SessionStream()
+{
+    for (auto& mapping : mappings) {
+        munmap(mapping.first, mapping.second);
+    }
+}
+
+std::vector<std::pair<Alignment*, Alignment*>>
+SessionStream::segments()
+{
+    std::vector<const SessionFile*> byOffset;
+    for (const SessionFile& file : files) {
+        byOffset.push_back(&file);
+    }
+    std::sort(byOffset.begin(), byOffset.end(),
+            [](const SessionFile* a, const SessionFile* b) {
+                return a->offset < b->offset;
+            });
+
+    std::vector<std::pair<Alignment*, Alignment*>> result;
+    size_t next = 0;
+    const SessionFile* mappedFile = nullptr;
+    for (uint64_t start = 0; start < streamSize; start += SEGMENT_SIZE) {
+        uint64_t end = std::min(start + SEGMENT_SIZE, streamSize);
+        while (next < byOffset.size() &&
+                (byOffset[next]->offset + byOffset[next]->size <= start ||
+                 byOffset[next]->size == 0)) {
+            next++;
+        }
+
+        // A segment within a single file is encoded from the file itself
+        const SessionFile* file = next < byOffset.size() ? byOffset[next]
+                                                         : nullptr;
+        if (file && file->offset <= start &&
+                file->offset + file->size >= end) {
+            if (file != mappedFile) {
+                int fd = SystemCall("open " + file->path,
+                                    open(file->path.c_str(), O_RDONLY));
+                void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+                                  fd, 0);
+                close(fd);
+                if (data == MAP_FAILED) {
+                    throw unix_error("mmap " + file->path);
+                }
+                mappings.emplace_back(data, file->size);
+                mappedFile = file;
+            }
+            char* data = static_cast<char*>(mappings.back().first) +
+                         (start - file->offset);
+            result.emplace_back(reinterpret_cast<Alignment*>(data),
+                    reinterpret_cast<Alignment*>(data + (end - start)));
+            continue;
+        }
+
+        // Others are assembled in memory
+        buffers.emplace_back(new Alignment[(end - start) / ALIGNMENT_SIZE]());
+        char* buffer = reinterpret_cast<char*>(buffers.back().get());
+        if (start < manifest.size()) {
+            std::memcpy(buffer, manifest.data() + start,
+                        std::min<uint64_t>(manifest.size() - start,
+                                           end - start));
+        }
+        for (size_t i = next; i < byOffset.size() &&
+                byOffset[i]->offset < end; i++) {
+            const SessionFile* piece = byOffset[i];
+            uint64_t from = std::max(start, piece->offset);
+            uint64_t to = std::min(end, piece->offset + piece->size);
+            if (from >= to) {
+                continue;
+            }
+            int fd = SystemCall("open " + piece->path,
+                                open(piece->path.c_str(), O_RDONLY));
+            readFully(fd, buffer + (from - start), to - from,
+                      from - piece->offset);
+            close(fd);
+        }
+        result.emplace_back(buffers.back().get(), buffers.back().get() +
+                            (end - start) / ALIGNMENT_SIZE);
+    }
+    return result;
+}
+
+/**
+ * Adds the regular files under directory/prefix to the list, naming them
+ * after their path relative to directory.
+ */
+static bool
+listDirectory(const std::string& directory, const std::string& prefix,
+              std::vector<SessionFile>& files)
+{
+    DIR* dir = opendir((directory + "/" + prefix).c_str());
+    if (!dir) {
+        return false;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 &&
+                strcmp(entry->d_name, "..") != 0) {
+            names.push_back(prefix + entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    for (const std::string& name : names) {
+        std::string path = directory + "/" + name;
+        struct stat statBuf;
+        if (lstat(path.c_str(), &statBuf) != 0) {
+            return false;
+        }
+        if (S_ISDIR(statBuf.st_mode)) {
+            if (!listDirectory(directory, name + "/", files)) {
+                return false;
+            }
+        } else if (S_ISREG(statBuf.st_mode)) {
+            files.push_back({name, path, uint64_t(statBuf.st_size), 0});
+        }
+    }
+    return true;
+}
+
+bool
+listDirectory(const std::string& directory, std::vector<SessionFile>& files)
+{
+    return listDirectory(directory, "", files);
+}
+
+bool
+readFileList(const std::string& listFile, std::vector<SessionFile>& files)
+{
+    std::ifstream list(listFile);
+    if (!list) {
+        return false;
+    }
+    size_t slash = listFile.find_last_of('/');
+    std::string directory = slash == std::string::npos
+            ? "." : listFile.substr(0, slash);
+
+    std::string name;
+    while (std::getline(list, name)) {
+        if (name.empty()) {
+            continue;
+        }
+        std::string path = directory + "/" + name;
+        struct stat statBuf;
+        if (!isValidName(name) || stat(path.c_str(), &statBuf) != 0 ||
+                !S_ISREG(statBuf.st_mode)) {
+            printf("Cannot send %s\n", name.c_str());
+            return false;
+        }
+        files.push_back({name, path, uint64_t(statBuf.st_size), 0});
+    }
+    return true;
+}
+
+/**
+ * Creates the directories leading to a file, as needed.
+ */
+static void
+makeParentDirectories(const std::string& path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos;
+            slash = path.find('/', slash + 1)) {
+        if (mkdir(path.substr(0, slash).c_str(), 0700) != 0 &&
+                errno != EEXIST) {
+            throw unix_error("mkdir " + path.substr(0, slash));
+        }
+    }
+}
+
+/**
+ * Copies length bytes at the given offset of the stream to a new file.
+ * copy_file_range() lets the kernel (or the file system) do the copy; it
+ * falls back to writing from the mapped stream.
+ */
+static void
+copyToFile(int streamFd, const char* stream, uint64_t offset,
+           uint64_t length, int fd)
+{
+    loff_t in = offset;
+    while (length > 0) {
+        ssize_t n = copy_file_range(streamFd, &in, fd, NULL, length, 0);
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+                      errno == EINVAL)) {
+            break;
+        }
+        if (SystemCall("copy_file_range", n) == 0) {
+            throw std::runtime_error("stream shorter than the manifest says");
+        }
+        length -= n;
+    }
+    while (length > 0) {
+        ssize_t n = SystemCall("write", write(fd, stream + in, length));
+        in += n;
+        length -= n;
+    }
+}
+
+bool
+extractSession(const char* directory,
+               int streamFd,
+               const char* stream,
+               uint64_t streamSize)
+{
+    WireFormat::ManifestHeader header;
+    if (streamSize < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, stream, sizeof(header));
+    uint64_t entriesEnd = sizeof(header) +
+            uint64_t(header.numFiles) * sizeof(WireFormat::ManifestEntry);
+    if (entriesEnd > streamSize || header.namesSize > streamSize - entriesEnd) {
+        return false;
+    }
+
+    if (mkdir(directory, 0700) != 0 && errno != EEXIST) {
+        printf("mkdir %s: %s\n", directory, strerror(errno));
+        return false;
+    }
+
+    const char* names = stream + entriesEnd;
+    uint64_t namesLeft = header.namesSize;
+    for (uint32_t i = 0; i < header.numFiles; i++) {
+        WireFormat::ManifestEntry entry;
+        std::memcpy(&entry, stream + sizeof(header) + i * sizeof(entry),
+                    sizeof(entry));
+        if (entry.nameLength > namesLeft || entry.offset > streamSize ||
+                entry.size > streamSize - entry.offset) {
+            return false;
+        }
+        std::string name(names, entry.nameLength);
+        names += entry.nameLength;
+        namesLeft -= entry.nameLength;
+        if (!isValidName(name)) {
+            printf("Refusing to write %s\n", name.c_str());
+            return false;
+        }
+
+        std::string path = std::string(directory) + "/" + name;
+        try {
+            makeParentDirectories(path);
+            int fd = SystemCall("open " + path,
+                    open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600));
+            copyToFile(streamFd, stream, entry.offset, entry.size, fd);
+            SystemCall("close", close(fd));
+        } catch (const std::exception& e) {
+            printf("%s\n", e.what());
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,139 @@
+#ifndef SESSION_HH
+#define SESSION_HH
+
+#include <cassert>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <RaptorQ.hpp>
+
+#include "common.hh"
+
+/**
+ * A file transferred as part of a session.
+ */
+struct SessionFile {
+    /**
+     * Path of the file relative to the directory of the session.
+     */
+    std::string name;
+
+    /**
+     * Where the sender reads the file from; empty on the receiver.
+     */
+    std::string path;
+
+    uint64_t size;
+
+    /**
+     * Where the file is in the data stream of the session.
+     */
+    uint64_t offset;
+};
+
+/**
+ * The data of a session on the sender: a manifest followed by many files,
+ * laid out as a single stream of bytes that is cut into segments like a
+ * single file would be. Segments that lie within a single file are encoded
+ * straight from the mapped file, so files spanning at least one segment
+ * start on a segment boundary when possible. Smaller files are packed
+ * together, in the gaps this leaves and after the large files, so that
+ * they share source blocks instead of paying for an encoder each.
+ */
+class SessionStream {
+  public:
+    /**
+     * Lays out the given files (name, path and size filled in) after their
+     * manifest.
+     */
+    SessionStream(const std::string& name, std::vector<SessionFile> files);
+
+    ~SessionStream();
+
+    const char* name() const
+    {
+        return sessionName.c_str();
+    }
+
+    /**
+     * Size of the stream in bytes, manifest included.
+     */
+    uint64_t size() const
+    {
+        return streamSize;
+    }
+
+    uint32_t numFiles() const
+    {
+        return downCast<uint32_t>(files.size());
+    }
+
+    /**
+     * Returns the data of each segment of SEGMENT_SIZE bytes of the stream
+     * (the last one may be shorter), reading the files that are not mapped.
+     * The data stays valid as long as the stream.
+     */
+    std::vector<std::pair<Alignment*, Alignment*>> segments();
+
+    SessionStream(const SessionStream&) = delete;
+    SessionStream& operator=(const SessionStream&) = delete;
+
+  private:
+    std::string sessionName;
+    std::vector<SessionFile> files;
+    std::vector<char> manifest;
+    uint64_t streamSize;
+
+    /**
+     * Files mapped in memory, with their sizes.
+     */
+    std::vector<std::pair<void*, size_t>> mappings;
+
+    /**
+     * Segments assembled in memory.
+     */
+    std::vector<std::unique_ptr<Alignment[]>> buffers;
+};
+
+/**
+ * Returns true if a name, relative to some directory, stays within that
+ * directory: it is not absolute and has no ".." component.
+ */
+bool isValidName(const std::string& name);
+
+/**
+ * Lists the regular files under a directory, recursively.
+ *
+ * \return
+ *      False if the directory cannot be read.
+ */
+bool listDirectory(const std::string& directory,
+                   std::vector<SessionFile>& files);
+
+/**
+ * Lists the files named in a list file, one path per line. Relative paths
+ * are relative to the directory of the list file, and are also the names
+ * of the files on the receiver.
+ *
+ * \return
+ *      False if the list cannot be read or names a file that cannot be
+ *      sent.
+ */
+bool readFileList(const std::string& listFile,
+                  std::vector<SessionFile>& files);
+
+/**
+ * Writes the files of a session decoded into a stream (mapped at stream,
+ * and open as streamFd) to a directory, as described by the manifest at
+ * the start of the stream.
+ *
+ * \return
+ *      False if the manifest is corrupted or a file cannot be written.
+ */
+bool extractSession(const char* directory,
+                    int streamFd,
+                    const char* stream,
+                    uint64_t streamSize);
+
+#endif /* SESSION_HH */
@@ -1,4 +1,8 @@
 #include <sys/socket.h>
+#include <netinet/udp.h>
+#include <linux/net_tstamp.h>
+#include <numeric>
+#include <vector>
 
 #include "socket.hh"
 #include "util.hh"
@@ -209,6 +213,228 @@ void UDPSocket::sendbytes( const char *payload, size_t length )
   }
 }
 
+/* most segments the kernel will split a single GSO send into */
+static const size_t MAX_GSO_SEGMENTS = 64;
+
+/* largest UDP payload of a single (GSO) send */
+static const size_t MAX_GSO_BYTES = 65507;
+
+/* total length of the iovecs_per_datagram iovecs of datagram i */
+static size_t datagram_length( const iovec * iovecs, const size_t iovecs_per_datagram,
+			       const size_t i )
+{
+  size_t length = 0;
+  for ( size_t j = 0; j < iovecs_per_datagram; j++ ) {
+    length += iovecs[ i * iovecs_per_datagram + j ].iov_len;
+  }
+  return length;
+}
+
+/* build the sendmmsg() vector for a batch of datagrams; with a GSO segment
+   size, runs of datagrams of exactly that size share one message (only the
+   last datagram of a run may be shorter). datagrams_per_message records how
+   many datagrams each message carries. With departure times, every message
+   carries its own in an SCM_TXTIME control message stored in control, and
+   only datagrams leaving at the same time can share a message. Each
+   datagram is gathered from iovecs_per_datagram consecutive iovecs. */
+static vector< mmsghdr > make_messages( const iovec * iovecs, const size_t count,
+					const size_t iovecs_per_datagram,
+					const uint16_t segment_size,
+					const uint64_t * txtimes,
+					vector< size_t > & datagrams_per_message,
+					vector< char > & control )
+{
+  vector< mmsghdr > messages;
+  messages.reserve( count );
+  datagrams_per_message.clear();
+  datagrams_per_message.reserve( count );
+  if ( txtimes ) {
+    control.assign( count * CMSG_SPACE( sizeof( uint64_t ) ), 0 );
+  }
+
+  size_t run_bytes = 0, previous_length = 0;
+  for ( size_t i = 0; i < count; i++ ) {
+    const size_t length = datagram_length( iovecs, iovecs_per_datagram, i );
+    const bool extend_run = segment_size > 0 and not messages.empty()
+      and datagrams_per_message.back() < MAX_GSO_SEGMENTS
+      and previous_length == segment_size
+      and run_bytes + length <= MAX_GSO_BYTES
+      and ( not txtimes or txtimes[ i ] == txtimes[ i - 1 ] );
+    previous_length = length;
+
+    if ( extend_run ) {
+      messages.back().msg_hdr.msg_iovlen += iovecs_per_datagram;
+      datagrams_per_message.back()++;
+      run_bytes += length;
+    } else {
+      mmsghdr message; zero( message );
+      message.msg_hdr.msg_iov = const_cast<iovec *>( &iovecs[ i * iovecs_per_datagram ] );
+      message.msg_hdr.msg_iovlen = iovecs_per_datagram;
+      if ( txtimes ) {
+	char * buffer = &control[ messages.size() * CMSG_SPACE( sizeof( uint64_t ) ) ];
+	message.msg_hdr.msg_control = buffer;
+	message.msg_hdr.msg_controllen = CMSG_SPACE( sizeof( uint64_t ) );
+	cmsghdr * cmsg = CMSG_FIRSTHDR( &message.msg_hdr );
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TXTIME;
+	cmsg->cmsg_len = CMSG_LEN( sizeof( uint64_t ) );
+	memcpy( CMSG_DATA( cmsg ), &txtimes[ i ], sizeof( uint64_t ) );
+      }
+      messages.push_back( message );
+      datagrams_per_message.push_back( 1 );
+      run_bytes = length;
+    }
+  }
+
+  return messages;
+}
+
+/* send a batch of datagrams to connected address */
+size_t UDPSocket::sendbatch( const iovec * iovecs, const size_t count,
+			     const uint64_t * txtimes,
+			     const size_t iovecs_per_datagram )
+{
+  vector< size_t > datagrams_per_message;
+  vector< char > control;
+  vector< mmsghdr > messages = make_messages( iovecs, count, iovecs_per_datagram,
+					      gso_segment_size_,
+					      txtime_ ? txtimes : nullptr,
+					      datagrams_per_message, control );
+
+  const int messages_sent = ::sendmmsg( fd_num(), messages.data(), messages.size(),
+					MSG_DONTWAIT );
+  if ( messages_sent < 0 ) {
+    if ( errno == EAGAIN or errno == EWOULDBLOCK ) {
+      return 0;
+    }
+    throw unix_error( "sendmmsg" );
+  }
+
+  register_write();
+
+  return accumulate( datagrams_per_message.begin(),
+		     datagrams_per_message.begin() + messages_sent, size_t( 0 ) );
+}
+
+/* let the kernel segment runs of same-sized datagrams */
+bool UDPSocket::set_gso_segment( const uint16_t segment_size )
+{
+  try {
+    setsockopt( SOL_UDP, UDP_SEGMENT, int( segment_size ) );
+  } catch ( const unix_error & ) {
+    return false;
+  }
+
+  gso_segment_size_ = segment_size;
+  return true;
+}
+
+/* let the kernel (fq or etf qdisc) hold each datagram until its departure time */
+bool UDPSocket::set_txtime( void )
+{
+  sock_txtime config;
+  zero( config );
+  config.clockid = CLOCK_MONOTONIC;
+  try {
+    setsockopt( SOL_SOCKET, SO_TXTIME, config );
+  } catch ( const unix_error & ) {
+    return false;
+  }
+
+  txtime_ = true;
+  return true;
+}
+
+/* room for one timestamp control message per datagram */
+static const size_t CONTROL_SIZE = CMSG_SPACE( sizeof( timespec ) );
+
+/* carve the slab into slot_count slots of slot_size bytes each */
+
+DatagramSlab::DatagramSlab( const size_t slot_size, const size_t slot_count )
+  : slot_size_( slot_size ),
+    buffer_( slot_size * slot_count ),
+    sources_( slot_count ),
+    controls_( CONTROL_SIZE * slot_count ),
+    iovecs_( slot_count ),
+    messages_( slot_count ),
+    size_( 0 ),
+    clock_offset_( 0 )
+{
+  for ( size_t i = 0; i < slot_count; i++ ) {
+    iovecs_[ i ].iov_base = &buffer_[ i * slot_size ];
+    iovecs_[ i ].iov_len = slot_size;
+    zero( messages_[ i ] );
+    messages_[ i ].msg_hdr.msg_iov = &iovecs_[ i ];
+    messages_[ i ].msg_hdr.msg_iovlen = 1;
+    messages_[ i ].msg_hdr.msg_name = &sources_[ i ];
+    messages_[ i ].msg_hdr.msg_control = &controls_[ i * CONTROL_SIZE ];
+  }
+}
+
+DatagramSlab::view DatagramSlab::operator[]( const size_t i ) const
+{
+  return { &buffer_[ i * slot_size_ ], messages_[ i ].msg_len };
+}
+
+Address DatagramSlab::source( const size_t i ) const
+{
+  return Address( sources_[ i ], messages_[ i ].msg_hdr.msg_namelen );
+}
+
+uint64_t DatagramSlab::timestamp( const size_t i ) const
+{
+  msghdr header = messages_[ i ].msg_hdr;
+  for ( cmsghdr * ts_hdr = CMSG_FIRSTHDR( &header ); ts_hdr;
+	ts_hdr = CMSG_NXTHDR( &header, ts_hdr ) ) {
+    if ( ts_hdr->cmsg_level == SOL_SOCKET
+	 and ts_hdr->cmsg_type == SO_TIMESTAMPNS ) {
+      timespec kernel_time;
+      memcpy( &kernel_time, CMSG_DATA( ts_hdr ), sizeof( kernel_time ) );
+      return ( kernel_time.tv_sec * 1000000 + kernel_time.tv_nsec / 1000 )
+	- clock_offset_;
+    }
+  }
+  return 0;
+}
+
+/* receive a batch of datagrams into the slab */
+static int recv_into( const int fd_num, vector< mmsghdr > & messages,
+		      int64_t & clock_offset )
+{
+  /* the kernel overwrites the length of each source address and of the
+     control messages */
+  for ( auto & message : messages ) {
+    message.msg_hdr.msg_namelen = sizeof( Address::raw );
+    message.msg_hdr.msg_controllen = CONTROL_SIZE;
+  }
+
+  const int received = ::recvmmsg( fd_num, messages.data(), messages.size(),
+				   MSG_WAITFORONE, nullptr );
+  if ( received < 0 ) {
+    throw unix_error( "recvmmsg" );
+  }
+
+  /* datagrams too large for their slot are returned empty rather than
+     throwing, which would lose the rest of the batch: recvmmsg() has
+     already consumed it */
+  for ( int i = 0; i < received; i++ ) {
+    if ( messages[ i ].msg_hdr.msg_flags & MSG_TRUNC ) {
+      messages[ i ].msg_len = 0;
+    }
+  }
+
+  clock_offset = realtime_offset_us();
+
+  return received;
+}
+
+size_t UDPSocket::recvbatch( DatagramSlab & slab )
+{
+  slab.size_ = recv_into( fd_num(), slab.messages_, slab.clock_offset_ );
+  register_read();
+  return slab.size_;
+}
+
 /* mark the socket as listening for incoming connections */
 void TCPSocket::listen( const int backlog )
 {
@@ -271,6 +497,52 @@ int DCCPSocket::send( const char* payload, int payload_len )
   return 0;
 }
 
+/* send a batch of datagrams to connected address */
+int DCCPSocket::sendbatch( const iovec * iovecs, const size_t count,
+			   const size_t iovecs_per_datagram )
+{
+  vector< size_t > datagrams_per_message;
+  vector< char > control;
+  vector< mmsghdr > messages = make_messages( iovecs, count, iovecs_per_datagram,
+					      0, nullptr, datagrams_per_message,
+					      control );
+
+  int messages_sent = ::sendmmsg( fd_num(), messages.data(), messages.size(), 0 );
+  if ( messages_sent < 0 ) {
+    return errno == EAGAIN ? -1 : -2;
+  }
+
+  for ( int i = 0; i < messages_sent; i++ ) {
+    if ( messages[ i ].msg_len != datagram_length( iovecs, iovecs_per_datagram, i ) ) {
+      throw runtime_error( "datagram payload too big for sendmmsg()" );
+    }
+  }
+
+  return messages_sent;
+}
+
+/* receive a batch of datagrams from connected address */
+size_t DCCPSocket::recvbatch( DatagramSlab & slab )
+{
+  const int received = recv_into( fd_num(), slab.messages_,
+				  slab.clock_offset_ );
+  register_read();
+
+  /* a zero-length message that was not truncated means the connection
+     has been closed */
+  slab.size_ = 0;
+  while ( slab.size_ < size_t( received )
+	  and ( slab.messages_[ slab.size_ ].msg_len > 0
+		or slab.messages_[ slab.size_ ].msg_hdr.msg_flags & MSG_TRUNC ) ) {
+    slab.size_++;
+  }
+  if ( slab.size_ < size_t( received ) or received == 0 ) {
+    set_eof();
+  }
+
+  return slab.size_;
+}
+
 /* receive datagram from connected address */
 char* DCCPSocket::recv( void )
 {
@@ -1,7 +1,12 @@
 #ifndef SOCKET_HH
 #define SOCKET_HH
 
+#include <cstdint>
 #include <functional>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "address.hh"
 #include "file_descriptor.hh"
@@ -40,11 +45,66 @@ public:
   void set_reuseaddr( void );
 };
 
+/* preallocated, reusable receive buffers filled by recvbatch() */
+class DatagramSlab
+{
+private:
+  size_t slot_size_;
+  std::vector< char > buffer_;
+  std::vector< Address::raw > sources_;
+  std::vector< char > controls_;
+  std::vector< iovec > iovecs_;
+  std::vector< mmsghdr > messages_;
+  size_t size_;
+
+  /* CLOCK_REALTIME minus CLOCK_MONOTONIC when the datagrams were received,
+     in microseconds */
+  int64_t clock_offset_;
+
+  friend class UDPSocket;
+  friend class DCCPSocket;
+
+public:
+  /* a received datagram; only valid until the next recvbatch(). A
+     datagram larger than a slot has a length of 0. */
+  struct view {
+    const char * payload;
+    size_t length;
+  };
+
+  DatagramSlab( const size_t slot_size, const size_t slot_count );
+
+  /* number of slots and number of datagrams held after the last recvbatch() */
+  size_t capacity( void ) const { return messages_.size(); }
+  size_t size( void ) const { return size_; }
+
+  view operator[]( const size_t i ) const;
+
+  /* where the i-th datagram came from (for unconnected sockets) */
+  Address source( const size_t i ) const;
+
+  /* when the kernel received the i-th datagram, on the scale of
+     timestamp_us(), or 0 if the socket does not timestamp datagrams
+     (see UDPSocket::set_timestamps()) */
+  uint64_t timestamp( const size_t i ) const;
+
+  /* forbid copying: the message headers point into the slab itself */
+  DatagramSlab( const DatagramSlab & other ) = delete;
+  DatagramSlab & operator=( const DatagramSlab & other ) = delete;
+};
+
 /* UDP socket */
 class UDPSocket : public Socket
 {
+private:
+  /* GSO segment size, or 0 if every datagram goes out on its own */
+  uint16_t gso_segment_size_;
+
+  /* whether sendbatch() passes departure times to the kernel */
+  bool txtime_;
+
 public:
-  UDPSocket() : Socket( AF_INET6, SOCK_DGRAM ) {}
+  UDPSocket() : Socket( AF_INET6, SOCK_DGRAM ), gso_segment_size_( 0 ), txtime_( false ) {}
 
   struct received_datagram {
     Address source_address;
@@ -56,6 +116,10 @@ public:
   /* receive datagram, timestamp, and where it came from */
   received_datagram recv( void );
 
+  /* receive up to slab.capacity() datagrams with one recvmmsg(), blocking
+     until at least one is available; returns the number received */
+  size_t recvbatch( DatagramSlab & slab );
+
   /* send datagram to specified address */
   void sendto( const Address & peer, const std::string & payload );
   void sendbytesto( const Address & peer, const char *payload, size_t length);
@@ -63,6 +127,23 @@ public:
   /* send datagram to connected address */
   void send( const std::string & payload );
   void sendbytes( const char *payload, size_t length);
+
+  /* send a batch of datagrams to connected address with one sendmmsg();
+     returns the number of datagrams accepted by the kernel (0 if the
+     socket buffer is full). After set_txtime(), txtimes (if given) holds
+     the departure time of each datagram in CLOCK_MONOTONIC nanoseconds.
+     Each datagram is gathered from iovecs_per_datagram consecutive iovecs. */
+  size_t sendbatch( const iovec * iovecs, const size_t count,
+		    const uint64_t * txtimes = nullptr,
+		    const size_t iovecs_per_datagram = 1 );
+
+  /* let the kernel split runs of datagrams of exactly segment_size bytes
+     (UDP GSO); returns false if the kernel does not support it */
+  bool set_gso_segment( const uint16_t segment_size );
+
+  /* have the qdisc (fq or etf) release each datagram at the departure time
+     given to sendbatch() (SO_TXTIME); returns false if unsupported */
+  bool set_txtime( void );
   
   /* turn on timestamps on receipt */
   void set_timestamps( void );
@@ -106,8 +187,19 @@ public:
   /* send datagram to connected address */
   int send( const char* payload, int payload_len );
 
+  /* send a batch of datagrams to connected address with one sendmmsg();
+     returns the number of datagrams sent, or the same error codes as send().
+     Each datagram is gathered from iovecs_per_datagram consecutive iovecs. */
+  int sendbatch( const iovec * iovecs, const size_t count,
+		 const size_t iovecs_per_datagram = 1 );
+
   /* receive datagram from connected address */
   char* recv( void );
+
+  /* receive up to slab.capacity() datagrams with one recvmmsg(), blocking
+     until at least one is available; returns the number received, or 0
+     (and marks EOF) once the connection has been closed */
+  size_t recvbatch( DatagramSlab & slab );
 };
 
 #endif /* SOCKET_HH */
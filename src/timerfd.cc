@@ -0,0 +1,31 @@
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "timerfd.hh"
+#include "util.hh"
+
+using namespace std;
+
+TimerFD::TimerFD()
+  : FileDescriptor( SystemCall( "timerfd_create", timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC ) ) )
+{}
+
+void TimerFD::set_interval( const chrono::nanoseconds & interval )
+{
+  itimerspec spec;
+  spec.it_interval.tv_sec = interval.count() / 1000000000;
+  spec.it_interval.tv_nsec = interval.count() % 1000000000;
+  spec.it_value = spec.it_interval;
+  SystemCall( "timerfd_settime", timerfd_settime( fd_num(), 0, &spec, nullptr ) );
+}
+
+uint64_t TimerFD::read_expirations( void )
+{
+  uint64_t expirations;
+  if ( SystemCall( "read", ::read( fd_num(), &expirations, sizeof( expirations ) ) )
+       != sizeof( expirations ) ) {
+    throw runtime_error( "read (short read from timerfd)" );
+  }
+  register_read();
+  return expirations;
+}
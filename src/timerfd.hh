@@ -0,0 +1,24 @@
+#ifndef TIMERFD_HH
+#define TIMERFD_HH
+
+#include <chrono>
+#include <cstdint>
+
+#include "file_descriptor.hh"
+
+/* timer that expires through a file descriptor (on CLOCK_MONOTONIC), so
+   that deadlines can wait in the same event loop as sockets */
+class TimerFD : public FileDescriptor
+{
+public:
+  TimerFD();
+
+  /* expire every interval from now on, or never if the interval is zero */
+  void set_interval( const std::chrono::nanoseconds & interval );
+
+  /* consume the expirations since the last call and return how many there
+     were; blocks until the next expiration if there were none */
+  uint64_t read_expirations( void );
+};
+
+#endif /* TIMERFD_HH */
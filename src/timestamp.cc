@@ -3,6 +3,9 @@
 #include "timestamp.hh"
 #include "util.hh"
 
+/* nanoseconds per microsecond */
+static const uint64_t THOUSAND = 1000;
+
 /* nanoseconds per millisecond */
 static const uint64_t MILLION = 1000000;
 
@@ -34,3 +37,18 @@ uint64_t timestamp_ms( const timespec & ts )
   const static uint64_t EPOCH = timestamp_ms_raw( current_time() );
   return timestamp_ms_raw( ts ) - EPOCH;
 }
+
+/* Current monotonic time in microseconds */
+uint64_t timestamp_us( void )
+{
+  timespec ts;
+  SystemCall( "clock_gettime", clock_gettime( CLOCK_MONOTONIC, &ts ) );
+  return ( ts.tv_sec * BILLION + ts.tv_nsec ) / THOUSAND;
+}
+
+int64_t realtime_offset_us( void )
+{
+  const timespec realtime = current_time();
+  return int64_t( ( realtime.tv_sec * BILLION + realtime.tv_nsec ) / THOUSAND )
+    - int64_t( timestamp_us() );
+}
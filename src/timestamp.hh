@@ -8,4 +8,12 @@
 uint64_t timestamp_ms( void );
 uint64_t timestamp_ms( const timespec & ts );
 
+/* Current monotonic time in microseconds */
+uint64_t timestamp_us( void );
+
+/* CLOCK_REALTIME minus CLOCK_MONOTONIC, in microseconds: subtracted from
+   kernel timestamps (e.g. SO_TIMESTAMPNS), it puts them on the scale of
+   timestamp_us() */
+int64_t realtime_offset_us( void );
+
 #endif /* TIMESTAMP_HH */
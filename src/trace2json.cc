@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "tracer.hh"
+
+/**
+ * Converts the trace files written with -t by the sender and the receiver
+ * into a single Chrome trace in JSON, to be loaded in chrome://tracing or
+ * Perfetto. Each file becomes a process. Both programs stamp events with
+ * CLOCK_MONOTONIC, so the traces of a sender and a receiver on the same
+ * host line up.
+ */
+
+using Tracer::Event;
+
+struct Trace {
+    Tracer::FileHeader header;
+    std::vector<Event> events;
+
+    Trace()
+        : header()
+        , events()
+    {}
+};
+
+void printUsage(char *command)
+{
+    std::cerr << "Usage: " << command << " TRACE... > trace.json" << std::endl;
+    std::cerr << "\tTRACE: file written by sender -t or receiver -t" << std::endl;
+}
+
+bool readTrace(const char* path, Trace& trace)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    if (fread(&trace.header, sizeof(trace.header), 1, file) != 1 ||
+            std::memcmp(trace.header.magic, Tracer::MAGIC,
+                        sizeof(Tracer::MAGIC)) != 0 ||
+            trace.header.version != Tracer::VERSION) {
+        std::cerr << path << ": not a trace file" << std::endl;
+        fclose(file);
+        return false;
+    }
+    trace.header.program[sizeof(trace.header.program) - 1] = 0;
+    Event event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        trace.events.push_back(event);
+    }
+    fclose(file);
+    return true;
+}
+
+/**
+ * Writes one event of the Chrome trace format, with the given arguments as
+ * a JSON object body (without the braces).
+ */
+void printEvent(bool& first, const char* phase, const char* name,
+                size_t pid, uint16_t tid, uint64_t time, uint64_t start,
+                const std::string& args)
+{
+    printf("%s\n{\"ph\":\"%s\",\"name\":\"%s\",\"pid\":%zu,\"tid\":%u,"
+           "\"ts\":%.3f%s,\"args\":{%s}}", first ? "" : ",", phase, name,
+           pid, static_cast<unsigned>(tid),
+           static_cast<double>(time - start) / 1000,
+           phase[0] == 'i' ? ",\"s\":\"t\"" : "", args.c_str());
+    first = false;
+}
+
+std::string packetArgs(const Event& event)
+{
+    uint32_t id = static_cast<uint32_t>(event.b);
+    char args[128];
+    snprintf(args, sizeof(args),
+             "\"seq\":%u,\"segment\":%u,\"sbn\":%u,\"esi\":%u",
+             event.a, static_cast<uint32_t>(event.b >> 32), id >> 24,
+             id & 0xffffff);
+    return args;
+}
+
+std::string numberArgs(const char* aName, uint64_t a, const char* bName,
+                       uint64_t b)
+{
+    char args[128];
+    if (bName) {
+        snprintf(args, sizeof(args), "\"%s\":%" PRIu64 ",\"%s\":%" PRIu64,
+                 aName, a, bName, b);
+    } else {
+        snprintf(args, sizeof(args), "\"%s\":%" PRIu64, aName, a);
+    }
+    return args;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argv[1][0] == '-') {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Trace> traces(argc - 1);
+    uint64_t start = UINT64_MAX;
+    for (int i = 1; i < argc; i++) {
+        if (!readTrace(argv[i], traces[i - 1])) {
+            return EXIT_FAILURE;
+        }
+        for (const Event& event : traces[i - 1].events) {
+            start = std::min(start, event.time);
+        }
+    }
+
+    bool first = true;
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (size_t i = 0; i < traces.size(); i++) {
+        const Trace& trace = traces[i];
+        size_t pid = i + 1;
+        printEvent(first, "M", "process_name", pid, 0, start, start,
+                   std::string("\"name\":\"") + trace.header.program + "\"");
+
+        // Symbols queued for each decoding worker, as a counter
+        std::map<uint32_t, int64_t> queueDepth;
+        uint64_t dropped = 0;
+        for (const Event& event : trace.events) {
+            switch (event.type) {
+                case Tracer::THREAD_NAME: {
+                    char name[13] = {};
+                    std::memcpy(name, &event.a, sizeof(event.a));
+                    std::memcpy(name + sizeof(event.a), &event.b,
+                                sizeof(event.b));
+                    printEvent(first, "M", "thread_name", pid, event.thread,
+                               start, start,
+                               std::string("\"name\":\"") + name + "\"");
+                    break;
+                }
+                case Tracer::PACKET_SENT:
+                    printEvent(first, "i", "send", pid, event.thread,
+                               event.time, start, packetArgs(event));
+                    break;
+                case Tracer::PACKET_RECEIVED:
+                    printEvent(first, "i", "recv", pid, event.thread,
+                               event.time, start, packetArgs(event));
+                    break;
+                case Tracer::SYMBOL_ENQUEUED:
+                case Tracer::SYMBOL_DEQUEUED: {
+                    bool enqueued = event.type == Tracer::SYMBOL_ENQUEUED;
+                    printEvent(first, "i", enqueued ? "enqueue" : "dequeue",
+                               pid, event.thread, event.time, start,
+                               numberArgs("worker", event.a, "block",
+                                          event.b));
+                    int64_t& depth = queueDepth[event.a];
+                    depth += enqueued ? 1 : -1;
+                    char name[32];
+                    snprintf(name, sizeof(name), "queue %u", event.a);
+                    printEvent(first, "C", name, pid, 0, event.time, start,
+                               numberArgs("symbols", uint64_t(std::max<
+                                          int64_t>(depth, 0)), nullptr, 0));
+                    break;
+                }
+                case Tracer::SYMBOL_ADDED:
+                    printEvent(first, "i", "add_symbol", pid, event.thread,
+                               event.time, start,
+                               numberArgs("id", event.a, "block", event.b));
+                    break;
+                case Tracer::DECODE_START:
+                    printEvent(first, "B", "decode", pid, event.thread,
+                               event.time, start,
+                               numberArgs("block", event.b, nullptr, 0));
+                    break;
+                case Tracer::DECODE_END:
+                    printEvent(first, "E", "decode", pid, event.thread,
+                               event.time, start,
+                               numberArgs("decoded", event.a, nullptr, 0));
+                    break;
+                case Tracer::ACK_SENT:
+                    printEvent(first, "i", "ack", pid, event.thread,
+                               event.time, start,
+                               numberArgs("first_undecoded", event.a,
+                                          "highest_seq", event.b));
+                    break;
+                case Tracer::ACK_RECEIVED:
+                    printEvent(first, "i", "ack", pid, event.thread,
+                               event.time, start,
+                               numberArgs("decoded", event.a, "highest_seq",
+                                          event.b));
+                    break;
+                case Tracer::PRECOMPUTE_START:
+                    printEvent(first, "B", "precompute", pid, event.thread,
+                               event.time, start,
+                               numberArgs("block", event.b, nullptr, 0));
+                    break;
+                case Tracer::PRECOMPUTE_END:
+                    printEvent(first, "E", "precompute", pid, event.thread,
+                               event.time, start, "");
+                    break;
+                case Tracer::EVENTS_DROPPED:
+                    printEvent(first, "i", "dropped", pid, event.thread,
+                               event.time, start,
+                               numberArgs("events", event.a, nullptr, 0));
+                    dropped += event.a;
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (dropped > 0) {
+            std::cerr << trace.header.program << ": " << dropped
+                      << " events were dropped" << std::endl;
+        }
+    }
+    printf("\n]}\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <vector>
+
+#include "ring_buffer.hh"
+#include "tracer.hh"
+
+namespace Tracer {
+
+std::atomic<bool> enabled(false);
+
+namespace {
+
+/**
+ * Number of events each thread can record before the writer drains them;
+ * about 1.5 MB per thread. At a million packets per second the writer has
+ * tens of milliseconds to catch up.
+ */
+const size_t EVENTS_PER_THREAD = 1 << 16;
+
+/**
+ * Time between two flushes of the rings to the file.
+ */
+const std::chrono::milliseconds FLUSH_INTERVAL(10);
+
+/**
+ * The ring of events of a thread. The thread is its producer, and the
+ * writer its consumer.
+ */
+struct Buffer {
+    uint16_t thread;
+    SpscRing<Event> events;
+
+    // Events dropped since the last one recorded; producer only
+    uint32_t dropped;
+
+    explicit Buffer(uint16_t thread)
+        : thread(thread)
+        , events(EVENTS_PER_THREAD)
+        , dropped(0)
+    {}
+};
+
+/**
+ * Protects buffers().
+ */
+std::mutex&
+buffersMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+/**
+ * The rings of all the threads that recorded events, indexed by thread.
+ * They live until the program exits, as their threads may still hold on to
+ * them.
+ */
+std::vector<std::unique_ptr<Buffer>>&
+buffers()
+{
+    static std::vector<std::unique_ptr<Buffer>> all;
+    return all;
+}
+
+thread_local Buffer* threadBuffer = nullptr;
+
+Buffer*
+registerThread()
+{
+    std::lock_guard<std::mutex> _(buffersMutex());
+    std::vector<std::unique_ptr<Buffer>>& all = buffers();
+    all.emplace_back(new Buffer(static_cast<uint16_t>(all.size())));
+    return all.back().get();
+}
+
+uint64_t
+now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+}
+
+void
+append(EventType type, uint32_t a, uint64_t b)
+{
+    if (!threadBuffer) {
+        threadBuffer = registerThread();
+    }
+    Buffer* buffer = threadBuffer;
+    uint64_t time = now();
+    if (buffer->dropped > 0) {
+        if (!buffer->events.tryEmplace(Event {time, EVENTS_DROPPED,
+                buffer->thread, buffer->dropped, 0})) {
+            buffer->dropped++;
+            return;
+        }
+        buffer->dropped = 0;
+    }
+    if (!buffer->events.tryEmplace(Event {time, type, buffer->thread, a,
+                                          b})) {
+        buffer->dropped++;
+        return;
+    }
+    buffer->events.publish();
+}
+
+void
+nameThread(const std::string& name)
+{
+    char packed[12] = {};
+    std::memcpy(packed, name.data(), std::min(name.size(), sizeof(packed)));
+    uint32_t a;
+    uint64_t b;
+    std::memcpy(&a, packed, sizeof(a));
+    std::memcpy(&b, packed + sizeof(a), sizeof(b));
+    record(THREAD_NAME, a, b);
+}
+
+Writer::Writer(const std::string& path, const char* program)
+    : file(fopen(path.c_str(), "w"))
+    , mutex()
+    , stopped()
+    , stopping(false)
+    , thread()
+{
+    if (!file) {
+        perror(path.c_str());
+        return;
+    }
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    strncpy(header.program, program, sizeof(header.program) - 1);
+    fwrite(&header, sizeof(header), 1, file);
+
+    enabled = true;
+    thread = std::thread(&Writer::flushLoop, this);
+}
+
+Writer::~Writer()
+{
+    if (!file) {
+        return;
+    }
+    enabled = false;
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        stopping = true;
+    }
+    stopped.notify_all();
+    thread.join();
+    flush();
+    fclose(file);
+}
+
+void
+Writer::flushLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopped.wait_for(lock, FLUSH_INTERVAL,
+                             [this] { return stopping; })) {
+        flush();
+    }
+}
+
+void
+Writer::flush()
+{
+    std::vector<Event> events;
+    {
+        std::lock_guard<std::mutex> _(buffersMutex());
+        for (auto& buffer : buffers()) {
+            buffer->events.consume([&events] (Event& event) {
+                events.push_back(event);
+            });
+        }
+    }
+    if (!events.empty()) {
+        fwrite(events.data(), sizeof(Event), events.size(), file);
+        fflush(file);
+    }
+}
+
+}
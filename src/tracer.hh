@@ -0,0 +1,174 @@
+#ifndef TRACER_HH
+#define TRACER_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Records what the threads of the sender and the receiver do, packet by
+ * packet, with little enough overhead to leave the timing of the transfer
+ * alone: each thread appends compact binary events, stamped with
+ * CLOCK_MONOTONIC in nanoseconds, to a lock-free ring of its own, and a
+ * Writer drains the rings to a file from a thread of its own. trace2json
+ * turns the file into a Chrome trace (chrome://tracing, Perfetto).
+ *
+ * When no Writer is running, recording an event costs a relaxed load and a
+ * branch.
+ */
+namespace Tracer {
+
+enum EventType : uint16_t {
+    // The name of the thread, up to 12 characters in a and b
+    THREAD_NAME         = 0,
+
+    // A data packet handed to the kernel, or received: a is its sequence
+    // number, and b its segment (high 32 bits) and symbol id
+    PACKET_SENT         = 1,
+    PACKET_RECEIVED     = 2,
+
+    // A symbol passed to a decoding worker, or taken by it: a is the
+    // worker, and b the block
+    SYMBOL_ENQUEUED     = 3,
+    SYMBOL_DEQUEUED     = 4,
+
+    // A symbol the decoder took in: a is its id, and b the block
+    SYMBOL_ADDED        = 5,
+
+    // A decoding attempt on block b; a is 1 at the end if it succeeded
+    DECODE_START        = 6,
+    DECODE_END          = 7,
+
+    // An ACK: a is the number of blocks decoded (received) or the first
+    // block not decoded (sent), and b the highest sequence number it
+    // accounts for
+    ACK_SENT            = 8,
+    ACK_RECEIVED        = 9,
+
+    // Precomputation of the intermediate symbols of block b
+    PRECOMPUTE_START    = 10,
+    PRECOMPUTE_END      = 11,
+
+    // The ring of the thread was full: a events were dropped before this
+    // one
+    EVENTS_DROPPED      = 12,
+};
+
+struct Event {
+    uint64_t time;
+    uint16_t type;
+
+    // Index of the thread that recorded the event, in the order the
+    // threads recorded their first event
+    uint16_t thread;
+
+    uint32_t a;
+    uint64_t b;
+};
+
+/**
+ * Start of a trace file, followed by Events until the end of the file.
+ */
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+
+    // Name of the program that wrote the trace
+    char program[20];
+};
+
+static const char MAGIC[8] = {'R', 'Q', 'T', 'R', 'A', 'C', 'E', 0};
+static const uint32_t VERSION = 1;
+
+/**
+ * Whether a Writer is running. Use record() instead.
+ */
+extern std::atomic<bool> enabled;
+
+void append(EventType type, uint32_t a, uint64_t b);
+
+/**
+ * Records an event on behalf of the calling thread if tracing is on.
+ * Thread-safe and lock-free; the event is dropped if the ring of the
+ * thread is full.
+ */
+inline void
+record(EventType type, uint32_t a = 0, uint64_t b = 0)
+{
+    if (enabled.load(std::memory_order_relaxed)) {
+        append(type, a, b);
+    }
+}
+
+/**
+ * Whether tracing is on; for callers that would do work just to record
+ * events.
+ */
+inline bool
+active()
+{
+    return enabled.load(std::memory_order_relaxed);
+}
+
+/**
+ * Names the calling thread in the trace, e.g. "network" or "decoder 3".
+ */
+void nameThread(const std::string& name);
+
+/**
+ * Turns tracing on for its lifetime, and writes the events recorded in the
+ * meantime to a file every few milliseconds. At most one Writer may exist
+ * at a time.
+ */
+class Writer {
+  public:
+    /**
+     * \param path
+     *      File to write to; truncated.
+     * \param program
+     *      Name of the program, recorded in the header of the file.
+     */
+    Writer(const std::string& path, const char* program);
+
+    /**
+     * Turns tracing off and writes the events left.
+     */
+    ~Writer();
+
+    /**
+     * \return
+     *      False if the file could not be opened, in which case tracing
+     *      stays off.
+     */
+    bool ok() const { return file != nullptr; }
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+  private:
+    void flushLoop();
+
+    /**
+     * Writes the events published so far by all the threads.
+     */
+    void flush();
+
+    FILE* file;
+
+    /**
+     * Wakes up the flushing thread when the writer is destroyed.
+     */
+    std::mutex mutex;
+    std::condition_variable stopped;
+    bool stopping;
+
+    std::thread thread;
+};
+
+}
+
+#endif /* TRACER_HH */
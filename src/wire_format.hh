@@ -1,6 +1,7 @@
 #ifndef WIREFORMAT_HH
 #define WIREFORMAT_HH
 
+#include <cstddef>
 #include <RaptorQ.hpp>
 
 #include "common.hh"
@@ -13,15 +14,16 @@ enum Opcode : uint8_t {
     HANDSHAKE_RESP      = 6,
     DATA_PACKET         = 7,
     ACK                 = 8,
+    EXTENDED_ACK        = 9,
 };
 
 struct Header {
     Opcode opcode;
 };
 
-Opcode getOpcode(char* datagram) {
+inline Opcode getOpcode(const char* datagram) {
     if (datagram)
-        return *((Opcode*)datagram);
+        return *((const Opcode*)datagram);
     else
         return EMPTY;
 }
@@ -31,67 +33,297 @@ struct HandshakeReq {
     uint32_t connectionId;
     char fileName[MAX_FILENAME_LEN];
     size_t fileSize;
+
+    // 0 to transfer a single file of fileSize bytes. Otherwise, the number
+    // of files of a session: the data is then a stream of fileSize bytes
+    // that starts with a manifest (see ManifestHeader) telling where each
+    // file is in the stream, and fileName names the directory they go to.
+    uint32_t numFiles;
+
+    // Segment table: the file is split into numSegments segments of
+    // segmentSize bytes (the last one may be shorter), each encoded on its
+    // own. All segments but the last share the same encoding parameters.
+    uint64_t segmentSize;
+    uint32_t numSegments;
     RaptorQ::OTI_Common_Data otiCommon;
     RaptorQ::OTI_Scheme_Specific_Data otiScheme;
+    RaptorQ::OTI_Common_Data lastOtiCommon;
+    RaptorQ::OTI_Scheme_Specific_Data lastOtiScheme;
 
     HandshakeReq(uint32_t connectionId,
                  const char* fileName,
                  size_t fileSize,
+                 uint32_t numFiles,
+                 uint64_t segmentSize,
+                 uint32_t numSegments,
                  RaptorQ::OTI_Common_Data otiCommon,
-                 RaptorQ::OTI_Scheme_Specific_Data otiScheme)
+                 RaptorQ::OTI_Scheme_Specific_Data otiScheme,
+                 RaptorQ::OTI_Common_Data lastOtiCommon,
+                 RaptorQ::OTI_Scheme_Specific_Data lastOtiScheme)
         : header {HANDSHAKE_REQ}
         , connectionId(connectionId)
         , fileSize(fileSize)
+        , numFiles(numFiles)
+        , segmentSize(segmentSize)
+        , numSegments(numSegments)
         , otiCommon(otiCommon)
         , otiScheme(otiScheme)
+        , lastOtiCommon(lastOtiCommon)
+        , lastOtiScheme(lastOtiScheme)
     {
         std::strcpy(this->fileName, fileName);
     }
+
+    RaptorQ::OTI_Common_Data segmentOtiCommon(uint32_t segment) const
+    {
+        return segment + 1 == numSegments ? lastOtiCommon : otiCommon;
+    }
+
+    RaptorQ::OTI_Scheme_Specific_Data segmentOtiScheme(uint32_t segment) const
+    {
+        return segment + 1 == numSegments ? lastOtiScheme : otiScheme;
+    }
+} __attribute__((packed));
+
+/**
+ * The manifest of a session. It is not sent in a datagram of its own but
+ * makes the first bytes of the data stream, so that it is protected by the
+ * erasure code like the files. It is followed by numFiles ManifestEntry,
+ * then by the names of the files back to back.
+ */
+struct ManifestHeader {
+    uint32_t numFiles;
+
+    // Total length of the names
+    uint64_t namesSize;
+} __attribute__((packed));
+
+struct ManifestEntry {
+    // Where the file is in the data stream
+    uint64_t offset;
+    uint64_t size;
+
+    // Length of the name of the file, a path relative to the directory of
+    // the session
+    uint16_t nameLength;
 } __attribute__((packed));
 
 struct HandshakeResp {
     Header header;
     uint32_t connectionId;
 
-    HandshakeResp(uint32_t connectionId)
+    // Number of blocks the receiver accepts symbols for at first, from
+    // block 0 on; see Ack::windowEnd
+    uint32_t blockWindow;
+
+    HandshakeResp(uint32_t connectionId, uint32_t blockWindow)
         : header {HANDSHAKE_RESP}
         , connectionId(connectionId)
+        , blockWindow(blockWindow)
     {}
 } __attribute__((packed));
 
 struct DataPacket {
     Header header;
+
+    // Tells apart the transfers a receiver serves at the same time
+    uint32_t connectionId;
+
+    // Segment of the file the symbol belongs to, and the symbol id within
+    // the encoding of that segment (8-bit sbn followed by 24-bit esi)
+    uint32_t segment;
     uint32_t id;
+
+    // Transmission sequence number and send time (in microseconds of the
+    // sender's monotonic clock), stamped right before the packet is handed
+    // to the kernel; echoed back in ACKs for congestion control
+    uint32_t seq;
+    uint64_t sendTime;
+
     char raw[SYMBOL_SIZE];
 
-    DataPacket(uint32_t id, void* data)
+    DataPacket(uint32_t connectionId, uint32_t segment, uint32_t id,
+               const void* data)
         : header {DATA_PACKET}
+        , connectionId(connectionId)
+        , segment(segment)
         , id(id)
+        , seq(0)
+        , sendTime(0)
     {
         std::memcpy(raw, data, SYMBOL_SIZE);
     }
+
+    // Leaves the symbol for the caller to fill in, or to send from where
+    // it is
+    DataPacket(uint32_t connectionId, uint32_t segment, uint32_t id)
+        : header {DATA_PACKET}
+        , connectionId(connectionId)
+        , segment(segment)
+        , id(id)
+        , seq(0)
+        , sendTime(0)
+    {}
+} __attribute__((packed));
+
+/**
+ * Feedback about the data packets received so far, from which the sender
+ * derives the congestion signals it feeds to its CongestionController.
+ */
+struct CongestionFeedback {
+    // Highest DataPacket::seq received
+    uint32_t highestSeq;
+
+    // Total number of data packets received
+    uint32_t packetsReceived;
+
+    // DataPacket::sendTime of packet highestSeq; 0 if this feedback is empty
+    uint64_t echoSendTime;
+
+    // Time packet highestSeq was received, in microseconds of the
+    // receiver's monotonic clock: when the kernel received it if the
+    // receiver's socket timestamps datagrams
+    uint64_t recvTime;
+
+    // Time between recvTime and the sending of this feedback, in
+    // microseconds: how long the receiver held on to the packet, which is
+    // not part of the round-trip time of the path
+    uint32_t ackDelay;
 } __attribute__((packed));
 
 struct Ack {
     Header header;
+    uint32_t connectionId;
 
-    // RaptorQ supports at most 256 blocks
+    // Blocks are numbered across segments. All blocks before firstBlock (a
+    // multiple of 64) are decoded, and bit j of bitmask[i] tells whether
+    // block firstBlock + 64 * i + j is; later blocks are reported in later
+    // ACKs, once the blocks before them are decoded.
+    uint32_t firstBlock;
     uint64_t bitmask[4];
 
-    // How many source symbols should be sent before start sending another
-    // round of repair symbols for previous blocks; this parameter is derived
-    // from the packet loss rate observed by the receiver during the
-    // transmission of the last decoded block.
-    uint32_t repairSymbolInterval;
+    // The receiver drops the symbols of blocks from windowEnd on, to bound
+    // its memory; the sender holds them back until the window moves on
+    uint32_t windowEnd;
+
+    // Only filled in ACKs sent over UDP from the receiving thread
+    CongestionFeedback feedback;
 
-    Ack(std::array<std::bitset<64>, 4> bitset, uint32_t repairSymbolInterval)
+    Ack(uint32_t connectionId, uint32_t firstBlock,
+        const std::vector<uint64_t>& words, uint32_t windowEnd,
+        const CongestionFeedback& feedback = CongestionFeedback())
         : header {ACK}
-        , bitmask {bitset[0].to_ullong(),
-                   bitset[1].to_ullong(),
-                   bitset[2].to_ullong(),
-                   bitset[3].to_ullong()}
-        , repairSymbolInterval(repairSymbolInterval)
-    {}
+        , connectionId(connectionId)
+        , firstBlock(firstBlock)
+        , bitmask {0, 0, 0, 0}
+        , windowEnd(windowEnd)
+        , feedback(feedback)
+    {
+        for (size_t i = 0; i < std::min<size_t>(words.size(), 4); i++) {
+            bitmask[i] = words[i];
+        }
+    }
+
+    bool decoded(size_t offset) const
+    {
+        return (bitmask[offset / 64] >> (offset % 64)) & 1;
+    }
+} __attribute__((packed));
+
+/**
+ * An Ack that also tells how many symbols the receiver has of the blocks it
+ * is still receiving; sent in place of the ACKs that carry feedback. Only
+ * the first length() bytes are sent.
+ */
+struct ExtendedAck {
+    // Its header says EXTENDED_ACK
+    Ack ack;
+
+    // Fraction of the data packets lost lately, in 1/65536ths
+    uint16_t lossRate;
+
+    // Number of symbols received for each block from ack.firstBlock on that
+    // ack.bitmask does not report decoded, up to the last block any symbol
+    // was received for; like the feedback, they account for all data
+    // packets up to ack.feedback.highestSeq. Each is encoded as its
+    // difference from the previous one (or from 0), zigzag-encoded as a
+    // varint, and they take up countsLength bytes.
+    uint16_t countsLength;
+    uint8_t counts[3 * 64 * 4];
+
+    ExtendedAck(const Ack& ack, uint16_t lossRate,
+                const std::vector<uint16_t>& received)
+        : ack(ack)
+        , lossRate(lossRate)
+        , countsLength(0)
+        , counts()
+    {
+        this->ack.header.opcode = EXTENDED_ACK;
+        int32_t previous = 0;
+        for (size_t i = 0; i < std::min<size_t>(received.size(), 64 * 4);
+                i++) {
+            if (ack.decoded(i)) {
+                continue;
+            }
+            int32_t delta = int32_t(received[i]) - previous;
+            uint32_t zigzag = (uint32_t(delta) << 1) ^ uint32_t(delta >> 31);
+            previous = received[i];
+            do {
+                counts[countsLength++] = uint8_t(zigzag & 0x7f) |
+                                         (zigzag > 0x7f ? 0x80 : 0);
+                zigzag >>= 7;
+            } while (zigzag > 0);
+        }
+    }
+
+    size_t length() const
+    {
+        return offsetof(ExtendedAck, counts) + countsLength;
+    }
+
+    /**
+     * Decodes the symbol counts.
+     *
+     * \param datagramLength
+     *      Size of the datagram the ACK came in; counts past it are ignored.
+     * \return
+     *      The number of symbols received for each block from
+     *      ack.firstBlock on, or -1 for the decoded ones.
+     */
+    std::vector<int> symbolCounts(size_t datagramLength) const
+    {
+        size_t end = std::min<size_t>(countsLength, sizeof(counts));
+        if (datagramLength < length()) {
+            end = datagramLength > offsetof(ExtendedAck, counts)
+                    ? datagramLength - offsetof(ExtendedAck, counts) : 0;
+        }
+        // No symbols for the blocks past the counts
+        std::vector<int> result(64 * 4, 0);
+        for (size_t i = 0; i < 4; i++) {
+            uint64_t word = ack.bitmask[i];
+            for (; word != 0; word &= word - 1) {
+                result[64 * i + size_t(__builtin_ctzll(word))] = -1;
+            }
+        }
+        int32_t previous = 0;
+        size_t position = 0;
+        for (size_t i = 0; i < result.size() && position < end; i++) {
+            if (result[i] < 0) {
+                continue;
+            }
+            uint32_t zigzag = 0;
+            for (int shift = 0; position < end && shift < 21; shift += 7) {
+                uint8_t byte = counts[position++];
+                zigzag |= uint32_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            previous += int32_t(zigzag >> 1) ^ -int32_t(zigzag & 1);
+            result[i] = std::max(previous, 0);
+        }
+        return result;
+    }
 } __attribute__((packed));
 
 }
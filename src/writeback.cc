@@ -0,0 +1,93 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "writeback.hh"
+
+Writeback::Writeback(int fd, const void* mapStart, size_t budget)
+    : fd(fd)
+    , mapStart(static_cast<const char*>(mapStart))
+    , budget(budget)
+    , pageSize(static_cast<uint64_t>(sysconf(_SC_PAGESIZE)))
+    , mutex()
+    , enabled(true)
+    , pending()
+    , pendingBytes(0)
+{}
+
+void
+Writeback::add(const void* begin, const void* end)
+{
+    Range range {static_cast<uint64_t>(static_cast<const char*>(begin) -
+                                       mapStart),
+                 static_cast<uint64_t>(static_cast<const char*>(end) -
+                                       static_cast<const char*>(begin))};
+    std::vector<Range> oldest;
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        if (!enabled) {
+            return;
+        }
+        pending.push_back(range);
+        pendingBytes += range.length;
+        while (pendingBytes > budget) {
+            oldest.push_back(pending.front());
+            pendingBytes -= pending.front().length;
+            pending.pop_front();
+        }
+    }
+
+    // Disk I/O is done without the lock, so that the other decoding
+    // threads keep going while one of them waits for the oldest blocks
+    if (sync_file_range(fd, range.offset, range.length,
+                        SYNC_FILE_RANGE_WRITE) != 0) {
+        disable("sync_file_range");
+        return;
+    }
+    for (const Range& older : oldest) {
+        if (!release(older)) {
+            return;
+        }
+    }
+}
+
+bool
+Writeback::release(const Range& range)
+{
+    if (sync_file_range(fd, range.offset, range.length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+        disable("sync_file_range");
+        return false;
+    }
+
+    // Only drop the pages entirely within the range: the pages it shares
+    // with neighbouring blocks may still be written to
+    uint64_t first = (range.offset + pageSize - 1) / pageSize * pageSize;
+    uint64_t last = (range.offset + range.length) / pageSize * pageSize;
+    if (first < last) {
+        madvise(const_cast<char*>(mapStart + first), last - first,
+                MADV_DONTNEED);
+        posix_fadvise(fd, first, last - first, POSIX_FADV_DONTNEED);
+    }
+    return true;
+}
+
+void
+Writeback::disable(const char* reason)
+{
+    int error = errno;
+    std::lock_guard<std::mutex> _(mutex);
+    if (!enabled) {
+        return;
+    }
+    printf("%s failed: %s; writing the file back at the end\n", reason,
+           strerror(error));
+    enabled = false;
+    pending.clear();
+    pendingBytes = 0;
+}
@@ -0,0 +1,85 @@
+#ifndef WRITEBACK_HH
+#define WRITEBACK_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+/**
+ * Writes the decoded blocks of a file mapped with MAP_SHARED back to disk
+ * as soon as each block is decoded, instead of leaving the whole file dirty
+ * until the final msync(). Writeback of a block starts right away; once
+ * more than a budget of bytes is being written back, the oldest blocks are
+ * waited for and dropped from memory. This bounds the dirty pages and the
+ * page cache the transfer holds, and leaves next to nothing for the final
+ * msync().
+ */
+class Writeback {
+  public:
+    /**
+     * \param fd
+     *      The file being written.
+     * \param mapStart
+     *      Where the file is mapped.
+     * \param budget
+     *      Number of bytes written back at a time before blocks are waited
+     *      for.
+     */
+    Writeback(int fd, const void* mapStart, size_t budget);
+
+    /**
+     * Starts writing back the bytes in [begin, end) of the mapping, and
+     * waits for older blocks if over budget. Thread-safe; may block the
+     * caller on disk I/O.
+     */
+    void add(const void* begin, const void* end);
+
+    Writeback(const Writeback&) = delete;
+    Writeback& operator=(const Writeback&) = delete;
+
+  private:
+    /**
+     * Byte range of the file.
+     */
+    struct Range {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    /**
+     * Waits for the writeback of a range, then drops its pages from the
+     * mapping and the page cache. Called without the lock.
+     *
+     * \return
+     *      False if writeback failed and was disabled.
+     */
+    bool release(const Range& range);
+
+    /**
+     * Gives up on writing back early, e.g. on a file system that does not
+     * support sync_file_range(); the final msync() still writes everything.
+     * Called without the lock.
+     */
+    void disable(const char* reason);
+
+    const int fd;
+    const char* const mapStart;
+    const size_t budget;
+    const uint64_t pageSize;
+
+    /**
+     * Protects everything below.
+     */
+    std::mutex mutex;
+
+    bool enabled;
+
+    /**
+     * Ranges being written back, oldest first, and their total length.
+     */
+    std::deque<Range> pending;
+    uint64_t pendingBytes;
+};
+
+#endif /* WRITEBACK_HH */
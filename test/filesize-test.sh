@@ -54,7 +54,10 @@ do
     sudo ip route add 100.64.0.4/32 dev $DEV
 
     # run sender
-    TIME=$( { time ../build/sender 100.64.0.4 /tmp/sent/$FILENAME > /dev/null ; } 2>&1 )
+    # the last line of the metrics is written at exit; its elapsed_ms
+    # column is the duration of the transfer
+    ../build/sender 100.64.0.4 /tmp/sent/$FILENAME -M sender-metrics.csv > /dev/null
+    TIME=$(tail -n 1 sender-metrics.csv | awk -F, '{ print $3 / 1000 }')
     echo -e "tornado\t${FILESIZE}\t${TIME}"
     echo -e "${FILESIZE},${TIME}" >> tor-filesize-test.log
 